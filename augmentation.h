@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace
+{
+
+	/*
+	* Augmentation policy of tree nodes which keeps nothing
+	*/
+	struct NoAugmentation
+	{
+		template<typename KeyType, typename ValueType>
+		struct Data
+		{
+			void update(const Data*, const Data*, const KeyType&, const ValueType&) {}
+		};
+	};
+
+	/*
+	* Augmentation policy which keeps a Merkle digest of subtrees: a hash of the key, the value and the digests
+	* of both children. Trees of the same shape with equal contents have equal digests, so versions are
+	* compared in O(1) and diffs skip subtrees with equal digests. Requires std::hash of keys and values,
+	* digests are stable between processes using the same std::hash
+	*/
+	struct MerkleDigest
+	{
+		template<typename KeyType, typename ValueType>
+		struct Data
+		{
+			void update(const Data* pLeft, const Data* pRight, const KeyType& key, const ValueType& value)
+			{
+				std::uint64_t digest = mix(std::hash<KeyType>()(key));
+				digest = mix(digest ^ std::hash<ValueType>()(value));
+				digest = mix(digest ^ Data::digest(pLeft));
+				m_digest = mix(digest ^ Data::digest(pRight));
+			}
+
+			static std::uint64_t digest(const Data* pData)
+			{
+				return pData == nullptr ? 0 : pData->m_digest;
+			}
+
+			std::uint64_t m_digest = 0;
+
+		private:
+			static std::uint64_t mix(std::uint64_t hash)
+			{
+				hash += 0x9e3779b97f4a7c15ULL;
+				hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+				return hash ^ (hash >> 31);
+			}
+		};
+	};
+
+}
@@ -0,0 +1,394 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "node_allocator.h"
+
+/*
+* Reference counter policy for nodes shared between threads
+*/
+struct AtomicRefCount
+{
+	using CounterType = std::atomic<int>;
+
+	static void increment(CounterType& counter)
+	{
+		counter.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static bool decrement(CounterType& counter)
+	{
+		return counter.fetch_sub(1, std::memory_order_acq_rel) == 1;
+	}
+
+	static int load(const CounterType& counter)
+	{
+		return counter.load(std::memory_order_acquire);
+	}
+};
+
+/*
+* Reference counter policy for containers used by a single thread, avoids atomic operations
+*/
+struct PlainRefCount
+{
+	using CounterType = int;
+
+	static void increment(CounterType& counter)
+	{
+		++counter;
+	}
+
+	static bool decrement(CounterType& counter)
+	{
+		return --counter == 0;
+	}
+
+	static int load(const CounterType& counter)
+	{
+		return counter;
+	}
+};
+
+/*
+* Base of nodes owned through IntrusivePtr, keeps the reference counter inside the node
+* and takes node memory from the Allocator policy
+*/
+template<typename RefCountPolicy, typename Allocator = HeapAllocator>
+class RefCounted
+{
+public:
+	static void* operator new(std::size_t size)
+	{
+		allocatedNodeBytes() += size;
+		return Allocator::allocate(size);
+	}
+
+	static void operator delete(void* p, std::size_t size)
+	{
+		Allocator::deallocate(p, size);
+	}
+
+	RefCounted() :
+		m_refCount(0)
+	{}
+
+	RefCounted(const RefCounted&) :
+		m_refCount(0)
+	{}
+
+	RefCounted& operator=(const RefCounted&)
+	{
+		return *this;
+	}
+
+	int useCount() const
+	{
+		return RefCountPolicy::load(m_refCount);
+	}
+
+	void addRef() const
+	{
+		RefCountPolicy::increment(m_refCount);
+	}
+
+	bool releaseRef() const
+	{
+		return RefCountPolicy::decrement(m_refCount);
+	}
+
+private:
+	mutable typename RefCountPolicy::CounterType m_refCount;
+};
+
+/*
+* Destroys nodes whose last reference is gone. Children released while a node is destroyed
+* are queued instead of being destroyed recursively, so dropping a long list or a degenerate
+* tree doesn't overflow the stack. With a limit set, a release destroys at most that many
+* queued nodes and the rest waits for the next release or for drain, which bounds the pause
+* caused by dropping a version. The queue is per thread, like slab pools.
+*/
+class NodeReclaimer
+{
+public:
+	template<typename T>
+	static void retire(T* p)
+	{
+		// nodes released by static containers after the thread's queue is gone are destroyed directly
+		if (phase() == DESTROYED)
+		{
+			deleteNode(p, 0);
+			return;
+		}
+
+		State& state = local();
+		if (state.m_isDraining || state.m_maxNodes != 0)
+		{
+			state.m_aNodes.push_back(Entry{ p, &destroy<T> });
+			if (!state.m_isDraining)
+				drain(state, state.m_maxNodes);
+			return;
+		}
+
+		state.m_isDraining = true;
+		deleteNode(p, 0);
+		drain(state, ~std::size_t(0));
+	}
+
+	/**
+	* Sets number of nodes destroyed per release, 0 destroys all released nodes at once
+	* @param maxNodes
+	*/
+	static void setLimit(std::size_t maxNodes)
+	{
+		local().m_maxNodes = maxNodes;
+	}
+
+	/**
+	* Destroys up to maxNodes queued nodes of the current thread, e.g. when it is idle
+	* @param maxNodes
+	* @return number of nodes left in the queue
+	*/
+	static std::size_t drain(std::size_t maxNodes = ~std::size_t(0))
+	{
+		if (phase() == DESTROYED)
+			return 0;
+
+		State& state = local();
+		if (state.m_isDraining)
+			return state.m_aNodes.size();
+
+		return drain(state, maxNodes);
+	}
+
+private:
+	struct Entry
+	{
+		void* m_p;
+		void (*m_destroy)(void*);
+	};
+
+	enum Phase
+	{
+		NOT_CREATED,
+		CREATED,
+		DESTROYED
+	};
+
+	struct State
+	{
+		State()
+		{
+			phase() = CREATED;
+		}
+
+		~State()
+		{
+			NodeReclaimer::drain(*this, ~std::size_t(0));
+			phase() = DESTROYED;
+		}
+
+		std::vector<Entry> m_aNodes;
+		std::size_t m_maxNodes = 0;
+		bool m_isDraining = false;
+	};
+
+	template<typename T>
+	static void destroy(void* p)
+	{
+		deleteNode(static_cast<T*>(p), 0);
+	}
+
+	/*
+	* Nodes allocated with trailing entries, whose size delete doesn't know, are destroyed by their static destroy
+	*/
+	template<typename T>
+	static auto deleteNode(T* p, int) -> decltype(T::destroy(p))
+	{
+		T::destroy(p);
+	}
+
+	template<typename T>
+	static void deleteNode(T* p, long)
+	{
+		delete p;
+	}
+
+	static std::size_t drain(State& state, std::size_t maxNodes)
+	{
+		state.m_isDraining = true;
+		for (std::size_t i = 0; i < maxNodes && !state.m_aNodes.empty(); i++)
+		{
+			Entry entry = state.m_aNodes.back();
+			state.m_aNodes.pop_back();
+			entry.m_destroy(entry.m_p);
+		}
+		state.m_isDraining = false;
+		return state.m_aNodes.size();
+	}
+
+	static State& local()
+	{
+		thread_local State s_state;
+		return s_state;
+	}
+
+	static Phase& phase()
+	{
+		thread_local Phase s_phase = NOT_CREATED;
+		return s_phase;
+	}
+};
+
+/*
+* Smart pointer to node derived from RefCounted, mirrors the parts of std::shared_ptr used by containers
+*/
+template<typename T>
+class IntrusivePtr
+{
+public:
+	IntrusivePtr() :
+		m_p(nullptr)
+	{}
+
+	IntrusivePtr(std::nullptr_t) :
+		m_p(nullptr)
+	{}
+
+	explicit IntrusivePtr(T* p) :
+		m_p(p)
+	{
+		if (m_p != nullptr)
+			m_p->addRef();
+	}
+
+	IntrusivePtr(const IntrusivePtr& other) :
+		m_p(other.m_p)
+	{
+		if (m_p != nullptr)
+			m_p->addRef();
+	}
+
+	IntrusivePtr(IntrusivePtr&& other) :
+		m_p(other.m_p)
+	{
+		other.m_p = nullptr;
+	}
+
+	template<typename U>
+	IntrusivePtr(const IntrusivePtr<U>& other) :
+		IntrusivePtr(other.get())
+	{}
+
+	~IntrusivePtr()
+	{
+		release(m_p);
+	}
+
+	IntrusivePtr& operator=(const IntrusivePtr& other)
+	{
+		IntrusivePtr(other).swap(*this);
+		return *this;
+	}
+
+	IntrusivePtr& operator=(IntrusivePtr&& other)
+	{
+		IntrusivePtr(std::move(other)).swap(*this);
+		return *this;
+	}
+
+	IntrusivePtr& operator=(std::nullptr_t)
+	{
+		reset();
+		return *this;
+	}
+
+	void reset()
+	{
+		T* p = m_p;
+		m_p = nullptr;
+		release(p);
+	}
+
+	void swap(IntrusivePtr& other)
+	{
+		std::swap(m_p, other.m_p);
+	}
+
+	T* get() const
+	{
+		return m_p;
+	}
+
+	T* operator->() const
+	{
+		return m_p;
+	}
+
+	T& operator*() const
+	{
+		return *m_p;
+	}
+
+	explicit operator bool() const
+	{
+		return m_p != nullptr;
+	}
+
+	int use_count() const
+	{
+		return m_p == nullptr ? 0 : m_p->useCount();
+	}
+
+private:
+	static void release(T* p)
+	{
+		if (p != nullptr && p->releaseRef())
+			NodeReclaimer::retire(p);
+	}
+
+	T* m_p;
+};
+
+template<typename T>
+bool operator==(const IntrusivePtr<T>& left, const IntrusivePtr<T>& right)
+{
+	return left.get() == right.get();
+}
+
+template<typename T>
+bool operator!=(const IntrusivePtr<T>& left, const IntrusivePtr<T>& right)
+{
+	return left.get() != right.get();
+}
+
+template<typename T>
+bool operator==(const IntrusivePtr<T>& p, std::nullptr_t)
+{
+	return p.get() == nullptr;
+}
+
+template<typename T>
+bool operator!=(const IntrusivePtr<T>& p, std::nullptr_t)
+{
+	return p.get() != nullptr;
+}
+
+template<typename T>
+bool operator==(std::nullptr_t, const IntrusivePtr<T>& p)
+{
+	return p.get() == nullptr;
+}
+
+template<typename T>
+bool operator!=(std::nullptr_t, const IntrusivePtr<T>& p)
+{
+	return p.get() != nullptr;
+}
+
+template<typename T, typename... Args>
+IntrusivePtr<T> makeIntrusive(Args&&... args)
+{
+	return IntrusivePtr<T>(new T(std::forward<Args>(args)...));
+}
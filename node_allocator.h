@@ -0,0 +1,381 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+/*
+* Bytes of nodes allocated by the current thread, containers take the difference around
+* an operation as the memory held by the version it makes
+*/
+inline std::size_t& allocatedNodeBytes()
+{
+	thread_local std::size_t s_numBytes = 0;
+	return s_numBytes;
+}
+
+/*
+* Hints the processor to load memory of a node which is about to be read, so lookups advanced
+* in lockstep wait for their nodes at once instead of one after another
+*/
+inline void prefetchNode(const void* p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(p);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#endif
+}
+
+/*
+* Allocator policy which takes node memory from the global heap
+*/
+struct HeapAllocator
+{
+	static void* allocate(std::size_t size)
+	{
+		return ::operator new(size);
+	}
+
+	static void deallocate(void* p, std::size_t)
+	{
+		::operator delete(p);
+	}
+};
+
+/*
+* Allocator policy with thread local slab pools, one pool per size class of 16 bytes.
+* Nodes are carved from 64 KB slabs by bump pointer, freed nodes are reused by the same slab,
+* and a slab is released as a whole as soon as all its nodes are freed, so versions dropped by
+* 'undo' with clearHistory give their memory back in bulk.
+* A node freed by another thread, e.g. a reader dropping the last reference to a snapshot, is pushed
+* to a lock-free list of its pool, which the allocating thread takes back on its next allocation.
+* When a thread exits, its pools stay alive while their slabs hold nodes, and other threads free
+* into them under a lock until the last node is gone.
+*/
+struct SlabAllocator
+{
+	static void* allocate(std::size_t size)
+	{
+		if (size > MAX_BLOCK_SIZE)
+			return ::operator new(size);
+
+		return localPool(poolIndex(size))->allocate(blockSize(size));
+	}
+
+	static void deallocate(void* p, std::size_t size)
+	{
+		if (size > MAX_BLOCK_SIZE)
+		{
+			::operator delete(p);
+			return;
+		}
+
+		SlabPool* pPool = SlabPool::ownerOf(p);
+		if (pPool == localPools()[poolIndex(size)])
+			pPool->deallocate(p);
+		else
+			pPool->deallocateRemote(p);
+	}
+
+private:
+	static const std::size_t SLAB_SIZE = 64 * 1024;
+	static const std::size_t GRANULARITY = 16;
+	static const std::size_t MAX_BLOCK_SIZE = 512;
+	static const std::size_t NUM_POOLS = MAX_BLOCK_SIZE / GRANULARITY;
+
+	class SlabPool
+	{
+	public:
+		SlabPool() :
+			m_pRemoteFree(nullptr)
+		{}
+
+		SlabPool(const SlabPool&) = delete;
+		SlabPool& operator=(const SlabPool&) = delete;
+
+		~SlabPool()
+		{
+			// a pool is deleted when its nodes are all freed, so the slabs left are empty
+			while (m_pAvailable != nullptr)
+			{
+				Slab* pSlab = m_pAvailable;
+				assert(pSlab->m_numUsed == 0);
+				unlink(pSlab);
+				freeSlab(pSlab);
+			}
+		}
+
+		static SlabPool* ownerOf(void* p)
+		{
+			return slabOf(p)->m_pOwner;
+		}
+
+		void* allocate(std::size_t size)
+		{
+			if (m_pRemoteFree.load(std::memory_order_relaxed) != nullptr)
+			{
+				drainRemote();
+			}
+
+			if (m_pAvailable == nullptr)
+			{
+				link(newSlab(size));
+			}
+
+			Slab* pSlab = m_pAvailable;
+			void* p;
+			if (pSlab->m_pFree != nullptr)
+			{
+				p = pSlab->m_pFree;
+				pSlab->m_pFree = pSlab->m_pFree->m_pNext;
+			}
+			else
+			{
+				p = pSlab->m_pBump;
+				pSlab->m_pBump += size;
+			}
+
+			pSlab->m_numUsed++;
+			m_numUsed++;
+			if (pSlab->m_pFree == nullptr && pSlab->m_pBump + size > reinterpret_cast<char*>(pSlab) + SLAB_SIZE)
+			{
+				unlink(pSlab);
+			}
+			return p;
+		}
+
+		/*
+		* Frees node allocated by this pool, called by the owner thread or under the lock once it has exited
+		*/
+		void deallocate(void* p)
+		{
+			Slab* pSlab = slabOf(p);
+			assert(pSlab->m_pOwner == this);
+
+			auto pBlock = static_cast<FreeBlock*>(p);
+			pBlock->m_pNext = pSlab->m_pFree;
+			pSlab->m_pFree = pBlock;
+			pSlab->m_numUsed--;
+			m_numUsed--;
+
+			if (!pSlab->m_isAvailable)
+			{
+				link(pSlab);
+			}
+
+			// the only available slab is kept to avoid allocating it again on the next node
+			if (pSlab->m_numUsed == 0 && (m_isAbandoned || pSlab->m_pPrev != nullptr || pSlab->m_pNext != nullptr))
+			{
+				unlink(pSlab);
+				freeSlab(pSlab);
+			}
+		}
+
+		/*
+		* Frees node allocated by this pool from another thread
+		*/
+		void deallocateRemote(void* p)
+		{
+			auto pBlock = static_cast<FreeBlock*>(p);
+			FreeBlock* pHead = m_pRemoteFree.load(std::memory_order_relaxed);
+			while (pHead != abandoned())
+			{
+				pBlock->m_pNext = pHead;
+				if (m_pRemoteFree.compare_exchange_weak(pHead, pBlock, std::memory_order_release, std::memory_order_relaxed))
+					return;
+			}
+
+			bool isEmpty;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				deallocate(p);
+				isEmpty = m_numUsed == 0;
+			}
+			if (isEmpty)
+				delete this;
+		}
+
+		/*
+		* Called by the owner thread when it exits, the pool is deleted by whoever frees its last node
+		*/
+		void abandon()
+		{
+			FreeBlock* pRemote = m_pRemoteFree.exchange(abandoned(), std::memory_order_acquire);
+
+			bool isEmpty;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_isAbandoned = true;
+				freeBlocks(pRemote);
+
+				Slab* pSlab = m_pAvailable;
+				while (pSlab != nullptr)
+				{
+					Slab* pNext = pSlab->m_pNext;
+					if (pSlab->m_numUsed == 0)
+					{
+						unlink(pSlab);
+						freeSlab(pSlab);
+					}
+					pSlab = pNext;
+				}
+				isEmpty = m_numUsed == 0;
+			}
+			if (isEmpty)
+				delete this;
+		}
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* m_pNext;
+		};
+
+		struct Slab
+		{
+			SlabPool* m_pOwner;
+			Slab* m_pPrev;
+			Slab* m_pNext;
+			FreeBlock* m_pFree;
+			char* m_pBump;
+			int m_numUsed;
+			bool m_isAvailable;
+		};
+
+		static Slab* slabOf(void* p)
+		{
+			return reinterpret_cast<Slab*>(reinterpret_cast<std::uintptr_t>(p) & ~(std::uintptr_t)(SLAB_SIZE - 1));
+		}
+
+		// head of the remote list of a pool whose thread has exited, no block is ever at this address
+		static FreeBlock* abandoned()
+		{
+			return reinterpret_cast<FreeBlock*>(std::uintptr_t(1));
+		}
+
+		void drainRemote()
+		{
+			freeBlocks(m_pRemoteFree.exchange(nullptr, std::memory_order_acquire));
+		}
+
+		void freeBlocks(FreeBlock* pBlock)
+		{
+			while (pBlock != nullptr)
+			{
+				FreeBlock* pNext = pBlock->m_pNext;
+				deallocate(pBlock);
+				pBlock = pNext;
+			}
+		}
+
+		Slab* newSlab(std::size_t size)
+		{
+			auto pSlab = static_cast<Slab*>(::operator new(SLAB_SIZE, std::align_val_t(SLAB_SIZE)));
+			pSlab->m_pOwner = this;
+			pSlab->m_pPrev = pSlab->m_pNext = nullptr;
+			pSlab->m_pFree = nullptr;
+			pSlab->m_pBump = reinterpret_cast<char*>(pSlab) + (sizeof(Slab) + size - 1) / size * size;
+			pSlab->m_numUsed = 0;
+			pSlab->m_isAvailable = false;
+			return pSlab;
+		}
+
+		static void freeSlab(Slab* pSlab)
+		{
+			::operator delete(pSlab, std::align_val_t(SLAB_SIZE));
+		}
+
+		void link(Slab* pSlab)
+		{
+			pSlab->m_pPrev = nullptr;
+			pSlab->m_pNext = m_pAvailable;
+			if (m_pAvailable != nullptr)
+				m_pAvailable->m_pPrev = pSlab;
+			m_pAvailable = pSlab;
+			pSlab->m_isAvailable = true;
+		}
+
+		void unlink(Slab* pSlab)
+		{
+			if (pSlab->m_pPrev != nullptr)
+				pSlab->m_pPrev->m_pNext = pSlab->m_pNext;
+			else
+				m_pAvailable = pSlab->m_pNext;
+
+			if (pSlab->m_pNext != nullptr)
+				pSlab->m_pNext->m_pPrev = pSlab->m_pPrev;
+
+			pSlab->m_pPrev = pSlab->m_pNext = nullptr;
+			pSlab->m_isAvailable = false;
+		}
+
+		Slab* m_pAvailable = nullptr;
+		long m_numUsed = 0;
+		bool m_isAbandoned = false;
+		std::atomic<FreeBlock*> m_pRemoteFree;
+		std::mutex m_mutex;
+	};
+
+	/*
+	* Abandons pools of the thread when it exits
+	*/
+	struct ThreadExit
+	{
+		~ThreadExit()
+		{
+			isThreadExiting() = true;
+			SlabPool** apPools = localPools();
+			for (std::size_t i = 0; i < NUM_POOLS; i++)
+			{
+				if (apPools[i] != nullptr)
+					apPools[i]->abandon();
+				apPools[i] = nullptr;
+			}
+		}
+	};
+
+	static std::size_t poolIndex(std::size_t size)
+	{
+		return (size + GRANULARITY - 1) / GRANULARITY - 1;
+	}
+
+	static std::size_t blockSize(std::size_t size)
+	{
+		return (poolIndex(size) + 1) * GRANULARITY;
+	}
+
+	// plain pointers stay valid while other thread locals are destroyed, nodes they free are remote then
+	static SlabPool** localPools()
+	{
+		thread_local SlabPool* s_apPools[NUM_POOLS] = {};
+		return s_apPools;
+	}
+
+	static bool& isThreadExiting()
+	{
+		thread_local bool s_isExiting = false;
+		return s_isExiting;
+	}
+
+	static SlabPool* localPool(std::size_t index)
+	{
+		SlabPool*& pPool = localPools()[index];
+		if (pPool == nullptr)
+		{
+			// pools made by destructors running at thread exit are never abandoned and stay until the process exits
+			if (!isThreadExiting())
+			{
+				thread_local ThreadExit s_threadExit;
+				(void)s_threadExit;
+			}
+			pPool = new SlabPool();
+		}
+		return pPool;
+	}
+};
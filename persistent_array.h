@@ -1,4 +1,8 @@
 #include "persistent_container.h"
+#include "intrusive_ptr.h"
+#include "augmentation.h"
+#include "version_history.h"
+#include "snapshot.h"
 #include <vector>
 #include <algorithm>
 #include <ctime>
@@ -7,17 +11,25 @@
 #include <numeric>
 #include <cassert>
 #include <memory>
+#include <array>
+#include <iterator>
+#include <utility>
+#include <type_traits>
+#include <iostream>
 
 namespace
 {
 
-	template<typename T>
-	struct Node
+	template<typename T, typename RefCountPolicy, typename Allocator, typename Augmentation = NoAugmentation>
+	struct Node : public RefCounted<RefCountPolicy, Allocator>, public Augmentation::template Data<int, T>
 	{
+		using Augment = typename Augmentation::template Data<int, T>;
+
 		Node()
 		{
 			m_index = 0;
 			m_value = T{};
+			m_edit = 0;
 			m_pLeft = m_pRight = nullptr;
 		}
 
@@ -25,18 +37,24 @@ namespace
 		{
 			m_index = index;
 			m_value = value;
+			m_edit = 0;
 			m_pLeft = m_pRight = nullptr;
 		}
 
+		void update()
+		{
+			Augment::update(m_pLeft.get(), m_pRight.get(), m_index, m_value);
+		}
 
 		int m_index;
 		T m_value;
+		EditToken m_edit;
 
-		std::shared_ptr<Node<T> > m_pLeft;
-		std::shared_ptr<Node<T> > m_pRight;
+		IntrusivePtr<Node> m_pLeft;
+		IntrusivePtr<Node> m_pRight;
 	};
 
-	template<typename T>
+	template<typename T, typename RefCountPolicy = AtomicRefCount, typename Allocator = HeapAllocator, typename Augmentation = NoAugmentation>
 	class PersistentArrayVersion
 	{
 
@@ -47,19 +65,18 @@ namespace
 			m_size = 0;
 		}
 
-		PersistentArrayVersion(int size)
+		PersistentArrayVersion(int size, const T& value = T{})
 		{
 			m_size = size;
-			std::vector<int> aIndexes(m_size - 1);
-			std::iota(aIndexes.begin(), aIndexes.end(), 1);
-
-			random_shuffle(aIndexes.begin(), aIndexes.end());
+			m_pRoot = build(0, m_size, [&value](int) { return value; });
+		}
 
-			m_pRoot = std::make_shared<Node<T> >();
-			for (const auto& index : aIndexes)
-			{
-				create(m_pRoot, index);
-			}
+		template<typename InputIt, typename = typename std::iterator_traits<InputIt>::iterator_category>
+		PersistentArrayVersion(InputIt first, InputIt last)
+		{
+			std::vector<T> aValues(first, last);
+			m_size = (int)aValues.size();
+			m_pRoot = build(0, m_size, [&aValues](int index) { return aValues[index]; });
 		}
 
 		PersistentArrayVersion(const PersistentArrayVersion& other)
@@ -80,11 +97,124 @@ namespace
 			m_pRoot = setValue(m_pRoot, index, value);
 		}
 
-		T getValue(int index)
+		void setValues(const std::vector<std::pair<int, T> >& aChanges)
+		{
+			m_pRoot = setValues(m_pRoot, aChanges.data(), aChanges.data() + aChanges.size());
+		}
+
+		void setValue(int index, const T& value, EditToken edit)
+		{
+			NodePtr* ppNode = &m_pRoot;
+			while (*ppNode != nullptr)
+			{
+				NodePtr& pNode = *ppNode;
+				if (!isOwned(pNode, edit))
+				{
+					auto pCopy = makeIntrusive<NodeType>(*pNode);
+					pCopy->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+					pNode = pCopy;
+				}
+
+				if (index == pNode->m_index)
+				{
+					pNode->m_value = value;
+					if (IS_AUGMENTED)
+						updatePath(m_pRoot.get(), index);
+					return;
+				}
+
+				ppNode = index < pNode->m_index ? &pNode->m_pLeft : &pNode->m_pRight;
+			}
+		}
+
+		T getValue(int index) const
 		{
 			return getValue(m_pRoot, index);
 		}
 
+		/*
+		* Gets values of many elements, up to GET_LANES lookups advance in turns and prefetch the next node
+		* of each, so their cache misses overlap. A finished lane takes the next index
+		*/
+		void getMany(const std::vector<int>& aIndexes, std::vector<T>& aValues) const
+		{
+			struct Lane
+			{
+				const NodeType* m_pNode;
+				std::size_t m_index;
+			};
+
+			aValues.assign(aIndexes.size(), T{});
+			if (m_pRoot == nullptr)
+				return;
+
+			std::array<Lane, GET_LANES> aLanes;
+			std::size_t numLanes = std::min<std::size_t>(GET_LANES, aIndexes.size()), next = numLanes;
+			for (std::size_t i = 0; i < numLanes; i++)
+			{
+				aLanes[i] = Lane{ m_pRoot.get(), i };
+			}
+
+			while (numLanes > 0)
+			{
+				for (std::size_t i = 0; i < numLanes;)
+				{
+					Lane& lane = aLanes[i];
+					int index = aIndexes[lane.m_index];
+					if (lane.m_pNode != nullptr && index != lane.m_pNode->m_index)
+					{
+						lane.m_pNode = index < lane.m_pNode->m_index ? lane.m_pNode->m_pLeft.get() : lane.m_pNode->m_pRight.get();
+						if (lane.m_pNode != nullptr)
+							prefetchNode(lane.m_pNode);
+						i++;
+						continue;
+					}
+
+					if (lane.m_pNode != nullptr)
+						aValues[lane.m_index] = lane.m_pNode->m_value;
+
+					if (next < aIndexes.size())
+					{
+						lane = Lane{ m_pRoot.get(), next++ };
+						i++;
+					}
+					else
+						lane = aLanes[--numLanes];
+				}
+			}
+		}
+
+		int size() const
+		{
+			return m_size;
+		}
+
+		std::uint64_t digest() const
+		{
+			static_assert(IS_DIGESTED, "digest requires PersistentArrayVersion with MerkleDigest augmentation");
+			return NodeType::Augment::digest(m_pRoot.get());
+		}
+
+		/*
+		* Compares digests with MerkleDigest augmentation, otherwise the nodes which aren't shared
+		*/
+		bool equals(const PersistentArrayVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return true;
+			if (m_size != other.m_size)
+				return false;
+			if constexpr (IS_DIGESTED)
+				return digest() == other.digest();
+			return isEqual(m_pRoot.get(), other.m_pRoot.get());
+		}
+
+		template<typename Callback>
+		void diff(const PersistentArrayVersion& other, const Callback& callback) const
+		{
+			diff(m_pRoot.get(), other.m_pRoot.get(), callback);
+		}
+
 		void print()
 		{
 			int deep = 0;
@@ -94,27 +224,81 @@ namespace
 		}
 
 	private:
-		using NodePtr = std::shared_ptr<Node<T> >;
+		using NodeType = Node<T, RefCountPolicy, Allocator, Augmentation>;
+		using NodePtr = IntrusivePtr<NodeType>;
+
+		static const bool IS_AUGMENTED = !std::is_empty<typename NodeType::Augment>::value;
+		static const bool IS_DIGESTED = std::is_same<Augmentation, MerkleDigest>::value;
+		static const int GET_LANES = 16;
 
 		int m_size;
 		NodePtr m_pRoot;
 
-		void create(NodePtr& pRoot, int index)
+		static bool isOwned(const NodePtr& pNode, EditToken edit)
 		{
-			if (pRoot == nullptr)
-			{
-				pRoot = std::make_shared<Node<T> >(index, T{});
+			return edit == EXCLUSIVE_EDIT ? pNode.use_count() == 1 : pNode->m_edit == edit;
+		}
+
+		/*
+		* Recomputes augmentation of nodes on the path from pNode down to index, the nodes must be owned
+		*/
+		static void updatePath(NodeType* pNode, int index)
+		{
+			if (pNode == nullptr)
 				return;
-			}
 
-			if (index < pRoot->m_index)
+			if (index != pNode->m_index)
+				updatePath(index < pNode->m_index ? pNode->m_pLeft.get() : pNode->m_pRight.get(), index);
+			pNode->update();
+		}
+
+		/*
+		* Checks if two trees of the same size have equal values, shared subtrees are skipped
+		*/
+		static bool isEqual(const NodeType* pFirst, const NodeType* pSecond)
+		{
+			if (pFirst == pSecond)
+				return true;
+
+			return pFirst->m_value == pSecond->m_value
+				&& isEqual(pFirst->m_pLeft.get(), pSecond->m_pLeft.get()) && isEqual(pFirst->m_pRight.get(), pSecond->m_pRight.get());
+		}
+
+		/*
+		* Calls callback(index, firstValue, secondValue) for elements which differ in two trees of the same size,
+		* skipping shared subtrees and, with MerkleDigest, subtrees with equal digests
+		*/
+		template<typename Callback>
+		static void diff(const NodeType* pFirst, const NodeType* pSecond, const Callback& callback)
+		{
+			if (pFirst == pSecond)
+				return;
+			if constexpr (IS_DIGESTED)
 			{
-				create(pRoot->m_pLeft, index);
+				if (NodeType::Augment::digest(pFirst) == NodeType::Augment::digest(pSecond))
+					return;
 			}
-			else
+
+			diff(pFirst->m_pLeft.get(), pSecond->m_pLeft.get(), callback);
+			if (!(pFirst->m_value == pSecond->m_value))
+				callback(pFirst->m_index, pFirst->m_value, pSecond->m_value);
+			diff(pFirst->m_pRight.get(), pSecond->m_pRight.get(), callback);
+		}
+
+		template<typename Generator>
+		NodePtr build(int begin, int end, const Generator& value)
+		{
+			if (begin >= end)
 			{
-				create(pRoot->m_pRight, index);
+				return nullptr;
 			}
+
+			int mid = begin + (end - begin) / 2;
+			auto pNode = makeIntrusive<NodeType>(mid, value(mid));
+			pNode->m_pLeft = build(begin, mid, value);
+			pNode->m_pRight = build(mid + 1, end, value);
+			pNode->update();
+			return pNode;
 		}
 
 		NodePtr setValue(NodePtr& pRoot, int index, T value)
@@ -127,9 +311,10 @@ namespace
 			NodePtr pNode = nullptr;
 			if (index == pRoot->m_index)
 			{
-				pNode = std::make_shared<Node<T> >(index, value);
+				pNode = makeIntrusive<NodeType>(index, value);
 				pNode->m_pLeft = pRoot->m_pLeft;
 				pNode->m_pRight = pRoot->m_pRight;
+				pNode->update();
 				return pNode;
 			}
 
@@ -138,7 +323,7 @@ namespace
 				NodePtr pLeft = setValue(pRoot->m_pLeft, index, value);
 				if (pLeft != nullptr)
 				{
-					pNode = std::make_shared<Node<T> >(pRoot->m_index, pRoot->m_value);
+					pNode = makeIntrusive<NodeType>(pRoot->m_index, pRoot->m_value);
 					pNode->m_pLeft = pLeft;
 					pNode->m_pRight = pRoot->m_pRight;
 				}
@@ -148,15 +333,40 @@ namespace
 				NodePtr pRight = setValue(pRoot->m_pRight, index, value);
 				if (pRight != nullptr)
 				{
-					pNode = std::make_shared<Node<T> >(pRoot->m_index, pRoot->m_value);
+					pNode = makeIntrusive<NodeType>(pRoot->m_index, pRoot->m_value);
 					pNode->m_pLeft = pRoot->m_pLeft;
 					pNode->m_pRight = pRight;
 				}
 			}
+
+			if (pNode != nullptr)
+				pNode->update();
+			return pNode;
+		}
+
+		NodePtr setValues(const NodePtr& pRoot, const std::pair<int, T>* pBegin, const std::pair<int, T>* pEnd)
+		{
+			if (pRoot == nullptr || pBegin == pEnd)
+			{
+				return pRoot;
+			}
+
+			auto pMid = std::lower_bound(pBegin, pEnd, pRoot->m_index,
+				[](const std::pair<int, T>& change, int index) { return change.first < index; });
+
+			auto pNode = makeIntrusive<NodeType>(pRoot->m_index, pRoot->m_value);
+			pNode->m_pLeft = setValues(pRoot->m_pLeft, pBegin, pMid);
+			if (pMid != pEnd && pMid->first == pRoot->m_index)
+			{
+				pNode->m_value = pMid->second;
+				++pMid;
+			}
+			pNode->m_pRight = setValues(pRoot->m_pRight, pMid, pEnd);
+			pNode->update();
 			return pNode;
 		}
 
-		T getValue(const NodePtr& pRoot, int index)
+		T getValue(const NodePtr& pRoot, int index) const
 		{
 			if (pRoot == nullptr)
 			{
@@ -191,21 +401,417 @@ namespace
 		}
 	};
 
+	const int TRIE_BITS = 5;
+	const int TRIE_WIDTH = 1 << TRIE_BITS;
+	const int TRIE_MASK = TRIE_WIDTH - 1;
+
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	struct TrieNode : public RefCounted<RefCountPolicy, Allocator>
+	{
+		virtual ~TrieNode() = default;
+
+		EditToken m_edit = 0;
+	};
+
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	struct TrieBranch : public TrieNode<T, RefCountPolicy, Allocator>
+	{
+		std::array<IntrusivePtr<TrieNode<T, RefCountPolicy, Allocator> >, TRIE_WIDTH> m_apChildren;
+	};
+
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	struct TrieLeaf : public TrieNode<T, RefCountPolicy, Allocator>
+	{
+		std::array<T, TRIE_WIDTH> m_aValues{};
+	};
+
+	/*
+	* Array version stored as a trie with TRIE_WIDTH-way branching: leaves hold TRIE_WIDTH
+	* contiguous values, so a lookup touches log32(n) nodes and a set copies as many wide nodes
+	*/
+	template<typename T, typename RefCountPolicy = AtomicRefCount, typename Allocator = HeapAllocator>
+	class PersistentArrayTrieVersion
+	{
+
+	public:
+		PersistentArrayTrieVersion()
+		{
+			m_pRoot = nullptr;
+			m_size = 0;
+			m_shift = 0;
+		}
+
+		PersistentArrayTrieVersion(int size, const T& value = T{})
+		{
+			build(size, [&value](int) { return value; });
+		}
+
+		template<typename InputIt, typename = typename std::iterator_traits<InputIt>::iterator_category>
+		PersistentArrayTrieVersion(InputIt first, InputIt last)
+		{
+			std::vector<T> aValues(first, last);
+			build((int)aValues.size(), [&aValues](int index) { return aValues[index]; });
+		}
+
+		void setValue(int index, T value)
+		{
+			m_pRoot = setValue(m_pRoot, m_shift, index, value);
+		}
+
+		void setValues(const std::vector<std::pair<int, T> >& aChanges)
+		{
+			if (!aChanges.empty())
+			{
+				m_pRoot = setValues(m_pRoot, m_shift, aChanges.data(), aChanges.data() + aChanges.size());
+			}
+		}
+
+		void setValue(int index, const T& value, EditToken edit)
+		{
+			NodePtr* ppNode = &m_pRoot;
+			for (int shift = m_shift; shift > 0; shift -= TRIE_BITS)
+			{
+				ppNode = &editable<Branch>(*ppNode, edit).m_apChildren[(index >> shift) & TRIE_MASK];
+			}
+
+			editable<Leaf>(*ppNode, edit).m_aValues[index & TRIE_MASK] = value;
+		}
+
+		T getValue(int index) const
+		{
+			const TrieNodeType* pNode = m_pRoot.get();
+			for (int shift = m_shift; shift > 0; shift -= TRIE_BITS)
+			{
+				pNode = static_cast<const Branch*>(pNode)->m_apChildren[(index >> shift) & TRIE_MASK].get();
+			}
+
+			return static_cast<const Leaf*>(pNode)->m_aValues[index & TRIE_MASK];
+		}
+
+		/*
+		* Gets values of many elements by groups of GET_LANES: all lookups of a group have the same depth,
+		* so they descend level by level together, prefetching the slot each one reads on the next level
+		*/
+		void getMany(const std::vector<int>& aIndexes, std::vector<T>& aValues) const
+		{
+			aValues.resize(aIndexes.size());
+			std::array<const TrieNodeType*, GET_LANES> apNodes;
+			for (std::size_t first = 0; first < aIndexes.size(); first += GET_LANES)
+			{
+				const int* aGroup = aIndexes.data() + first;
+				std::size_t count = std::min<std::size_t>(GET_LANES, aIndexes.size() - first);
+				apNodes.fill(m_pRoot.get());
+				for (int shift = m_shift; shift > 0; shift -= TRIE_BITS)
+				{
+					for (std::size_t i = 0; i < count; i++)
+					{
+						apNodes[i] = static_cast<const Branch*>(apNodes[i])->m_apChildren[(aGroup[i] >> shift) & TRIE_MASK].get();
+						if (shift > TRIE_BITS)
+							prefetchNode(&static_cast<const Branch*>(apNodes[i])->m_apChildren[(aGroup[i] >> (shift - TRIE_BITS)) & TRIE_MASK]);
+						else
+							prefetchNode(&static_cast<const Leaf*>(apNodes[i])->m_aValues[aGroup[i] & TRIE_MASK]);
+					}
+				}
+
+				for (std::size_t i = 0; i < count; i++)
+				{
+					aValues[first + i] = static_cast<const Leaf*>(apNodes[i])->m_aValues[aGroup[i] & TRIE_MASK];
+				}
+			}
+		}
+
+		int size() const
+		{
+			return m_size;
+		}
+
+		std::uint64_t digest() const
+		{
+			static_assert(!std::is_same<T, T>::value, "digest requires PersistentArrayVersion with MerkleDigest augmentation, tries have no digests");
+			return 0;
+		}
+
+		/*
+		* Compares the nodes which aren't shared, as tries of one size have the same shape
+		*/
+		bool equals(const PersistentArrayTrieVersion& other) const
+		{
+			return m_pRoot == other.m_pRoot || (m_size == other.m_size && isEqual(m_pRoot, other.m_pRoot, m_shift));
+		}
+
+		/*
+		* Calls callback(index, firstValue, secondValue) in ascending order of indexes for elements which differ
+		* from other of the same size, nodes shared by both tries are skipped
+		*/
+		template<typename Callback>
+		void diff(const PersistentArrayTrieVersion& other, const Callback& callback) const
+		{
+			diff(m_pRoot, other.m_pRoot, m_shift, 0, callback);
+		}
+
+		void print()
+		{
+			int index = 0;
+			print(m_pRoot, m_shift, index);
+			std::cout << std::endl;
+		}
+
+	private:
+		using TrieNodeType = TrieNode<T, RefCountPolicy, Allocator>;
+		using Branch = TrieBranch<T, RefCountPolicy, Allocator>;
+		using Leaf = TrieLeaf<T, RefCountPolicy, Allocator>;
+		using NodePtr = IntrusivePtr<TrieNodeType>;
+
+		static const int GET_LANES = 16;
+
+		int m_size;
+		int m_shift;
+		NodePtr m_pRoot;
+
+		template<typename Generator>
+		void build(int size, const Generator& value)
+		{
+			m_size = size;
+			m_shift = 0;
+
+			std::vector<NodePtr> apLevel((m_size + TRIE_MASK) >> TRIE_BITS);
+			for (int i = 0; i < (int)apLevel.size(); i++)
+			{
+				auto pLeaf = makeIntrusive<Leaf>();
+				for (int j = 0; j < TRIE_WIDTH && i * TRIE_WIDTH + j < m_size; j++)
+				{
+					pLeaf->m_aValues[j] = value(i * TRIE_WIDTH + j);
+				}
+				apLevel[i] = pLeaf;
+			}
+
+			while (apLevel.size() > 1)
+			{
+				std::vector<NodePtr> apParents((apLevel.size() + TRIE_MASK) >> TRIE_BITS);
+				for (int i = 0; i < (int)apParents.size(); i++)
+				{
+					auto pBranch = makeIntrusive<Branch>();
+					for (int j = 0; j < TRIE_WIDTH && i * TRIE_WIDTH + j < (int)apLevel.size(); j++)
+					{
+						pBranch->m_apChildren[j] = std::move(apLevel[i * TRIE_WIDTH + j]);
+					}
+					apParents[i] = pBranch;
+				}
+				apLevel.swap(apParents);
+				m_shift += TRIE_BITS;
+			}
+
+			m_pRoot = apLevel.empty() ? nullptr : apLevel[0];
+		}
+
+		template<typename NodeType>
+		static NodeType& editable(NodePtr& pNode, EditToken edit)
+		{
+			bool isOwned = edit == EXCLUSIVE_EDIT ? pNode.use_count() == 1 : pNode->m_edit == edit;
+			if (!isOwned)
+			{
+				auto pCopy = makeIntrusive<NodeType>(*static_cast<const NodeType*>(pNode.get()));
+				pCopy->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+				pNode = pCopy;
+			}
+
+			return *static_cast<NodeType*>(pNode.get());
+		}
+
+		NodePtr setValue(const NodePtr& pRoot, int shift, int index, const T& value)
+		{
+			if (shift == 0)
+			{
+				auto pLeaf = makeIntrusive<Leaf>(*static_cast<const Leaf*>(pRoot.get()));
+				pLeaf->m_aValues[index & TRIE_MASK] = value;
+				return pLeaf;
+			}
+
+			auto pBranch = makeIntrusive<Branch>(*static_cast<const Branch*>(pRoot.get()));
+			auto& pChild = pBranch->m_apChildren[(index >> shift) & TRIE_MASK];
+			pChild = setValue(pChild, shift - TRIE_BITS, index, value);
+			return pBranch;
+		}
+
+		NodePtr setValues(const NodePtr& pRoot, int shift, const std::pair<int, T>* pBegin, const std::pair<int, T>* pEnd)
+		{
+			if (shift == 0)
+			{
+				auto pLeaf = makeIntrusive<Leaf>(*static_cast<const Leaf*>(pRoot.get()));
+				for (auto pChange = pBegin; pChange != pEnd; ++pChange)
+				{
+					pLeaf->m_aValues[pChange->first & TRIE_MASK] = pChange->second;
+				}
+				return pLeaf;
+			}
+
+			auto pBranch = makeIntrusive<Branch>(*static_cast<const Branch*>(pRoot.get()));
+			while (pBegin != pEnd)
+			{
+				int prefix = pBegin->first >> shift;
+				auto pNext = pBegin;
+				while (pNext != pEnd && (pNext->first >> shift) == prefix)
+				{
+					++pNext;
+				}
+
+				auto& pChild = pBranch->m_apChildren[prefix & TRIE_MASK];
+				pChild = setValues(pChild, shift - TRIE_BITS, pBegin, pNext);
+				pBegin = pNext;
+			}
+			return pBranch;
+		}
+
+		static bool isEqual(const NodePtr& pFirst, const NodePtr& pSecond, int shift)
+		{
+			if (pFirst == pSecond)
+				return true;
+
+			if (shift == 0)
+				return static_cast<const Leaf*>(pFirst.get())->m_aValues == static_cast<const Leaf*>(pSecond.get())->m_aValues;
+
+			const auto& apFirstChildren = static_cast<const Branch*>(pFirst.get())->m_apChildren;
+			const auto& apSecondChildren = static_cast<const Branch*>(pSecond.get())->m_apChildren;
+			for (int i = 0; i < TRIE_WIDTH; i++)
+			{
+				if (!isEqual(apFirstChildren[i], apSecondChildren[i], shift - TRIE_BITS))
+					return false;
+			}
+			return true;
+		}
+
+		template<typename Callback>
+		void diff(const NodePtr& pFirst, const NodePtr& pSecond, int shift, int first, const Callback& callback) const
+		{
+			if (pFirst == pSecond)
+				return;
+
+			if (shift == 0)
+			{
+				const auto& aFirstValues = static_cast<const Leaf*>(pFirst.get())->m_aValues;
+				const auto& aSecondValues = static_cast<const Leaf*>(pSecond.get())->m_aValues;
+				for (int i = 0; i < TRIE_WIDTH && first + i < m_size; i++)
+				{
+					if (!(aFirstValues[i] == aSecondValues[i]))
+						callback(first + i, aFirstValues[i], aSecondValues[i]);
+				}
+				return;
+			}
+
+			const auto& apFirstChildren = static_cast<const Branch*>(pFirst.get())->m_apChildren;
+			const auto& apSecondChildren = static_cast<const Branch*>(pSecond.get())->m_apChildren;
+			for (int i = 0; i < TRIE_WIDTH; i++)
+			{
+				diff(apFirstChildren[i], apSecondChildren[i], shift - TRIE_BITS, first + (i << shift), callback);
+			}
+		}
+
+		void print(const NodePtr& pRoot, int shift, int& index)
+		{
+			if (pRoot == nullptr)
+				return;
+
+			if (shift == 0)
+			{
+				const auto& aValues = static_cast<const Leaf*>(pRoot.get())->m_aValues;
+				for (int i = 0; i < TRIE_WIDTH && index < m_size; i++, index++)
+				{
+					std::cout << aValues[i] << " ";
+				}
+				return;
+			}
+
+			for (const auto& pChild : static_cast<const Branch*>(pRoot.get())->m_apChildren)
+			{
+				print(pChild, shift - TRIE_BITS, index);
+			}
+		}
+	};
+
 }
 
-template<typename T>
+template<typename T, typename VersionType>
+class PersistentArrayTransient;
+
+/*
+* Immutable view of one version of PersistentArray, can be read from any thread
+*/
+template<typename T, typename VersionType>
+class PersistentArraySnapshot : public RefCounted<AtomicRefCount>
+{
+public:
+	PersistentArraySnapshot(int version, const VersionType& root) :
+		m_version(version),
+		m_root(root)
+	{}
+
+	/**
+	* Gets value of element with index, throws exception if index is invalid
+	* @param index - index of element
+	* @return found element
+	*/
+	T getValue(int index) const
+	{
+		if (index < 0 || index >= m_root.size())
+		{
+			assert(index >= 0 && index < m_root.size());
+			throw std::exception();
+		}
+
+		return m_root.getValue(index);
+	}
+
+	int size() const
+	{
+		return m_root.size();
+	}
+
+	/*
+	* Gets number of the version of the array
+	*/
+	int version() const
+	{
+		return m_version;
+	}
+
+private:
+	int m_version;
+	VersionType m_root;
+};
+
+template<typename T, typename VersionType = PersistentArrayTrieVersion<T> >
 class PersistentArray : public PersistentBase
 {
 public:
+	friend class PersistentArrayTransient<T, VersionType>;
+	using PersistentArrayTransientPtr = std::shared_ptr<PersistentArrayTransient<T, VersionType> >;
+	using PersistentArraySnapshotPtr = IntrusivePtr<PersistentArraySnapshot<T, VersionType> >;
 
 	PersistentArray() {}
 
-	PersistentArray(int size)
+	/**
+	* Creates array of given size with all elements set to value, in linear time
+	* @param size
+	* @param value
+	*/
+	PersistentArray(int size, const T& value = T{})
 	{
 		m_size = size;
 		m_lastVersion = m_curVersion = 0;
-		PersistentArrayVersion<T> initVer(size);
-		m_versions.push_back(initVer);
+		m_versions.push(VersionType(size, value), 0);
+	}
+
+	/**
+	* Creates array from elements of range [first, last), in linear time
+	* @param first
+	* @param last
+	*/
+	template<typename InputIt, typename = typename std::iterator_traits<InputIt>::iterator_category>
+	PersistentArray(InputIt first, InputIt last)
+	{
+		m_lastVersion = m_curVersion = 0;
+		m_versions.push(VersionType(first, last), 0);
+		m_size = m_versions[0].size();
 	}
 
 	/**
@@ -215,22 +821,102 @@ public:
 	*/
 	void setValue(int index, T value)
 	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
 		if (index < 0 || index >= m_size)
 		{
 			assert(index >= 0 && index < m_size);
 			return;
 		}
 
-		PersistentArrayVersion<T> newVer(m_versions[m_curVersion]);
+		if (!m_isHistoryEnabled)
+		{
+			invalidate();
+			m_versions[m_curVersion].setValue(index, value, EXCLUSIVE_EDIT);
+			publish();
+			return;
+		}
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVer(m_versions[m_curVersion]);
 		newVer.setValue(index, value);
-		while (m_lastVersion > m_curVersion)
+		pushVersion(newVer, allocatedNodeBytes() - numBytes);
+	}
+
+	/**
+	* Sets values to several elements at once, creating a single new version
+	* @param aChanges - pairs of index and value, for repeated indexes the last value wins
+	*/
+	void setValues(std::vector<std::pair<int, T> > aChanges)
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		if (aChanges.empty())
+		{
+			return;
+		}
+
+		for (const auto& change : aChanges)
 		{
-			m_versions.pop_back();
-			m_lastVersion--;
+			if (change.first < 0 || change.first >= m_size)
+			{
+				assert(change.first >= 0 && change.first < m_size);
+				return;
+			}
 		}
 
-		m_versions.push_back(newVer);
-		m_lastVersion = ++m_curVersion;
+		std::stable_sort(aChanges.begin(), aChanges.end(),
+			[](const std::pair<int, T>& left, const std::pair<int, T>& right) { return left.first < right.first; });
+
+		auto last = aChanges.begin();
+		for (auto it = aChanges.begin(); it != aChanges.end(); ++it)
+		{
+			if (it->first != last->first)
+			{
+				++last;
+			}
+			if (it != last)
+			{
+				*last = std::move(*it);
+			}
+		}
+		aChanges.erase(last + 1, aChanges.end());
+
+		if (!m_isHistoryEnabled)
+		{
+			invalidate();
+			for (const auto& change : aChanges)
+			{
+				m_versions[m_curVersion].setValue(change.first, change.second, EXCLUSIVE_EDIT);
+			}
+			publish();
+			return;
+		}
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVer(m_versions[m_curVersion]);
+		newVer.setValues(aChanges);
+		pushVersion(newVer, allocatedNodeBytes() - numBytes);
+	}
+
+	/**
+	* Starts transient editing of the current version, changes made through the transient
+	* are invisible to the array until commit, which adds them as a single new version.
+	* Until the transient is committed or destroyed the array can be read but not changed
+	* @return transient editor, destroying it without commit discards its changes
+	*/
+	PersistentArrayTransientPtr beginTransient()
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		m_isReadOnly = true;
+		return PersistentArrayTransientPtr(new PersistentArrayTransient<T, VersionType>(*this, m_versions[m_curVersion]));
 	}
 
 	/**
@@ -250,20 +936,116 @@ public:
 	}
 
 	/**
-	* Undo last numIter operations of 'set' type
+	* Gets value of element with index in the given version without changing the current one,
+	* throws exception if version isn't kept or index is invalid
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param index - index of element
+	* @return found element
+	*/
+	T getValue(int version, int index) const
+	{
+		if (version < 0 || version > m_lastVersion || !m_versions.contains(version))
+		{
+			assert(version >= 0 && version <= m_lastVersion && m_versions.contains(version));
+			throw std::exception();
+		}
+
+		if (index < 0 || index >= m_size)
+		{
+			assert(index >= 0 && index < m_size);
+			throw std::exception();
+		}
+
+		return m_versions[version].getValue(index);
+	}
+
+	/**
+	* Gets values of many elements of the current version at once, throws exception if an index is invalid
+	* @param aIndexes - indexes of elements
+	* @param aValues - found elements in the order of indexes
+	*/
+	void getMany(const std::vector<int>& aIndexes, std::vector<T>& aValues) const
+	{
+		getMany(m_curVersion, aIndexes, aValues);
+	}
+
+	/**
+	* Gets values of many elements of the given version at once: independent lookups advance in lockstep
+	* and prefetch their next nodes, so memory latency of one overlaps with the others.
+	* Throws exception if version isn't kept or an index is invalid
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param aIndexes - indexes of elements
+	* @param aValues - found elements in the order of indexes
+	*/
+	void getMany(int version, const std::vector<int>& aIndexes, std::vector<T>& aValues) const
+	{
+		const VersionType& root = keptVersion(version);
+		for (int index : aIndexes)
+		{
+			if (index < 0 || index >= m_size)
+			{
+				assert(index >= 0 && index < m_size);
+				throw std::exception();
+			}
+		}
+
+		root.getMany(aIndexes, aValues);
+	}
+
+	/**
+	* Gets digest of the given version, equal for versions with equal elements in this and other processes.
+	* Compiles only for PersistentArrayVersion with MerkleDigest augmentation, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @return digest
+	*/
+	std::uint64_t digest(int version) const
+	{
+		return keptVersion(version).digest();
+	}
+
+	/**
+	* Checks if two versions have equal elements: in O(1) up to digest collisions with MerkleDigest augmentation,
+	* otherwise by comparing the nodes the versions don't share. Throws exception if a version isn't kept
+	* @param firstVersion - number of version, from 0 to lastVersion() - 1
+	* @param secondVersion - number of version, from 0 to lastVersion() - 1
+	* @return true, if the versions are equal
+	*/
+	bool equals(int firstVersion, int secondVersion) const
+	{
+		return keptVersion(firstVersion).equals(keptVersion(secondVersion));
+	}
+
+	/**
+	* Calls callback(index, firstValue, secondValue) in ascending order of indexes for elements which differ
+	* between two versions. Subtrees shared by the versions are skipped, and with MerkleDigest augmentation
+	* so are subtrees with equal digests, so it takes about O(k log n) for k changes.
+	* Throws exception if a version isn't kept
+	* @param firstVersion - number of version, from 0 to lastVersion() - 1
+	* @param secondVersion - number of version, from 0 to lastVersion() - 1
+	* @param callback
+	*/
+	template<typename Callback>
+	void diff(int firstVersion, int secondVersion, const Callback& callback) const
+	{
+		keptVersion(firstVersion).diff(keptVersion(secondVersion), callback);
+	}
+
+	/**
+	* Undo last numIter operations of 'set' type, stops at the nearest older version kept by the history limit
 	* @param numIter
 	*/
 	void undo(int numIter = 1, bool clearHistory = false) override
 	{
-		m_curVersion = std::max(0, m_curVersion - numIter);
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		m_curVersion = m_versions.nearest(std::max(0, m_curVersion - numIter));
 		if (clearHistory)
 		{
-			while (m_lastVersion > m_curVersion)
-			{
-				m_versions.pop_back();
-				m_lastVersion--;
-			}
+			invalidate();
 		}
+		publish();
 	}
 
 	/**
@@ -272,7 +1054,16 @@ public:
 	*/
 	void redo(int numIter = 1)
 	{
-		m_curVersion = std::min(m_lastVersion, m_curVersion + numIter);
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		int version = std::min(m_lastVersion, m_curVersion + numIter);
+		if (version > m_curVersion)
+		{
+			m_curVersion = std::max(m_versions.nearest(version), m_versions.next(m_curVersion));
+			publish();
+		}
 	}
 
 	/**
@@ -292,8 +1083,182 @@ public:
 		return m_lastVersion + 1;
 	}
 
+	/**
+	* Turns history on or off, while it is off 'set' operations change the current version
+	* instead of creating new ones, nodes not shared with older versions are changed in place
+	* @param isEnabled
+	*/
+	void setHistoryEnabled(bool isEnabled)
+	{
+		m_isHistoryEnabled = isEnabled;
+	}
+
+	/**
+	* Sets retention policy of history, the oldest versions over the limit are released
+	* immediately and after each new version, version numbers stay the same
+	* @param limit
+	*/
+	void setHistoryLimit(const HistoryLimit& limit)
+	{
+		m_versions.setLimit(limit);
+		m_versions.prune(m_curVersion);
+	}
+
+	/**
+	* Turns publishing of snapshots on or off, while it is on the current version is published after
+	* each change, so a single writer thread can change the array while other threads read snapshots.
+	* Snapshots hold nodes of their version, so changes with history off copy them instead of changing in place.
+	* Requires VersionType with atomic reference counts and nodes which can be freed by any thread.
+	* @param isEnabled
+	*/
+	void setSnapshotsEnabled(bool isEnabled)
+	{
+		m_isSnapshotEnabled = isEnabled;
+		m_snapshots.publish(isEnabled ? makeIntrusive<PersistentArraySnapshot<T, VersionType> >(m_curVersion, m_versions[m_curVersion]) : nullptr);
+	}
+
+	/**
+	* Gets the last published snapshot, wait-free and safe to call from any thread while the array changes
+	* @return snapshot, nullptr if snapshots are off
+	*/
+	PersistentArraySnapshotPtr snapshot() const
+	{
+		return m_snapshots.acquire();
+	}
+
 private:
+	const VersionType& keptVersion(int version) const
+	{
+		if (version < 0 || version > m_lastVersion || !m_versions.contains(version))
+		{
+			assert(version >= 0 && version <= m_lastVersion && m_versions.contains(version));
+			throw std::exception();
+		}
+
+		return m_versions[version];
+	}
+
+	void publish()
+	{
+		if (m_isSnapshotEnabled)
+		{
+			m_snapshots.publish(makeIntrusive<PersistentArraySnapshot<T, VersionType> >(m_curVersion, m_versions[m_curVersion]));
+		}
+	}
+
+	void invalidate()
+	{
+		m_versions.truncate(m_curVersion);
+		m_lastVersion = m_curVersion;
+	}
+
+	void applyVersion(const VersionType& version, std::size_t numBytes)
+	{
+		if (!m_isHistoryEnabled)
+		{
+			invalidate();
+			m_versions[m_curVersion] = version;
+			publish();
+			return;
+		}
+
+		pushVersion(version, numBytes);
+	}
+
+	void pushVersion(const VersionType& version, std::size_t numBytes)
+	{
+		invalidate();
+		m_versions.push(version, numBytes);
+		m_lastVersion = ++m_curVersion;
+		m_versions.prune(m_curVersion);
+		publish();
+	}
+
 	int m_size;
 	int m_lastVersion, m_curVersion;
-	std::vector<PersistentArrayVersion<T> >m_versions;
-};
\ No newline at end of file
+	bool m_isHistoryEnabled = true;
+	bool m_isSnapshotEnabled = false;
+	bool m_isReadOnly = false;
+	VersionHistory<VersionType> m_versions;
+	SnapshotPublisher<PersistentArraySnapshot<T, VersionType> > m_snapshots;
+};
+
+template<typename T, typename VersionType>
+class PersistentArrayTransient
+{
+public:
+	/**
+	* Sets value to element with index, nodes already copied by this transient are changed in place
+	* @param index - index of element
+	* @param value
+	*/
+	void setValue(int index, T value)
+	{
+		assert(m_edit != 0);
+		if (m_edit == 0)
+			throw std::exception();
+
+		if (index < 0 || index >= m_version.size())
+		{
+			assert(index >= 0 && index < m_version.size());
+			return;
+		}
+
+		m_version.setValue(index, value, m_edit);
+	}
+
+	/**
+	* Gets value of element with index, throws exception if index is invalid
+	* @param index - index of element
+	* @return found element
+	*/
+	T getValue(int index)
+	{
+		if (index < 0 || index >= m_version.size())
+		{
+			assert(index >= 0 && index < m_version.size());
+			throw std::exception();
+		}
+
+		return m_version.getValue(index);
+	}
+
+	/**
+	* Adds all changes to the array as a single new version, or replaces the current version if history is off,
+	* and unlocks the array, the transient can't be used afterwards
+	*/
+	void commit()
+	{
+		assert(m_edit != 0);
+		if (m_edit == 0)
+			throw std::exception();
+
+		m_edit = 0;
+		m_array.m_isReadOnly = false;
+		m_array.applyVersion(m_version, allocatedNodeBytes() - m_numBytes);
+	}
+
+	/*
+	* Discards changes which weren't committed and unlocks the array
+	*/
+	~PersistentArrayTransient()
+	{
+		if (m_edit != 0)
+			m_array.m_isReadOnly = false;
+	}
+
+private:
+	friend class PersistentArray<T, VersionType>;
+
+	PersistentArrayTransient(PersistentArray<T, VersionType>& array, const VersionType& version) :
+		m_array(array),
+		m_version(version),
+		m_edit(newEditToken()),
+		m_numBytes(allocatedNodeBytes())
+	{}
+
+	PersistentArray<T, VersionType>& m_array;
+	VersionType m_version;
+	EditToken m_edit;
+	std::size_t m_numBytes;
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include<memory>
+#include<atomic>
 
 class PersistentBase
 {
@@ -7,4 +8,21 @@ public:
 	virtual void undo(int numIter = 1, bool clearHistory = false) = 0;
 	virtual int lastVersion() = 0;
 };
-using PersistentBasePtr = std::shared_ptr<PersistentBase>;
\ No newline at end of file
+using PersistentBasePtr = std::shared_ptr<PersistentBase>;
+
+/*
+* Identifies the transient editor which owns a node, nodes stamped with the token of
+* an active transient may be changed in place, 0 means the node is owned by nobody
+*/
+using EditToken = unsigned long long;
+
+/*
+* Token for editing without history: nodes referenced from a single place are changed in place
+*/
+const EditToken EXCLUSIVE_EDIT = ~EditToken(0);
+
+inline EditToken newEditToken()
+{
+	static std::atomic<EditToken> s_lastToken(0);
+	return ++s_lastToken;
+}
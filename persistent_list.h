@@ -1,45 +1,54 @@
 #include "persistent_container.h"
+#include "intrusive_ptr.h"
+#include "version_history.h"
+#include <algorithm>
 #include <cassert>
 #include <functional>
 #include <iostream>
 #include <initializer_list>
+#include <iterator>
+#include <deque>
 #include <memory>
 #include <vector>
 
 namespace
 {
 
-	template<typename T>
+	template<typename T, typename RefCountPolicy, typename Allocator>
 	class PersistentListInvalidator;
 
-	template<typename T>
+	template<typename T, typename RefCountPolicy, typename Allocator>
 	class ListNode;
 
-	template<typename T>
+	template<typename T, typename RefCountPolicy, typename Allocator>
 	struct NodeVersion
 	{
 		NodeVersion()
 		{
 			m_version = -1;
 			m_value = T{};
-			m_pLeft = m_pRight = nullptr;
+			m_pLeft = nullptr;
+			m_pRight = nullptr;
 		}
 
 		NodeVersion(const T& value, int version)
 		{
 			m_version = version;
 			m_value = value;
-			m_pLeft = m_pRight = nullptr;
+			m_pLeft = nullptr;
+			m_pRight = nullptr;
 		}
 
 		int m_version;
 		T m_value;
-		std::shared_ptr<ListNode<T> > m_pLeft;
-		std::shared_ptr<ListNode<T> > m_pRight;
+		// left links don't own nodes: the left neighbour in a kept version is reachable from its head
+		// through right links, and owning links in both directions would keep dropped nodes in cycles
+		ListNode<T, RefCountPolicy, Allocator>* m_pLeft;
+		IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > m_pRight;
 	};
 
-	template<typename T>
-	class ListNode
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	class ListNode : public RefCounted<RefCountPolicy, Allocator>
 	{
 	public:
 		ListNode() = default;
@@ -54,6 +63,11 @@ namespace
 			return m_isFull;
 		}
 
+		bool isOwned(int version)
+		{
+			return (m_isFull ? m_second.m_version : m_first.m_version) == version;
+		}
+
 		void initSecond(const T& value, int version)
 		{
 			m_second = m_first;
@@ -62,19 +76,19 @@ namespace
 			m_isFull = true;
 		}
 
-		std::shared_ptr<ListNode<T> > getLeft(int version)
+		IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > getLeft(int version)
 		{
 			assert(version >= m_first.m_version);
 			if (version < m_first.m_version)
 				return nullptr;
 
 			if (m_isFull && m_second.m_version <= version)
-				return m_second.m_pLeft;
+				return IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >(m_second.m_pLeft);
 			else
-				return m_first.m_pLeft;
+				return IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >(m_first.m_pLeft);
 		}
 
-		std::shared_ptr<ListNode<T> > getRight(int version)
+		IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > getRight(int version)
 		{
 			assert(version >= m_first.m_version);
 			if (version < m_first.m_version)
@@ -86,15 +100,15 @@ namespace
 				return m_first.m_pRight;
 		}
 
-		void setLeft(std::shared_ptr<ListNode<T> > pLeft, bool isFirst = true)
+		void setLeft(IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > pLeft, bool isFirst = true)
 		{
 			if (isFirst)
-				m_first.m_pLeft = pLeft;
+				m_first.m_pLeft = pLeft.get();
 			else
-				m_second.m_pLeft = pLeft;
+				m_second.m_pLeft = pLeft.get();
 		}
 
-		void setRight(std::shared_ptr<ListNode<T> > pRight, bool isFirst = true)
+		void setRight(IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > pRight, bool isFirst = true)
 		{
 			if (isFirst)
 				m_first.m_pRight = pRight;
@@ -133,8 +147,9 @@ namespace
 				if (version >= m_second.m_version)
 					return false;
 
-				m_second.m_pLeft.reset();
+				m_second.m_pLeft = nullptr;
 				m_second.m_pRight.reset();
+				m_isFull = false;
 				return true;
 			}
 			else
@@ -142,54 +157,76 @@ namespace
 				if (version >= m_first.m_version)
 					return false;
 
-				m_first.m_pLeft.reset();
+				m_first.m_pLeft = nullptr;
 				m_first.m_pRight.reset();
 				return true;
 			}
 		}
 
-		std::pair<int, int> versions()
+		/*
+		* Drops links of the older slot once no version from which it is read is kept
+		*/
+		void releaseFirst(int firstVersion)
+		{
+			if (m_isFull && m_second.m_version <= firstVersion)
+			{
+				m_first.m_pLeft = nullptr;
+				m_first.m_pRight.reset();
+			}
+		}
+
+		int latestVersion()
 		{
-			return std::make_pair(m_first.m_version, m_second.m_version);
+			return m_isFull ? m_second.m_version : m_first.m_version;
 		}
 
 	private:
 		bool m_isFull = false;
-		NodeVersion<T> m_first, m_second;
+		NodeVersion<T, RefCountPolicy, Allocator> m_first, m_second;
 	};
 
-	template<typename T>
+	template<typename T, typename RefCountPolicy, typename Allocator>
 	class PersistentListInvalidator
 	{
 	public:
-		using NodePtr = std::shared_ptr<ListNode<T> >;
+		using NodePtr = IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >;
 
-		PersistentListInvalidator(std::vector<NodePtr>& apHeads, std::vector<NodePtr>& apTails) :
-			m_apHeads(apHeads),
-			m_apTails(apTails)
-		{}
+		PersistentListInvalidator(const NodePtr& pEnd)
+		{
+			m_apHeads.emplace_back(0, pEnd);
+			m_apTails.emplace_back(0, pEnd);
+		}
 
 		void add(const NodePtr& pNode)
 		{
 			m_apNodes.push_back(pNode);
 		}
 
-		void addHead(const NodePtr& pNode)
+		/*
+		* Records that node is the first one of the list since version, an existing node can become
+		* the head long after it was created
+		*/
+		void addHead(int version, const NodePtr& pNode)
 		{
-			m_apHeads.push_back(pNode);
+			m_apHeads.emplace_back(version, pNode);
 		}
 
-		void addTail(const NodePtr& pNode)
+		/*
+		* Records that node is the end of the list since version
+		*/
+		void addTail(int version, const NodePtr& pNode)
 		{
-			m_apTails.push_back(pNode);
+			m_apTails.emplace_back(version, pNode);
 		}
 
-		void updateLastHead(int version)
+		const NodePtr& head(int version) const
 		{
-			if (m_apHeads.back()->getLeft(version) != nullptr)
-			{
-				m_apHeads.back() = m_apHeads.back()->getLeft(version);
-			}
+			return find(m_apHeads, version);
+		}
+
+		const NodePtr& tail(int version) const
+		{
+			return find(m_apTails, version);
 		}
 
 		void invalidate(int version)
@@ -198,25 +235,187 @@ namespace
 			{
 				m_apNodes.pop_back();
 			}
-			while (!m_apHeads.empty() && m_apHeads.back()->versions().first > version)
+			while (m_apHeads.back().first > version)
 			{
 				m_apHeads.pop_back();
 			}
+			while (m_apTails.back().first > version)
+			{
+				m_apTails.pop_back();
+			}
+		}
+
+		void setMaxVersions(int maxVersions)
+		{
+			m_maxVersions = maxVersions;
+		}
+
+		int firstVersion()
+		{
+			return m_firstVersion;
+		}
+
+		/*
+		* Moves the oldest kept version up to meet the limit and forgets heads, tails and
+		* changed nodes which only older versions need
+		*/
+		void prune(int lastVersion)
+		{
+			if (m_maxVersions <= 0 || lastVersion - m_firstVersion < m_maxVersions)
+				return;
+
+			m_firstVersion = lastVersion - m_maxVersions + 1;
+			while (!m_apNodes.empty() && m_apNodes.front()->latestVersion() <= m_firstVersion)
+			{
+				m_apNodes.front()->releaseFirst(m_firstVersion);
+				m_apNodes.pop_front();
+			}
+			prune(m_apHeads);
+			prune(m_apTails);
 		}
 
 	private:
-		std::vector<NodePtr>& m_apHeads;
-		std::vector<NodePtr>& m_apTails;
-		std::vector<NodePtr> m_apNodes;
+		using VersionedNode = std::pair<int, NodePtr>;
+
+		/*
+		* Gets the node recorded last at or before version, ends are recorded in ascending order of versions
+		*/
+		static const NodePtr& find(const std::vector<VersionedNode>& apEnds, int version)
+		{
+			auto it = std::upper_bound(apEnds.begin(), apEnds.end(), version,
+				[](int version, const VersionedNode& end) { return version < end.first; });
+			return it == apEnds.begin() ? it->second : std::prev(it)->second;
+		}
+
+		void prune(std::vector<VersionedNode>& apEnds)
+		{
+			int ind = 0;
+			while (ind + 1 < (int)apEnds.size() && apEnds[ind + 1].first <= m_firstVersion)
+			{
+				ind++;
+			}
+			apEnds.erase(apEnds.begin(), apEnds.begin() + ind);
+		}
+
+		std::vector<VersionedNode> m_apHeads;
+		std::vector<VersionedNode> m_apTails;
+		std::deque<NodePtr> m_apNodes;
+		int m_maxVersions = 0;
+		int m_firstVersion = 0;
+	};
+
+	/*
+	* Prepares node for changes in version: owned nodes are changed in place, nodes with
+	* a free slot get it initialized, returns false if node is full and has to be copied
+	*/
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	bool acquire(const IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >& pNode, int version, PersistentListInvalidator<T, RefCountPolicy, Allocator>& invalidator)
+	{
+		if (pNode->isOwned(version))
+			return true;
+
+		if (pNode->isFull())
+			return false;
+
+		pNode->initSecond(pNode->getVal(version), version);
+		invalidator.add(pNode);
+		return true;
+	}
+
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	void copyLeft(const IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >& pFirst, IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > pPrev, int readVersion, int writeVersion,
+		PersistentListInvalidator<T, RefCountPolicy, Allocator>& invalidator)
+	{
+		for (auto pLeft = pFirst; pLeft != nullptr; pLeft = pLeft->getLeft(readVersion))
+		{
+			if (acquire(pLeft, writeVersion, invalidator))
+			{
+				pLeft->setRight(pPrev, !pLeft->isFull());
+				pPrev->setLeft(pLeft, !pPrev->isFull());
+				break;
+			}
+
+			auto pCopy = makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >(pLeft->getVal(readVersion), writeVersion);
+			pPrev->setLeft(pCopy, !pPrev->isFull());
+			pCopy->setRight(pPrev);
+			invalidator.add(pCopy);
+
+			if (pLeft->getLeft(readVersion) == nullptr)
+			{
+				invalidator.addHead(writeVersion, pCopy);
+			}
+			pPrev = pCopy;
+		}
+	}
+
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	void copyRight(const IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >& pFirst, IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> > pPrev, int readVersion, int writeVersion,
+		PersistentListInvalidator<T, RefCountPolicy, Allocator>& invalidator)
+	{
+		for (auto pRight = pFirst; pRight != nullptr; pRight = pRight->getRight(readVersion))
+		{
+			if (acquire(pRight, writeVersion, invalidator))
+			{
+				pRight->setLeft(pPrev, !pRight->isFull());
+				pPrev->setRight(pRight, !pPrev->isFull());
+				break;
+			}
+
+			auto pCopy = makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >(pRight->getVal(readVersion), writeVersion);
+			pPrev->setRight(pCopy, !pPrev->isFull());
+			pCopy->setLeft(pPrev);
+			invalidator.add(pCopy);
+
+			if (pRight->getRight(readVersion) == nullptr)
+			{
+				invalidator.addTail(writeVersion, pCopy);
+			}
+			pPrev = pCopy;
+		}
+	}
+
+	/*
+	* Version counters of a list editor, the list itself or a transient. A transient writes all its changes
+	* to m_transientVersion, the list to the version following the current one
+	*/
+	struct ListVersions
+	{
+		int writeVersion() const
+		{
+			return m_transientVersion == m_version ? m_version : m_version + 1;
+		}
+
+		// version which is read and changed
+		int m_version = 0;
+		// newest version reachable by redo
+		int m_lastVersion = 0;
+		// version written by a transient, -1 for the list
+		int m_transientVersion = -1;
+		// set for iterators pinned to a version, committed transients and the list locked by a transient
+		bool m_isReadOnly = false;
 	};
 
+	/*
+	* Makes version the current and the last one of the editor. Versions of the list are pruned
+	* to the history limit at once, the version of a transient on commit
+	*/
+	template<typename T, typename RefCountPolicy, typename Allocator>
+	void setVersion(ListVersions& versions, int version, PersistentListInvalidator<T, RefCountPolicy, Allocator>& invalidator)
+	{
+		versions.m_lastVersion = versions.m_version = version;
+		if (versions.m_transientVersion < 0)
+			invalidator.prune(version);
+	}
 
 }
 
-template<typename T>
+template<typename T, typename RefCountPolicy = AtomicRefCount, typename Allocator = HeapAllocator>
 class PersistentList;
 
-template<typename T>
+template<typename T, typename RefCountPolicy, typename Allocator>
+class PersistentListTransient;
+
+template<typename T, typename RefCountPolicy, typename Allocator>
 class PersistentListIterator
 {
 public:
@@ -229,7 +428,7 @@ public:
 		if (m_pItem == nullptr)
 			throw std::exception();
 
-		m_pItem = m_pItem->getRight(m_version);
+		m_pItem = m_pItem->getRight(m_versions.m_version);
 	}
 
 	/*
@@ -241,7 +440,7 @@ public:
 		if (m_pItem == nullptr)
 			throw std::exception();
 
-		m_pItem = m_pItem->getLeft(m_version);
+		m_pItem = m_pItem->getLeft(m_versions.m_version);
 	}
 
 	/*
@@ -254,45 +453,44 @@ public:
 		if (m_pItem == nullptr)
 			throw std::exception();
 
-		return m_pItem->getRight(m_version) == nullptr;
+		return m_pItem->getRight(m_versions.m_version) == nullptr;
 	}
 
 	/**
-	* Sets value to the element which iterator points to
+	* Sets value to the element which iterator points to, throws exception if iterator is pinned to a version
+	* or its list is locked by a transient
 	* @param value
 	*/
 	void setVal(const T& val)
 	{
-		assert(m_pItem != nullptr);
-		if (m_pItem == nullptr)
+		assert(m_pItem != nullptr && !m_versions.m_isReadOnly);
+		if (m_pItem == nullptr || m_versions.m_isReadOnly)
 			throw std::exception();
 
-		m_pInvalidator->invalidate(m_version);
+		int readVersion = m_versions.m_version;
+		m_pInvalidator->invalidate(readVersion);
+		int version = m_versions.writeVersion();
 
-		if (!m_pItem->isFull())
+		if (acquire(m_pItem, version, *m_pInvalidator))
 		{
-			m_pItem->initSecond(val, m_version + 1);
-			m_pInvalidator->add(m_pItem);
+			m_pItem->setVal(val, version);
 		}
 		else
 		{
-			auto pNode = std::make_shared<ListNode<T> >(val, m_version + 1);
-			auto pPrev = pNode;
+			auto pNode = makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >(val, version);
+			m_pInvalidator->add(pNode);
 
-			if (m_pItem->getLeft(m_version) == nullptr)
+			if (m_pItem->getLeft(readVersion) == nullptr)
 			{
-				m_pInvalidator->addHead(pNode);
+				m_pInvalidator->addHead(version, pNode);
 			}
 
-			copyLeft(m_pItem->getLeft(m_version), val, pPrev);
-
-			pPrev = pNode;
-			copyRight(m_pItem->getRight(m_version), val, pPrev);
+			copyLeft(m_pItem->getLeft(readVersion), pNode, readVersion, version, *m_pInvalidator);
+			copyRight(m_pItem->getRight(readVersion), pNode, readVersion, version, *m_pInvalidator);
+			m_pItem = pNode;
 		}
 
-		m_pInvalidator->updateLastHead(m_version + 1);
-
-		m_lastVersion = ++m_version;
+		setVersion(m_versions, version, *m_pInvalidator);
 	}
 
 	/**
@@ -301,98 +499,59 @@ public:
 	*/
 	T getVal()
 	{
-		assert(m_pItem != nullptr && m_pItem->getRight(m_version) != nullptr);
-		if (m_pItem == nullptr || m_pItem->getRight(m_version) == nullptr)
+		assert(m_pItem != nullptr && m_pItem->getRight(m_versions.m_version) != nullptr);
+		if (m_pItem == nullptr || m_pItem->getRight(m_versions.m_version) == nullptr)
 			throw std::exception();
 
-		return m_pItem->getVal(m_version);
+		return m_pItem->getVal(m_versions.m_version);
 	}
 
 private:
-	using NodePtr = std::shared_ptr<ListNode<T> >;
-	friend class PersistentList<T>;
+	using NodePtr = IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >;
+	friend class PersistentList<T, RefCountPolicy, Allocator>;
 
-	PersistentListIterator(const NodePtr& pNode, int& version, int& lastVer, std::shared_ptr<PersistentListInvalidator<T> > pInvalidator) :
-		m_version(version),
-		m_lastVersion(lastVer),
-		m_pInvalidator(pInvalidator)
+	/*
+	* Iterator which follows versions of its editor, the list or a transient
+	*/
+	PersistentListIterator(const NodePtr& pNode, ListVersions& versions, std::shared_ptr<PersistentListInvalidator<T, RefCountPolicy, Allocator> > pInvalidator) :
+		m_pInvalidator(pInvalidator),
+		m_versions(versions)
 	{
 		m_pItem = pNode;
 	}
 
-	void copyLeft(const NodePtr& pFirst, const T& val, NodePtr& pPrev)
+	/*
+	* Read only iterator over a fixed version, it doesn't follow undo and redo of the list
+	*/
+	PersistentListIterator(const NodePtr& pNode, int version, std::shared_ptr<PersistentListInvalidator<T, RefCountPolicy, Allocator> > pInvalidator) :
+		m_pInvalidator(pInvalidator),
+		m_pinnedVersions{ version, version, -1, true },
+		m_versions(m_pinnedVersions)
 	{
-		for (auto pLeft = pFirst; pLeft != nullptr; pLeft = pLeft->getLeft(m_version))
-		{
-			if (pLeft->isFull())
-			{
-				auto pCopy = std::make_shared<ListNode<T> >(pLeft->getVal(m_version), m_version + 1);
-				pPrev->setLeft(pCopy);
-				pCopy->setRight(pPrev);
-				m_pInvalidator->add(pCopy);
-
-				if (pLeft->getLeft(m_version) == nullptr)
-				{
-					m_pInvalidator->addHead(pCopy);
-				}
-				pPrev = pCopy;
-			}
-			else
-			{
-				pLeft->initSecond(val, m_version + 1);
-				pLeft->setRight(pPrev, false);
-				pPrev->setLeft(pLeft);
-				m_pInvalidator->add(pLeft);
-				break;
-			}
-		}
+		m_pItem = pNode;
 	}
 
-	void copyRight(const NodePtr& pFirst, const T& val, NodePtr& pPrev)
-	{
-		for (auto pRight = pFirst; pRight != nullptr; pRight = pRight->getRight(m_version))
-		{
-			if (pRight->isFull())
-			{
-				auto pCopy = std::make_shared<ListNode<T> >(pRight->getVal(m_version), m_version + 1);
-				pPrev->setRight(pCopy);
-				pCopy->setLeft(pPrev);
-				m_pInvalidator->add(pCopy);
-				pPrev = pCopy;
-
-				if (pRight->getRight(m_version) == nullptr)
-				{
-					m_pInvalidator->addTail(pCopy);
-				}
-			}
-			else
-			{
-				pRight->initSecond(val, m_version + 1);
-				pRight->setLeft(pPrev, false);
-				pPrev->setRight(pRight);
-				m_pInvalidator->add(pRight);
-				break;
-			}
-		}
-	}
+	PersistentListIterator(const PersistentListIterator&) = delete;
+	PersistentListIterator& operator=(const PersistentListIterator&) = delete;
 
-	std::shared_ptr<PersistentListInvalidator <T> > m_pInvalidator;
-	int &m_version, &m_lastVersion;
+	std::shared_ptr<PersistentListInvalidator<T, RefCountPolicy, Allocator> > m_pInvalidator;
+	ListVersions m_pinnedVersions;
+	ListVersions& m_versions;
 	NodePtr m_pItem;
 };
 
-template<typename T>
+template<typename T, typename RefCountPolicy, typename Allocator>
 class PersistentList : public PersistentBase
 {
 public:
-	friend class PersistentListIterator<T>;
-	using PersistentListIteratorPtr = std::shared_ptr<PersistentListIterator<T> >;
+	friend class PersistentListIterator<T, RefCountPolicy, Allocator>;
+	friend class PersistentListTransient<T, RefCountPolicy, Allocator>;
+	using PersistentListIteratorPtr = std::shared_ptr<PersistentListIterator<T, RefCountPolicy, Allocator> >;
+	using PersistentListTransientPtr = std::shared_ptr<PersistentListTransient<T, RefCountPolicy, Allocator> >;
 
 	PersistentList()
 	{
-		m_apHeads.push_back(std::make_shared<ListNode<T> >());
-		m_apTails = m_apHeads;
-		m_pInvalidator = std::make_shared<PersistentListInvalidator<T> >(m_apHeads, m_apTails);
+		m_pInvalidator = std::make_shared<PersistentListInvalidator<T, RefCountPolicy, Allocator> >(makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >());
 	}
 
 	/**
@@ -401,17 +560,24 @@ public:
 	*/
 	PersistentListIteratorPtr begin()
 	{
-		int ind = 0;
-		for (int i = (int)m_apHeads.size() - 1; i >= 0; i--)
+		return newIterator(m_pInvalidator->head(m_versions.m_version), m_versions);
+	}
+
+	/**
+	* Gets new read only iterator to the beginning of the list in the given version, it doesn't move
+	* the current version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @return iterator to the beginning
+	*/
+	PersistentListIteratorPtr begin(int version) const
+	{
+		if (version < m_pInvalidator->firstVersion() || version > m_versions.m_lastVersion)
 		{
-			if (m_apHeads[i]->versions().first <= m_version)
-			{
-				ind = i;
-				break;
-			}
+			assert(version >= m_pInvalidator->firstVersion() && version <= m_versions.m_lastVersion);
+			throw std::exception();
 		}
 
-		auto pBegin = std::shared_ptr<PersistentListIterator<T> >(new PersistentListIterator<T>(m_apHeads[ind], m_version, m_lastVersion, m_pInvalidator));
+		auto pBegin = std::shared_ptr<PersistentListIterator<T, RefCountPolicy, Allocator> >(new PersistentListIterator<T, RefCountPolicy, Allocator>(m_pInvalidator->head(version), version, m_pInvalidator));
 		return pBegin;
 	}
 
@@ -421,263 +587,322 @@ public:
 	*/
 	PersistentListIteratorPtr end()
 	{
-		int ind = 0;
-		for (int i = (int)m_apTails.size() - 1; i >= 0; i--)
-		{
-			if (m_apTails[i]->versions().first <= m_version)
-			{
-				ind = i;
-				break;
-			}
-		}
-
-		auto pEnd = std::shared_ptr<PersistentListIterator<T> >(new PersistentListIterator<T>(m_apTails[ind], m_version, m_lastVersion, m_pInvalidator));
-		return pEnd;
+		return newIterator(m_pInvalidator->tail(m_versions.m_version), m_versions);
 	}
 
 	/**
 	* Inserts new element to the position, which itarator points to, throws exception if iterator is invalid
+	* or the list is locked by a transient
 	* @param pIter - poiner to the iterator
 	* @param val - value of element
 	*/
 	PersistentListIteratorPtr insert(PersistentListIteratorPtr& pIter, T val)
 	{
-		assert(pIter != nullptr);
-		if (pIter == nullptr)
-			throw std::exception();
+		return insert(pIter, val, m_versions);
+	}
 
-		m_pInvalidator->invalidate(m_version);
+	/**
+	* Erases element which iterator points to, throws exception if iterator is invalid or points to the end,
+	* or the list is locked by a transient
+	* @param key
+	* @return true, if element is successfully deleted
+	*/
+	PersistentListIteratorPtr erase(PersistentListIteratorPtr& pIter)
+	{
+		return erase(pIter, m_versions);
+	}
 
-		auto pNode = std::make_shared<ListNode<T> >(val, m_version + 1);
-		m_pInvalidator->add(pNode);
+	/**
+	* Prints elements of the list
+	*/
+	void print()
+	{
+		for (auto pIter = begin(); !pIter->done(); pIter->next())
+		{
+			std::cout << pIter->getVal() << " ";
+		}
+		puts("");
+	}
 
-		if (pIter->m_pItem->getLeft(m_version) == nullptr)
+	/**
+	* Undo last numIter operations of 'set', 'insert', 'erase' types, stops at the oldest version kept by the history limit.
+	* Throws exception if the list is locked by a transient
+	* @param numIter
+	*/
+	void undo(int numIter = 1, bool clearHistory = false) override
+	{
+		assert(!m_versions.m_isReadOnly);
+		if (m_versions.m_isReadOnly)
+			throw std::exception();
+
+		m_versions.m_version = std::max(m_pInvalidator->firstVersion(), m_versions.m_version - numIter);
+		if (clearHistory)
 		{
-			m_pInvalidator->addHead(pNode);
+			m_pInvalidator->invalidate(m_versions.m_version);
 		}
+	}
 
-		auto pPrev = pNode;
-		copyLeft(pIter->m_pItem->getLeft(m_version), pPrev);
+	/**
+	* Reapplies last cancelled numIter operations of 'set', 'insert', 'erase' types.
+	* Throws exception if the list is locked by a transient
+	* @param numIter
+	*/
+	void redo(int numIter = 1)
+	{
+		assert(!m_versions.m_isReadOnly);
+		if (m_versions.m_isReadOnly)
+			throw std::exception();
 
-		pPrev = pNode;
-		copyRight(pIter->m_pItem, pPrev);
+		m_versions.m_version = std::min(m_versions.m_lastVersion, m_versions.m_version + numIter);
+	}
 
-		m_pInvalidator->updateLastHead(m_version + 1);
+	/*
+	* Gets number of versions of the array
+	* @return number of versions
+	*/
+	int lastVersion() override
+	{
+		return m_versions.m_lastVersion + 1;
+	}
+
+	/**
+	* Starts transient editing of the current version. Changes made through the transient form a single
+	* version, which the list sees only after commit, nodes created or copied by that version are changed
+	* in place instead of being copied again. Versions reachable by redo are dropped, and until the transient
+	* is committed or destroyed the list can be read but not changed
+	* @return transient editor, destroying it without commit discards its changes
+	*/
+	PersistentListTransientPtr beginTransient()
+	{
+		assert(!m_versions.m_isReadOnly);
+		if (m_versions.m_isReadOnly)
+			throw std::exception();
 
-		m_lastVersion = ++m_version;
-		pIter = std::shared_ptr<PersistentListIterator<T> >(new PersistentListIterator<T>(pNode->getRight(m_version), m_version, m_lastVersion, m_pInvalidator));
-		auto pNewIter = std::shared_ptr<PersistentListIterator<T> >(new PersistentListIterator<T>(pNode, m_version, m_lastVersion, m_pInvalidator));
-		return pNewIter;
+		m_pInvalidator->invalidate(m_versions.m_version);
+		m_versions.m_lastVersion = m_versions.m_version;
+		m_versions.m_isReadOnly = true;
+		return PersistentListTransientPtr(new PersistentListTransient<T, RefCountPolicy, Allocator>(*this));
 	}
 
 	/**
-	* Erases element which iterator points to, throws exception if iterator is invalid or points to the end
-	* @param key
-	* @return true, if element is successfully deleted
+	* Sets retention policy of history, only the number of versions is limited for the list:
+	* older versions can't be reached by undo and the nodes only they use are released,
+	* so iterators left on released versions must not be used.
+	* Throws exception if a byte budget or checkpoints are set, the list has neither
+	* @param limit
 	*/
-	PersistentListIteratorPtr erase(PersistentListIteratorPtr& pIter)
+	void setHistoryLimit(const HistoryLimit& limit)
+	{
+		assert(limit.m_maxBytes == 0 && limit.m_checkpointInterval == 0);
+		if (limit.m_maxBytes != 0 || limit.m_checkpointInterval != 0)
+			throw std::exception();
+
+		m_pInvalidator->setMaxVersions(limit.m_maxVersions);
+		m_pInvalidator->prune(m_versions.m_version);
+	}
+
+private:
+	using NodePtr = IntrusivePtr<ListNode<T, RefCountPolicy, Allocator> >;
+
+	PersistentListIteratorPtr newIterator(const NodePtr& pNode, ListVersions& versions)
 	{
-		assert(pIter != nullptr && pIter->m_pItem->getRight(m_version) != nullptr);
-		if (pIter == nullptr && pIter->m_pItem->getRight(m_version) != nullptr)
+		return PersistentListIteratorPtr(new PersistentListIterator<T, RefCountPolicy, Allocator>(pNode, versions, m_pInvalidator));
+	}
+
+	/*
+	* Inserts element for the editor which owns versions, the list or a transient
+	*/
+	PersistentListIteratorPtr insert(PersistentListIteratorPtr& pIter, const T& val, ListVersions& versions)
+	{
+		assert(pIter != nullptr && &pIter->m_versions == &versions && !versions.m_isReadOnly);
+		if (pIter == nullptr || &pIter->m_versions != &versions || versions.m_isReadOnly)
 			throw std::exception();
 
-		m_pInvalidator->invalidate(m_version);
+		int readVersion = versions.m_version;
+		m_pInvalidator->invalidate(readVersion);
+		int version = versions.writeVersion();
 
-		auto pLeftNode = pIter->m_pItem->getLeft(m_version);
-		auto pRightNode = pIter->m_pItem->getRight(m_version);
+		auto pNode = makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >(val, version);
+		m_pInvalidator->add(pNode);
+
+		if (pIter->m_pItem->getLeft(readVersion) == nullptr)
+		{
+			m_pInvalidator->addHead(version, pNode);
+		}
+
+		copyLeft(pIter->m_pItem->getLeft(readVersion), pNode, readVersion, version, *m_pInvalidator);
+		copyRight(pIter->m_pItem, pNode, readVersion, version, *m_pInvalidator);
+
+		setVersion(versions, version, *m_pInvalidator);
+		pIter = newIterator(pNode->getRight(version), versions);
+		return newIterator(pNode, versions);
+	}
+
+	/*
+	* Erases element for the editor which owns versions, the list or a transient
+	*/
+	PersistentListIteratorPtr erase(PersistentListIteratorPtr& pIter, ListVersions& versions)
+	{
+		assert(pIter != nullptr && &pIter->m_versions == &versions && !versions.m_isReadOnly);
+		if (pIter == nullptr || &pIter->m_versions != &versions || versions.m_isReadOnly)
+			throw std::exception();
+
+		int readVersion = versions.m_version;
+		assert(pIter->m_pItem->getRight(readVersion) != nullptr);
+		if (pIter->m_pItem->getRight(readVersion) == nullptr)
+			throw std::exception();
+
+		m_pInvalidator->invalidate(readVersion);
+		int version = versions.writeVersion();
+
+		auto pLeftNode = pIter->m_pItem->getLeft(readVersion);
+		auto pRightNode = pIter->m_pItem->getRight(readVersion);
 
 		NodePtr pLeftClonedNode = nullptr, pRightClonedNode = nullptr;
 
-		if (pLeftNode != nullptr)
+		if (pLeftNode != nullptr && !acquire(pLeftNode, version, *m_pInvalidator))
 		{
-			if (!pLeftNode->isFull())
+			pLeftClonedNode = makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >(pLeftNode->getVal(readVersion), version);
+			m_pInvalidator->add(pLeftClonedNode);
+			if (pLeftNode->getLeft(readVersion) == nullptr)
 			{
-				pLeftNode->initSecond(pLeftNode->getVal(m_version), m_version + 1);
-				m_pInvalidator->add(pLeftNode);
-			}
-			else
-			{
-				pLeftClonedNode = std::make_shared<ListNode<T> >(pLeftNode->getVal(m_version), m_version + 1);
-				m_pInvalidator->add(pLeftClonedNode);
-				if (pLeftNode->getLeft(m_version) == nullptr)
-				{
-					m_pInvalidator->addHead(pLeftClonedNode);
-				}
-
-				auto pPrev = pLeftClonedNode;
-				copyLeft(pLeftNode->getLeft(m_version), pPrev);
+				m_pInvalidator->addHead(version, pLeftClonedNode);
 			}
+
+			copyLeft(pLeftNode->getLeft(readVersion), pLeftClonedNode, readVersion, version, *m_pInvalidator);
 		}
 
-		if (!pRightNode->isFull())
+		if (acquire(pRightNode, version, *m_pInvalidator))
 		{
-			pRightNode->initSecond(pRightNode->getVal(m_version), m_version + 1);
-			m_pInvalidator->add(pRightNode);
 			if (pLeftNode == nullptr)
 			{
-				pRightNode->setLeft(nullptr, false);
-				m_pInvalidator->addHead(pRightNode);
+				pRightNode->setLeft(nullptr, !pRightNode->isFull());
+				m_pInvalidator->addHead(version, pRightNode);
 			}
 		}
 		else
 		{
-			pRightClonedNode = std::make_shared<ListNode<T> >(pRightNode->getVal(m_version), m_version + 1);
+			pRightClonedNode = makeIntrusive<ListNode<T, RefCountPolicy, Allocator> >(pRightNode->getVal(readVersion), version);
 			m_pInvalidator->add(pRightClonedNode);
 			if (pLeftNode == nullptr)
 			{
-				m_pInvalidator->addHead(pRightClonedNode);
+				m_pInvalidator->addHead(version, pRightClonedNode);
+			}
+			if (pRightNode->getRight(readVersion) == nullptr)
+			{
+				m_pInvalidator->addTail(version, pRightClonedNode);
 			}
 
-			auto pPrev = pRightClonedNode;
-			copyRight(pRightNode->getRight(m_version), pPrev);
+			copyRight(pRightNode->getRight(readVersion), pRightClonedNode, readVersion, version, *m_pInvalidator);
 		}
 
 		if (pLeftNode != nullptr)
 		{
-			if (pLeftClonedNode == nullptr)
-			{
-				if (pRightClonedNode == nullptr)
-				{
-					pLeftNode->setRight(pRightNode, false);
-					pRightNode->setLeft(pLeftNode, false);
-				}
-				else
-				{
-					pLeftNode->setRight(pRightClonedNode, false);
-					pRightClonedNode->setLeft(pLeftNode);
-				}
-			}
-			else
-			{
-				if (pRightClonedNode == nullptr)
-				{
-					pLeftClonedNode->setRight(pRightNode);
-					pRightNode->setLeft(pLeftClonedNode, false);
-				}
-				else
-				{
-					pLeftClonedNode->setRight(pRightClonedNode);
-					pRightClonedNode->setLeft(pLeftClonedNode);
-				}
-			}
+			auto pNewLeft = pLeftClonedNode != nullptr ? pLeftClonedNode : pLeftNode;
+			auto pNewRight = pRightClonedNode != nullptr ? pRightClonedNode : pRightNode;
+			pNewLeft->setRight(pNewRight, !pNewLeft->isFull());
+			pNewRight->setLeft(pNewLeft, !pNewRight->isFull());
 		}
 
-		m_pInvalidator->updateLastHead(m_version + 1);
-
-		m_lastVersion = ++m_version;
+		setVersion(versions, version, *m_pInvalidator);
 		pIter.reset();
 
-		if (pRightClonedNode != nullptr)
-			return std::shared_ptr<PersistentListIterator<T> >(new PersistentListIterator<T>(pRightClonedNode, m_version, m_lastVersion, m_pInvalidator));
-		else
-			return std::shared_ptr<PersistentListIterator<T> >(new PersistentListIterator<T>(pRightNode, m_version, m_lastVersion, m_pInvalidator));
+		return newIterator(pRightClonedNode != nullptr ? pRightClonedNode : pRightNode, versions);
 	}
 
+private:
+	ListVersions m_versions;
+	std::shared_ptr<PersistentListInvalidator<T, RefCountPolicy, Allocator> > m_pInvalidator;
+};
+
+/*
+* Editor of a list version: its changes are written to the version following the current one, which
+* the list sees only after commit. Iterators of the transient must not be used after it is destroyed
+*/
+template<typename T, typename RefCountPolicy, typename Allocator>
+class PersistentListTransient
+{
+public:
+	using PersistentListIteratorPtr = typename PersistentList<T, RefCountPolicy, Allocator>::PersistentListIteratorPtr;
+
 	/**
-	* Prints elements of the list
+	* Gets new itarator to the beginning of the transient version, setVal through it changes the transient
+	* @return iterator to the beginning
 	*/
-	void print()
+	PersistentListIteratorPtr begin()
 	{
-		for (auto pIter = begin(); !pIter->done(); pIter->next())
-		{
-			std::cout << pIter->getVal() << " ";
-		}
-		puts("");
+		return m_list.newIterator(m_list.m_pInvalidator->head(m_versions.m_version), m_versions);
 	}
 
 	/**
-	* Undo last numIter operations of 'set', 'insert', 'erase' types
-	* @param numIter
+	* Gets new itarator to the end of the transient version
+	* @return iterator to the end
 	*/
-	void undo(int numIter = 1, bool clearHistory = false) override
+	PersistentListIteratorPtr end()
 	{
-		m_version = std::max(0, m_version - numIter);
-		if (clearHistory)
-		{
-			m_pInvalidator->invalidate(m_version);
-		}
+		return m_list.newIterator(m_list.m_pInvalidator->tail(m_versions.m_version), m_versions);
 	}
 
 	/**
-	* Reapplies last cancelled numIter operations of 'set', 'insert', 'erase' types
-	* @param numIter
+	* Inserts new element to the position, which iterator of the transient points to, throws exception
+	* if iterator is invalid or the transient is committed
+	* @param pIter - poiner to the iterator
+	* @param val - value of element
 	*/
-	void redo(int numIter = 1)
+	PersistentListIteratorPtr insert(PersistentListIteratorPtr& pIter, T val)
 	{
-		m_version = std::min(m_lastVersion, m_version + numIter);
+		return m_list.insert(pIter, val, m_versions);
 	}
 
-	/*
-	* Gets number of versions of the array
-	* @return number of versions
+	/**
+	* Erases element which iterator of the transient points to, throws exception if iterator is invalid
+	* or points to the end, or the transient is committed
+	* @param pIter - poiner to the iterator
 	*/
-	int lastVersion() override
+	PersistentListIteratorPtr erase(PersistentListIteratorPtr& pIter)
 	{
-		return m_lastVersion + 1;
+		return m_list.erase(pIter, m_versions);
 	}
 
-private:
-	void copyLeft(const std::shared_ptr<ListNode<T> >& pFirst, std::shared_ptr<ListNode<T> >& pPrev)
+	/**
+	* Adds all changes to the list as a single new version and unlocks the list, the transient can't be used afterwards
+	*/
+	void commit()
 	{
-		for (auto pLeft = pFirst; pLeft != nullptr; pLeft = pLeft->getLeft(m_version))
-		{
-			if (pLeft->isFull())
-			{
-				auto pCopy = std::make_shared<ListNode<T> >(pLeft->getVal(m_version), m_version + 1);
-				pPrev->setLeft(pCopy);
-				pCopy->setRight(pPrev);
-				m_pInvalidator->add(pCopy);
-
-				if (pLeft->getLeft(m_version) == nullptr)
-				{
-					m_pInvalidator->addHead(pCopy);
-				}
-				pPrev = pCopy;
-			}
-			else
-			{
-				pLeft->initSecond(pLeft->getVal(m_version), m_version + 1);
-				pLeft->setRight(pPrev, false);
-				pPrev->setLeft(pLeft);
-				m_pInvalidator->add(pLeft);
-				break;
-			}
-		}
+		assert(!m_versions.m_isReadOnly);
+		if (m_versions.m_isReadOnly)
+			throw std::exception();
+
+		m_versions.m_isReadOnly = true;
+		ListVersions& listVersions = m_list.m_versions;
+		listVersions.m_isReadOnly = false;
+		listVersions.m_version = listVersions.m_lastVersion = m_versions.m_transientVersion;
+		m_list.m_pInvalidator->prune(listVersions.m_version);
 	}
 
-	void copyRight(const std::shared_ptr<ListNode<T> >& pFirst, std::shared_ptr<ListNode<T> >& pPrev)
+	/*
+	* Discards changes which weren't committed and unlocks the list
+	*/
+	~PersistentListTransient()
 	{
-		for (auto pRight = pFirst; pRight != nullptr; pRight = pRight->getRight(m_version))
+		if (!m_versions.m_isReadOnly)
 		{
-			if (pRight->isFull())
-			{
-				auto pCopy = std::make_shared<ListNode<T> >(pRight->getVal(m_version), m_version + 1);
-				pPrev->setRight(pCopy);
-				pCopy->setLeft(pPrev);
-				m_pInvalidator->add(pCopy);
-				pPrev = pCopy;
-
-				if (pRight->getRight(m_version) == nullptr)
-				{
-					m_pInvalidator->addTail(pCopy);
-				}
-			}
-			else
-			{
-				pRight->initSecond(pRight->getVal(m_version), m_version + 1);
-				pRight->setLeft(pPrev, false);
-				pPrev->setRight(pRight);
-				m_pInvalidator->add(pRight);
-				break;
-			}
+			m_list.m_pInvalidator->invalidate(m_list.m_versions.m_version);
+			m_list.m_versions.m_isReadOnly = false;
 		}
 	}
 
 private:
-	using NodePtr = std::shared_ptr<ListNode<T> >;
+	friend class PersistentList<T, RefCountPolicy, Allocator>;
+
+	PersistentListTransient(PersistentList<T, RefCountPolicy, Allocator>& list) :
+		m_list(list),
+		m_versions{ list.m_versions.m_version, list.m_versions.m_version, list.m_versions.m_version + 1, false }
+	{}
+
+	PersistentListTransient(const PersistentListTransient&) = delete;
+	PersistentListTransient& operator=(const PersistentListTransient&) = delete;
 
-	int m_version = 0, m_lastVersion = 0;
-	std::vector<NodePtr> m_apHeads;
-	std::vector<NodePtr> m_apTails;
-	std::shared_ptr<PersistentListInvalidator<T> > m_pInvalidator;
+	PersistentList<T, RefCountPolicy, Allocator>& m_list;
+	ListVersions m_versions;
 };
@@ -1,336 +1,3498 @@
 #include "persistent_container.h"
+#include "intrusive_ptr.h"
+#include "augmentation.h"
+#include "version_history.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <new>
 #include <random> 
 #include <iostream>
+#include <vector>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 namespace
 {
 
-	template<typename KeyType, typename ValueType>
-	class TreapNode : public std::enable_shared_from_this<TreapNode<KeyType, ValueType> >
+	/*
+	* Augmentation policy which keeps sizes of subtrees, enables order statistics: kth, rank, countRange
+	*/
+	struct SubtreeSize
 	{
-	public:
-		using TreapNodePtr = std::shared_ptr<TreapNode<KeyType, ValueType> >;
-		using super = std::enable_shared_from_this<TreapNode<KeyType, ValueType> >;
+		template<typename KeyType, typename ValueType>
+		struct Data
+		{
+			void update(const Data* pLeft, const Data* pRight, const KeyType&, const ValueType&)
+			{
+				m_size = 1 + (pLeft == nullptr ? 0 : pLeft->m_size) + (pRight == nullptr ? 0 : pRight->m_size);
+			}
 
-		TreapNode(const KeyType& key, const ValueType& value, int priority = rand()) :
-			m_key(key),
-			m_value(value),
-			m_priority(priority)
-		{}
+			int m_size = 1;
+		};
+	};
 
-		ValueType value() const
+	/*
+	* Augmentation policy which keeps values of subtrees combined by Monoid, enables range aggregates.
+	* Monoid defines Type, identity(), lift(value) and an associative combine(left, right), which
+	* needn't be commutative: values are always combined in ascending order of keys
+	*/
+	template<typename Monoid>
+	struct MonoidAggregate
+	{
+		template<typename KeyType, typename ValueType>
+		struct Data
 		{
-			return m_value;
-		}
+			using MonoidType = Monoid;
 
-		TreapNodePtr find(const KeyType& key)
-		{
-			if (m_key == key)
+			void update(const Data* pLeft, const Data* pRight, const KeyType&, const ValueType& value)
 			{
-				return super::shared_from_this();
+				m_aggregate = Monoid::combine(Monoid::combine(aggregate(pLeft), Monoid::lift(value)), aggregate(pRight));
 			}
-			if (m_key < key)
-			{
-				if (m_pRight == nullptr)
-					return nullptr;
 
-				return m_pRight->find(key);
-			}
-			else
+			static typename Monoid::Type aggregate(const Data* pData)
 			{
-				if (m_pLeft == nullptr)
-					return nullptr;
-
-				return m_pLeft->find(key);
+				return pData == nullptr ? Monoid::identity() : pData->m_aggregate;
 			}
-			return super::shared_from_this();
+
+			typename Monoid::Type m_aggregate = Monoid::identity();
+		};
+	};
+
+	template<typename T>
+	struct SumMonoid
+	{
+		using Type = T;
+
+		static T identity()
+		{
+			return T();
 		}
 
-		TreapNodePtr insert(const KeyType& key, const ValueType& value)
+		static T lift(const T& value)
+		{
+			return value;
+		}
+
+		static T combine(const T& left, const T& right)
 		{
-			TreapNodePtr pNode = std::make_shared<TreapNode<KeyType, ValueType> >(key, value), pLeft, pRight;
-			split(key, pLeft, pRight);
+			return left + right;
+		}
+	};
+
+	template<typename T>
+	struct MinMonoid
+	{
+		using Type = T;
 
-			pLeft = merge(pLeft, pNode);
-			return merge(pLeft, pRight);
+		static T identity()
+		{
+			return std::numeric_limits<T>::max();
 		}
 
-		TreapNodePtr erase(const KeyType& key)
+		static T lift(const T& value)
 		{
-			TreapNodePtr pNode;
-			if (key == m_key)
-			{
-				return merge(m_pLeft, m_pRight);
-			}
-			else
-			{
-				pNode = std::make_shared<TreapNode<KeyType, ValueType> >(m_key, m_value, m_priority);
-				pNode->m_pLeft = m_pLeft;
-				pNode->m_pRight = m_pRight;
+			return value;
+		}
 
-				if (key < m_key)
-					pNode->m_pLeft = pNode->m_pLeft->erase(key);
-				else
-					pNode->m_pRight = pNode->m_pRight->erase(key);
-			}
+		static T combine(const T& left, const T& right)
+		{
+			return right < left ? right : left;
+		}
+	};
 
-			return pNode;
+	template<typename T>
+	struct MaxMonoid
+	{
+		using Type = T;
+
+		static T identity()
+		{
+			return std::numeric_limits<T>::lowest();
 		}
 
-		TreapNodePtr setValue(const KeyType& key, const ValueType& value)
+		static T lift(const T& value)
 		{
-			TreapNodePtr pNode;
-			if (key == m_key)
-			{
-				pNode = std::make_shared<TreapNode<KeyType, ValueType> >(key, value, m_priority);
-				pNode->m_pLeft = m_pLeft;
-				pNode->m_pRight = m_pRight;
-				return pNode;
-			}
+			return value;
+		}
+
+		static T combine(const T& left, const T& right)
+		{
+			return left < right ? right : left;
+		}
+	};
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator, typename Augmentation>
+	class TreapIterator;
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator, typename Augmentation>
+	class TreapFinger;
+
+	/*
+	* Edit token of hash-consed nodes, which are never changed in place
+	*/
+	const EditToken INTERNED_EDIT = EXCLUSIVE_EDIT - 1;
+
+	/*
+	* Table of hash-consed nodes: a node is kept once for its contents and children, so equal subtrees
+	* interned into one table, across versions and across maps, are the same nodes. The table holds
+	* its nodes, collect() releases those no longer used elsewhere. Can be shared between threads.
+	*/
+	template<typename NodeType>
+	class HashConsTable
+	{
+	public:
+		using NodePtr = IntrusivePtr<NodeType>;
 
-			if (key < m_key)
+		HashConsTable() = default;
+		HashConsTable(const HashConsTable&) = delete;
+		HashConsTable& operator=(const HashConsTable&) = delete;
+
+		/**
+		* Gets node with given hash for which isEqual(node) holds, adds the node made by make() if there is none
+		* @param hash
+		* @param isEqual
+		* @param make
+		* @return node kept by the table
+		*/
+		template<typename Equal, typename Make>
+		NodePtr intern(std::size_t hash, const Equal& isEqual, const Make& make)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto range = m_apNodes.equal_range(hash);
+			for (auto it = range.first; it != range.second; ++it)
 			{
-				TreapNodePtr pLeft = m_pLeft == nullptr ? m_pLeft : m_pLeft->setValue(key, value);
-				if (pLeft != nullptr)
-				{
-					pNode = std::make_shared<TreapNode<KeyType, ValueType> >(m_key, m_value);
-					pNode->m_pLeft = pLeft;
-					pNode->m_pRight = m_pRight;
-				}
+				if (isEqual(*it->second))
+					return it->second;
 			}
-			else
+
+			NodePtr pNode = make();
+			m_apNodes.emplace(hash, pNode);
+			return pNode;
+		}
+
+		/**
+		* Releases nodes referenced by the table only
+		* @return number of nodes left in the table
+		*/
+		std::size_t collect()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (bool isReleased = true; isReleased;)
 			{
-				TreapNodePtr pRight = m_pRight == nullptr ? m_pRight : m_pRight->setValue(key, value);
-				if (pRight != nullptr)
+				// releasing a node may leave its children referenced by the table only
+				isReleased = false;
+				for (auto it = m_apNodes.begin(); it != m_apNodes.end();)
 				{
-					pNode = std::make_shared<TreapNode<KeyType, ValueType> >(m_key, m_value);
-					pNode->m_pLeft = m_pLeft;
-					pNode->m_pRight = pRight;
+					if (it->second.use_count() == 1)
+					{
+						it = m_apNodes.erase(it);
+						isReleased = true;
+					}
+					else
+						++it;
 				}
 			}
-			return pNode;
+			return m_apNodes.size();
 		}
 
-		void print()
+		std::size_t size() const
 		{
-			if (m_pLeft != nullptr)
-				m_pLeft->print();
-			std::cout << "(" << m_key << "; " << m_value << ")  ";
-			if (m_pRight != nullptr)
-				m_pRight->print();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_apNodes.size();
 		}
 
 	private:
-		TreapNodePtr merge(TreapNodePtr pLeft, TreapNodePtr pRight)
+		mutable std::mutex m_mutex;
+		std::unordered_multimap<std::size_t, NodePtr> m_apNodes;
+	};
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy = AtomicRefCount, typename Allocator = HeapAllocator, typename Augmentation = NoAugmentation>
+	class TreapVersion;
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator, typename Augmentation>
+	class TreapNode : public RefCounted<RefCountPolicy, Allocator>, public Augmentation::template Data<KeyType, ValueType>
+	{
+	public:
+		using Augment = typename Augmentation::template Data<KeyType, ValueType>;
+		using TreapNodePtr = IntrusivePtr<TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation> >;
+
+		TreapNode(const KeyType& key, const ValueType& value) :
+			TreapNode(key, value, priorityOf(key))
+		{}
+
+		TreapNode(const KeyType& key, const ValueType& value, unsigned priority) :
+			m_key(key),
+			m_priority(priority),
+			m_value(value)
 		{
-			if (pLeft == nullptr && pRight == nullptr)
-				return nullptr;
+			update();
+		}
 
-			TreapNodePtr pNewRoot;
-			if (pLeft != nullptr && pRight != nullptr)
+		/*
+		* Gets priority of key: a mix of its std::hash, so a set of keys has a single treap shape whatever
+		* the order of changes. Hash-consing, digests and diff rely on that shape, so keys need std::hash
+		*/
+		static unsigned priorityOf(const KeyType& key)
+		{
+			static_assert(std::is_default_constructible<std::hash<KeyType> >::value,
+				"treap priorities are derived from std::hash of keys, specialize std::hash for the key type");
+
+			std::uint64_t hash = std::hash<KeyType>()(key);
+			hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+			return unsigned((hash ^ (hash >> 31)) >> 32);
+		}
+
+		ValueType value() const
+		{
+			return m_value;
+		}
+
+		/*
+		* Gets number of keys in treap, requires SubtreeSize augmentation
+		*/
+		static int size(const TreapNode* pNode)
+		{
+			return pNode == nullptr ? 0 : pNode->m_size;
+		}
+
+		/*
+		* Counts keys less than key in treap, requires SubtreeSize augmentation
+		*/
+		static int rank(const TreapNode* pNode, const KeyType& key)
+		{
+			int rank = 0;
+			while (pNode != nullptr)
 			{
-				if (pLeft->m_priority <= pRight->m_priority)
+				if (pNode->m_key < key)
 				{
-					pNewRoot = std::make_shared<TreapNode<KeyType, ValueType> >(pRight->m_key, pRight->m_value, pRight->m_priority);
-					pNewRoot->m_pLeft = pRight->m_pLeft;
-					pNewRoot->m_pRight = pRight->m_pRight;
-					pNewRoot->m_pLeft = merge(pLeft, pRight->m_pLeft);
+					rank += size(pNode->m_pLeft.get()) + 1;
+					pNode = pNode->m_pRight.get();
 				}
 				else
-				{
-					pNewRoot = std::make_shared<TreapNode<KeyType, ValueType> >(pLeft->m_key, pLeft->m_value, pLeft->m_priority);
-					pNewRoot->m_pLeft = pLeft->m_pLeft;
-					pNewRoot->m_pRight = pLeft->m_pRight;
-					pNewRoot->m_pRight = merge(pLeft->m_pRight, pRight);
-				}
+					pNode = pNode->m_pLeft.get();
 			}
-			else
+			return rank;
+		}
+
+		/*
+		* Combines values of keys from lo inclusive to hi exclusive in ascending order,
+		* requires MonoidAggregate augmentation
+		*/
+		static auto aggregate(const TreapNode* pNode, const KeyType& lo, const KeyType& hi)
+		{
+			using Monoid = typename Augment::MonoidType;
+
+			while (pNode != nullptr && (pNode->m_key < lo || !(pNode->m_key < hi)))
+			{
+				pNode = pNode->m_key < lo ? pNode->m_pRight.get() : pNode->m_pLeft.get();
+			}
+			if (pNode == nullptr)
+				return Monoid::identity();
+
+			// the range is the suffix of the left subtree, the node itself and the prefix of the right subtree
+			typename Monoid::Type result = Monoid::lift(pNode->m_value);
+			for (const TreapNode* pLeft = pNode->m_pLeft.get(); pLeft != nullptr;)
 			{
-				if (pLeft == nullptr)
+				if (pLeft->m_key < lo)
 				{
-					pNewRoot = std::make_shared<TreapNode<KeyType, ValueType> >(pRight->m_key, pRight->m_value, pRight->m_priority);
-					pNewRoot->m_pLeft = pRight->m_pLeft;
-					pNewRoot->m_pRight = pRight->m_pRight;
+					pLeft = pLeft->m_pRight.get();
+					continue;
 				}
-				else
+
+				result = Monoid::combine(Monoid::combine(Monoid::lift(pLeft->m_value), Augment::aggregate(pLeft->m_pRight.get())), result);
+				pLeft = pLeft->m_pLeft.get();
+			}
+
+			for (const TreapNode* pRight = pNode->m_pRight.get(); pRight != nullptr;)
+			{
+				if (!(pRight->m_key < hi))
 				{
-					pNewRoot = std::make_shared<TreapNode<KeyType, ValueType> >(pLeft->m_key, pLeft->m_value, pLeft->m_priority);
-					pNewRoot->m_pLeft = pLeft->m_pLeft;
-					pNewRoot->m_pRight = pLeft->m_pRight;
+					pRight = pRight->m_pLeft.get();
+					continue;
 				}
+
+				result = Monoid::combine(result, Monoid::combine(Augment::aggregate(pRight->m_pLeft.get()), Monoid::lift(pRight->m_value)));
+				pRight = pRight->m_pRight.get();
 			}
+			return result;
+		}
 
-			return pNewRoot;
+		const TreapNode* find(const KeyType& key) const
+		{
+			const TreapNode* pNode = this;
+			while (pNode != nullptr && !(pNode->m_key == key))
+			{
+				pNode = pNode->m_key < key ? pNode->m_pRight.get() : pNode->m_pLeft.get();
+			}
+			return pNode;
 		}
 
-		TreapNodePtr split(const KeyType& key, TreapNodePtr& pLeft, TreapNodePtr& pRight)
+		/*
+		* Finds numKeys keys in treap, up to FIND_LANES searches advance in turns and prefetch the next node
+		* of each, so their cache misses overlap. A finished lane takes the next key. Keys not found are left
+		* in aValues as they are
+		*/
+		static void findMany(const TreapNode* pRoot, const KeyType* aKeys, std::size_t numKeys, std::optional<ValueType>* aValues)
 		{
-			TreapNodePtr pNewRoot;
+			if (pRoot == nullptr)
+				return;
+
+			struct Lane
+			{
+				const TreapNode* m_pNode;
+				std::size_t m_index;
+			};
+
+			std::array<Lane, FIND_LANES> aLanes;
+			std::size_t numLanes = std::min<std::size_t>(FIND_LANES, numKeys), next = numLanes;
+			for (std::size_t i = 0; i < numLanes; i++)
 			{
-				pNewRoot = std::make_shared<TreapNode<KeyType, ValueType> >(m_key, m_value, m_priority);
-				pNewRoot->m_pLeft = m_pLeft;
-				pNewRoot->m_pRight = m_pRight;
+				aLanes[i] = Lane{ pRoot, i };
 			}
 
-			if (m_key <= key)
+			while (numLanes > 0)
 			{
-				if (pNewRoot->m_pRight != nullptr)
+				for (std::size_t i = 0; i < numLanes;)
 				{
-					pNewRoot->m_pRight->split(key, pNewRoot->m_pRight, pRight);
-				}
-				else
-					pRight = nullptr;
+					Lane& lane = aLanes[i];
+					const KeyType& key = aKeys[lane.m_index];
+					if (lane.m_pNode != nullptr && !(lane.m_pNode->m_key == key))
+					{
+						lane.m_pNode = key < lane.m_pNode->m_key ? lane.m_pNode->m_pLeft.get() : lane.m_pNode->m_pRight.get();
+						if (lane.m_pNode != nullptr)
+							prefetchNode(lane.m_pNode);
+						i++;
+						continue;
+					}
+
+					if (lane.m_pNode != nullptr)
+						aValues[lane.m_index] = lane.m_pNode->m_value;
 
-				pLeft = pNewRoot;
+					if (next < numKeys)
+					{
+						lane = Lane{ pRoot, next++ };
+						i++;
+					}
+					else
+						lane = aLanes[--numLanes];
+				}
 			}
-			else
+		}
+
+		static TreapNodePtr editable(const TreapNodePtr& pNode, EditToken edit)
+		{
+			return isEditable(pNode, edit) ? pNode : copy(pNode, edit);
+		}
+
+		/*
+		* Sets value to key or inserts the key in one descent, only nodes on the changed path are made editable.
+		* Priorities depend on keys only, so a key in the treap is never below a node it would be placed above,
+		* reaching such a node means the key is missing and is inserted there
+		*/
+		static void setValue(TreapNodePtr& pRoot, const KeyType& key, const ValueType& value, EditToken edit)
+		{
+			unsigned priority = priorityOf(key);
+			TreapNodePtr* ppNode = &pRoot;
+			while (*ppNode != nullptr && !isAbove(priority, key, ppNode->get()))
 			{
-				if (pNewRoot->m_pLeft != nullptr)
+				*ppNode = editable(*ppNode, edit);
+				if ((*ppNode)->m_key == key)
 				{
-					pNewRoot->m_pLeft->split(key, pLeft, pNewRoot->m_pLeft);
+					(*ppNode)->m_value = value;
+					(*ppNode)->update();
+					if (IS_AUGMENTED)
+						updatePath(pRoot.get(), key);
+					return;
 				}
-				else
-					pLeft = nullptr;
 
-				pRight = pNewRoot;
+				ppNode = key < (*ppNode)->m_key ? &(*ppNode)->m_pLeft : &(*ppNode)->m_pRight;
 			}
 
-			return pNewRoot;
+			auto pNode = makeIntrusive<TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation> >(key, value, priority);
+			pNode->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+			split(std::move(*ppNode), key, pNode->m_pLeft, pNode->m_pRight, edit);
+			pNode->update();
+			*ppNode = pNode;
+			if (IS_AUGMENTED)
+				updatePath(pRoot.get(), key);
 		}
 
-		KeyType m_key;
-		int m_priority;
-		TreapNodePtr m_pLeft, m_pRight;
+		/*
+		* Erases key in one descent, nodes on the path are made editable on the way back and only if the key is found
+		* @return true, if key is found
+		*/
+		static bool erase(TreapNodePtr& pRoot, const KeyType& key, EditToken edit)
+		{
+			bool isFound = false;
+			TreapNodePtr pNewRoot = erase(pRoot, key, edit, false, isFound);
+			if (isFound)
+				pRoot = std::move(pNewRoot);
+			return isFound;
+		}
 
-		ValueType m_value;
-	};
+		/*
+		* Builds treap from pairs with strictly ascending keys in O(n): the right spine is kept on a stack,
+		* a new node takes the popped nodes of lower priority as its left subtree
+		*/
+		template<typename Iterator>
+		static TreapNodePtr fromSorted(Iterator begin, Iterator end, EditToken edit)
+		{
+			std::vector<TreapNodePtr> apSpine;
+			for (; begin != end; ++begin)
+			{
+				if (!apSpine.empty() && !(apSpine.back()->m_key < begin->first))
+				{
+					assert(apSpine.back()->m_key < begin->first);
+					throw std::exception();
+				}
 
-	template<typename KeyType, typename ValueType>
-	class TreapVersion
-	{
+				auto pNode = makeIntrusive<TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation> >(begin->first, begin->second);
+				pNode->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
 
-	public:
-		using TreapNodePtr = std::shared_ptr<TreapNode<KeyType, ValueType> >;
+				TreapNodePtr pLeft;
+				while (!apSpine.empty() && isAbove(pNode->m_priority, pNode->m_key, apSpine.back().get()))
+				{
+					pLeft = std::move(apSpine.back());
+					apSpine.pop_back();
+					pLeft->update();
+				}
 
-		TreapVersion() : m_pRoot(nullptr) {}
+				pNode->m_pLeft = std::move(pLeft);
+				if (!apSpine.empty())
+					apSpine.back()->m_pRight = pNode;
+				apSpine.push_back(std::move(pNode));
+			}
 
-		TreapVersion(const TreapNodePtr& pNode) : m_pRoot(pNode) {}
+			if (apSpine.empty())
+				return nullptr;
 
-		bool find(const KeyType& key, ValueType& value)
+			for (std::size_t i = apSpine.size(); i-- > 0;)
+			{
+				apSpine[i]->update();
+			}
+			return apSpine.front();
+		}
+
+		/*
+		* Join-based set operations on treaps, nodes are shared with the operands where possible:
+		* the root with the highest priority splits the other treap and both halves are combined
+		* recursively, in O(m log(n/m + 1)). Large halves are combined on threads of ThreadPool.
+		*/
+		static TreapNodePtr unite(TreapNodePtr pFirst, TreapNodePtr pSecond, bool isFirstKept, EditToken edit, int forkDepth)
 		{
-			if (m_pRoot == nullptr)
-				false;
+			if (pFirst == nullptr || pFirst == pSecond)
+				return pSecond;
+			if (pSecond == nullptr)
+				return pFirst;
 
-			TreapNodePtr curTreapNode = m_pRoot->find(key);
-			if (!curTreapNode)
+			if (isAbove(pSecond->m_priority, pSecond->m_key, pFirst.get()))
 			{
-				return false;
+				std::swap(pFirst, pSecond);
+				isFirstKept = !isFirstKept;
 			}
-			value = curTreapNode->value();
-			return true;
+
+			bool isParallel = shouldFork(pFirst, pSecond, forkDepth);
+			TreapNodePtr pLeft, pSame, pRight;
+			splitAt(std::move(pSecond), pFirst->m_key, pLeft, pSame, pRight, edit);
+
+			TreapNodePtr pRoot = editable(pFirst, edit);
+			pFirst.reset();
+			if (pSame != nullptr && !isFirstKept)
+				pRoot->m_value = pSame->m_value;
+
+			forkJoin(isParallel,
+				[&]() { pRoot->m_pLeft = unite(std::move(pRoot->m_pLeft), std::move(pLeft), isFirstKept, edit, forkDepth - 1); },
+				[&]() { pRoot->m_pRight = unite(std::move(pRoot->m_pRight), std::move(pRight), isFirstKept, edit, forkDepth - 1); });
+			pRoot->update();
+			return pRoot;
 		}
 
-		TreapNodePtr erase(const KeyType& key, bool& isSuccess)
+		static TreapNodePtr intersect(TreapNodePtr pFirst, TreapNodePtr pSecond, bool isFirstKept, EditToken edit, int forkDepth)
 		{
-			isSuccess = false;
-			assert(m_pRoot != nullptr);
-			if (m_pRoot == nullptr)
-				throw std::exception();
+			if (pFirst == nullptr || pSecond == nullptr)
+				return nullptr;
+			if (pFirst == pSecond)
+				return pFirst;
 
-			TreapNodePtr curTreapNode = m_pRoot->find(key);
-			if (curTreapNode != nullptr)
+			if (isAbove(pSecond->m_priority, pSecond->m_key, pFirst.get()))
 			{
-				isSuccess = true;
-				return m_pRoot->erase(key);
+				std::swap(pFirst, pSecond);
+				isFirstKept = !isFirstKept;
 			}
 
-			return nullptr;
+			bool isParallel = shouldFork(pFirst, pSecond, forkDepth);
+			TreapNodePtr pLeft, pSame, pRight;
+			splitAt(std::move(pSecond), pFirst->m_key, pLeft, pSame, pRight, edit);
+
+			TreapNodePtr pLeftResult, pRightResult;
+			forkJoin(isParallel,
+				[&]() { pLeftResult = intersect(pFirst->m_pLeft, std::move(pLeft), isFirstKept, edit, forkDepth - 1); },
+				[&]() { pRightResult = intersect(pFirst->m_pRight, std::move(pRight), isFirstKept, edit, forkDepth - 1); });
+
+			if (pSame == nullptr)
+				return merge(pLeftResult, pRightResult, edit);
+
+			TreapNodePtr pRoot = editable(pFirst, edit);
+			if (!isFirstKept)
+				pRoot->m_value = pSame->m_value;
+			pRoot->m_pLeft = std::move(pLeftResult);
+			pRoot->m_pRight = std::move(pRightResult);
+			pRoot->update();
+			return pRoot;
 		}
 
-		TreapNodePtr insert(const KeyType& key, const ValueType& value)
+		static TreapNodePtr subtract(const TreapNodePtr& pFirst, TreapNodePtr pSecond, EditToken edit, int forkDepth)
 		{
-			TreapNodePtr curTreapNode;
-			if (m_pRoot != nullptr)
+			if (pFirst == nullptr || pFirst == pSecond)
+				return nullptr;
+			if (pSecond == nullptr)
+				return pFirst;
+
+			bool isParallel = shouldFork(pFirst, pSecond, forkDepth);
+			TreapNodePtr pLeft, pSame, pRight;
+			splitAt(std::move(pSecond), pFirst->m_key, pLeft, pSame, pRight, edit);
+
+			TreapNodePtr pLeftResult, pRightResult;
+			forkJoin(isParallel,
+				[&]() { pLeftResult = subtract(pFirst->m_pLeft, std::move(pLeft), edit, forkDepth - 1); },
+				[&]() { pRightResult = subtract(pFirst->m_pRight, std::move(pRight), edit, forkDepth - 1); });
+
+			if (pSame != nullptr)
+				return merge(pLeftResult, pRightResult, edit);
+
+			TreapNodePtr pRoot = editable(pFirst, edit);
+			pRoot->m_pLeft = std::move(pLeftResult);
+			pRoot->m_pRight = std::move(pRightResult);
+			pRoot->update();
+			return pRoot;
+		}
+
+		/*
+		* Gets number of levels of a set operation which may combine halves on separate threads: while both
+		* operands have at least FORK_CUTOFF nodes, at most log2 of the number of threads of ThreadPool.
+		* Sizes are counted once here, the halves are expected to have half of the nodes on each level
+		*/
+		static int forkDepth(const TreapNodePtr& pFirst, const TreapNodePtr& pSecond)
+		{
+			int maxDepth = IS_THREAD_SAFE ? ThreadPool::instance().maxForkDepth() : 0;
+			if (maxDepth == 0)
+				return 0;
+			if (IS_SIZED)
+				return maxDepth;
+
+			int limit = FORK_CUTOFF << (maxDepth - 1);
+			int numNodes = countNodes(pFirst.get(), limit);
+			if (numNodes >= FORK_CUTOFF)
+				numNodes = std::min(numNodes, countNodes(pSecond.get(), limit));
+
+			int depth = 0;
+			for (; depth < maxDepth && numNodes >= FORK_CUTOFF; numNodes /= 2)
+			{
+				depth++;
+			}
+			return depth;
+		}
+
+		/*
+		* Gets digest of treap, requires MerkleDigest augmentation
+		*/
+		static std::uint64_t digest(const TreapNode* pNode)
+		{
+			return Augment::digest(pNode);
+		}
+
+		/*
+		* Calls callback(key, pFirstValue, pSecondValue) in ascending order for keys whose values differ
+		* between two treaps, nullptr stands for a missing key. As priorityOf depends on the key only, a key set
+		* has one treap shape, so both treaps
+		* are descended together, skipping shared subtrees and, with MerkleDigest, subtrees with equal digests.
+		* Only keys from *pLo to *pHi exclusive are compared, nullptr bounds mean no bound
+		*/
+		template<typename Callback>
+		static void diff(const TreapNode* pFirst, const TreapNode* pSecond, const KeyType* pLo, const KeyType* pHi, const Callback& callback)
+		{
+			pFirst = restrict(pFirst, pLo, pHi);
+			pSecond = restrict(pSecond, pLo, pHi);
+			if (pFirst == pSecond)
+				return;
+			if constexpr (IS_DIGESTED)
 			{
-				curTreapNode = m_pRoot->setValue(key, value);
+				if (pFirst != nullptr && pSecond != nullptr && digest(pFirst) == digest(pSecond))
+					return;
+			}
+
+			if (pFirst == nullptr || pSecond == nullptr)
+			{
+				bool isFirst = pFirst != nullptr;
+				forEach(isFirst ? pFirst : pSecond, pLo, pHi, [&](const KeyType& key, const ValueType& value)
+				{
+					callback(key, isFirst ? &value : nullptr, isFirst ? nullptr : &value);
+				});
+				return;
 			}
 
-			if (curTreapNode != nullptr)
+			// the roots have the highest priorities within bounds, a root above the other one is missing in the other treap
+			if (pFirst->m_key == pSecond->m_key)
+			{
+				diff(pFirst->m_pLeft.get(), pSecond->m_pLeft.get(), pLo, &pFirst->m_key, callback);
+				if (!(pFirst->m_value == pSecond->m_value))
+					callback(pFirst->m_key, &pFirst->m_value, &pSecond->m_value);
+				diff(pFirst->m_pRight.get(), pSecond->m_pRight.get(), &pFirst->m_key, pHi, callback);
+			}
+			else if (isAbove(pSecond->m_priority, pSecond->m_key, pFirst))
 			{
-				return curTreapNode;
+				diff(pFirst, pSecond->m_pLeft.get(), pLo, &pSecond->m_key, callback);
+				callback(pSecond->m_key, nullptr, &pSecond->m_value);
+				diff(pFirst, pSecond->m_pRight.get(), &pSecond->m_key, pHi, callback);
 			}
 			else
 			{
-				if (m_pRoot == nullptr)
-					return std::make_shared<TreapNode<KeyType, ValueType> >(key, value);
-				else
-					return m_pRoot->insert(key, value);
+				diff(pFirst->m_pLeft.get(), pSecond, pLo, &pFirst->m_key, callback);
+				callback(pFirst->m_key, &pFirst->m_value, nullptr);
+				diff(pFirst->m_pRight.get(), pSecond, &pFirst->m_key, pHi, callback);
 			}
 		}
 
-		TreapNodePtr setValue(const KeyType& key, const ValueType& value)
+		/*
+		* Replaces nodes of treap not yet interned with the nodes of table having the same contents and children,
+		* takes O(k) for k such nodes. Requires std::hash and operator== of keys and values
+		*/
+		static TreapNodePtr intern(const TreapNodePtr& pNode, HashConsTable<TreapNode>& table)
 		{
-			if (m_pRoot == nullptr)
-			{
-				return std::make_shared<TreapNode<KeyType, ValueType> >(key, value);
-			}
+			if (pNode == nullptr || pNode->m_edit == INTERNED_EDIT)
+				return pNode;
 
-			auto pNewRoot = m_pRoot->setValue(key, value);
-			if (pNewRoot == nullptr)
+			TreapNodePtr pLeft = intern(pNode->m_pLeft, table), pRight = intern(pNode->m_pRight, table);
+			std::size_t hash = std::hash<KeyType>()(pNode->m_key);
+			for (std::size_t part : { std::hash<ValueType>()(pNode->m_value), std::hash<const TreapNode*>()(pLeft.get()), std::hash<const TreapNode*>()(pRight.get()) })
 			{
-				return m_pRoot->insert(key, value);
+				hash ^= part + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
 			}
-			else
-				return pNewRoot;
+
+			return table.intern(hash,
+				[&](const TreapNode& node) { return node.m_key == pNode->m_key && node.m_value == pNode->m_value && node.m_pLeft == pLeft && node.m_pRight == pRight; },
+				[&]()
+				{
+					auto pCopy = makeIntrusive<TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation> >(pNode->m_key, pNode->m_value, pNode->m_priority);
+					pCopy->m_pLeft = pLeft;
+					pCopy->m_pRight = pRight;
+					pCopy->update();
+					pCopy->m_edit = INTERNED_EDIT;
+					return pCopy;
+				});
 		}
 
 		void print()
 		{
-			if (m_pRoot == nullptr)
-				return;
-
-			m_pRoot->print();
+			if (m_pLeft != nullptr)
+				m_pLeft->print();
+			std::cout << "(" << m_key << "; " << m_value << ")  ";
+			if (m_pRight != nullptr)
+				m_pRight->print();
 		}
 
 	private:
-		TreapNodePtr m_pRoot;
-	};
+		friend class TreapIterator<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+		friend class TreapFinger<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
 
-}
+		// nodes may be shared between threads only with atomic counters and allocators which free nodes of other threads
+		static const bool IS_THREAD_SAFE = std::is_same<RefCountPolicy, AtomicRefCount>::value
+			&& (std::is_same<Allocator, HeapAllocator>::value || std::is_same<Allocator, SlabAllocator>::value);
+		static const int FORK_CUTOFF = 1 << 14;
+		static const int FIND_LANES = 16;
+		static const bool IS_AUGMENTED = !std::is_empty<Augment>::value;
+		static const bool IS_DIGESTED = std::is_same<Augmentation, MerkleDigest>::value;
+		static const bool IS_SIZED = std::is_same<Augmentation, SubtreeSize>::value;
 
-template<typename KeyType, typename ValueType>
-class PersistentMap : public PersistentBase
-{
-public:
-	PersistentMap() :
-		m_lastVersion(0),
-		m_curVersion(0)
-	{
-		m_versions.push_back(TreapVersion<KeyType, ValueType>());
-	}
+		static bool isEditable(const TreapNodePtr& pNode, EditToken edit)
+		{
+			return pNode->m_edit != INTERNED_EDIT && (edit == EXCLUSIVE_EDIT ? pNode.use_count() == 1 : pNode->m_edit == edit);
+		}
 
-	/**
-	* Sets value to key, if key doesn't exist, inserts new key with value
-	* @param key
-	* @param value
-	*/
+		/*
+		* Gets the highest node of treap with key from *pLo to *pHi exclusive, its subtree holds all such keys
+		*/
+		static const TreapNode* restrict(const TreapNode* pNode, const KeyType* pLo, const KeyType* pHi)
+		{
+			while (pNode != nullptr)
+			{
+				if (pLo != nullptr && !(*pLo < pNode->m_key))
+					pNode = pNode->m_pRight.get();
+				else if (pHi != nullptr && !(pNode->m_key < *pHi))
+					pNode = pNode->m_pLeft.get();
+				else
+					break;
+			}
+			return pNode;
+		}
+
+		/*
+		* Calls callback(key, value) for keys of treap from *pLo to *pHi exclusive in ascending order
+		*/
+		template<typename Callback>
+		static void forEach(const TreapNode* pNode, const KeyType* pLo, const KeyType* pHi, const Callback& callback)
+		{
+			if (pNode == nullptr)
+				return;
+
+			bool isAboveLo = pLo == nullptr || *pLo < pNode->m_key;
+			bool isBelowHi = pHi == nullptr || pNode->m_key < *pHi;
+			if (isAboveLo)
+				forEach(pNode->m_pLeft.get(), pLo, pHi, callback);
+			if (isAboveLo && isBelowHi)
+				callback(pNode->m_key, pNode->m_value);
+			if (isBelowHi)
+				forEach(pNode->m_pRight.get(), pLo, pHi, callback);
+		}
+
+		/*
+		* Checks if a node with priority and key goes above pNode, equal priorities are ordered by key
+		*/
+		static bool isAbove(unsigned priority, const KeyType& key, const TreapNode* pNode)
+		{
+			return pNode->m_priority < priority || (pNode->m_priority == priority && key < pNode->m_key);
+		}
+
+		static TreapNodePtr copy(const TreapNodePtr& pNode, EditToken edit)
+		{
+			auto pCopy = makeIntrusive<TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation> >(pNode->m_key, pNode->m_value, pNode->m_priority);
+			pCopy->m_pLeft = pNode->m_pLeft;
+			pCopy->m_pRight = pNode->m_pRight;
+			static_cast<Augment&>(*pCopy) = *pNode;
+			pCopy->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+			return pCopy;
+		}
+
+		void update()
+		{
+			Augment::update(m_pLeft.get(), m_pRight.get(), m_key, m_value);
+		}
+
+		/*
+		* Recomputes augmentation of nodes on the path from pNode down to key, the node with key excluded
+		*/
+		static void updatePath(TreapNode* pNode, const KeyType& key)
+		{
+			if (pNode == nullptr || pNode->m_key == key)
+				return;
+
+			updatePath(key < pNode->m_key ? pNode->m_pLeft.get() : pNode->m_pRight.get(), key);
+			pNode->update();
+		}
+
+		/*
+		* Splits treap into keys less than key, node with key and keys greater than key
+		*/
+		static void splitAt(TreapNodePtr pRoot, const KeyType& key, TreapNodePtr& pLeft, TreapNodePtr& pSame, TreapNodePtr& pRight, EditToken edit)
+		{
+			if (pRoot == nullptr)
+			{
+				pLeft = pSame = pRight = nullptr;
+				return;
+			}
+
+			if (pRoot->m_key == key)
+			{
+				pLeft = pRoot->m_pLeft;
+				pRight = pRoot->m_pRight;
+				pSame = std::move(pRoot);
+				return;
+			}
+
+			pRoot = editable(pRoot, edit);
+			if (pRoot->m_key < key)
+			{
+				splitAt(std::move(pRoot->m_pRight), key, pRoot->m_pRight, pSame, pRight, edit);
+				pRoot->update();
+				pLeft = std::move(pRoot);
+			}
+			else
+			{
+				splitAt(std::move(pRoot->m_pLeft), key, pLeft, pSame, pRoot->m_pLeft, edit);
+				pRoot->update();
+				pRight = std::move(pRoot);
+			}
+		}
+
+		/*
+		* Erases key below pNode, returns the new subtree if key is found. Nodes under a shared node
+		* are shared too, so with EXCLUSIVE_EDIT they are copied even if their own counter is 1
+		*/
+		static TreapNodePtr erase(const TreapNodePtr& pNode, const KeyType& key, EditToken edit, bool isShared, bool& isFound)
+		{
+			if (pNode == nullptr)
+				return nullptr;
+
+			isShared = isShared || !isEditable(pNode, edit);
+			if (pNode->m_key == key)
+			{
+				isFound = true;
+				if (!isShared)
+					return merge(pNode->m_pLeft, pNode->m_pRight, edit);
+
+				// references taken here make merge copy the children of a shared node
+				TreapNodePtr pLeft = pNode->m_pLeft, pRight = pNode->m_pRight;
+				return merge(pLeft, pRight, edit);
+			}
+
+			bool isLeft = key < pNode->m_key;
+			TreapNodePtr pChild = erase(isLeft ? pNode->m_pLeft : pNode->m_pRight, key, edit, isShared, isFound);
+			if (!isFound)
+				return nullptr;
+
+			TreapNodePtr pCopy = isShared ? copy(pNode, edit) : pNode;
+			(isLeft ? pCopy->m_pLeft : pCopy->m_pRight) = std::move(pChild);
+			pCopy->update();
+			return pCopy;
+		}
+
+		/*
+		* With SubtreeSize augmentation the halves are forked by their exact sizes
+		*/
+		static bool shouldFork(const TreapNodePtr& pFirst, const TreapNodePtr& pSecond, int forkDepth)
+		{
+			if (forkDepth <= 0)
+				return false;
+			if constexpr (IS_SIZED)
+				return size(pFirst.get()) >= FORK_CUTOFF && size(pSecond.get()) >= FORK_CUTOFF;
+			return true;
+		}
+
+		/*
+		* Counts nodes of treap, stops after limit
+		*/
+		static int countNodes(const TreapNode* pNode, int limit)
+		{
+			if (pNode == nullptr || limit <= 0)
+				return 0;
+
+			int count = 1 + countNodes(pNode->m_pLeft.get(), limit - 1);
+			if (count < limit)
+				count += countNodes(pNode->m_pRight.get(), limit - count);
+			return count;
+		}
+
+		template<typename LeftTask, typename RightTask>
+		static void forkJoin(bool isParallel, const LeftTask& left, const RightTask& right)
+		{
+			if (!isParallel)
+			{
+				left();
+				right();
+				return;
+			}
+
+			ThreadPool::instance().forkJoin(left, right);
+		}
+
+		static void split(TreapNodePtr pRoot, const KeyType& key, TreapNodePtr& pLeft, TreapNodePtr& pRight, EditToken edit)
+		{
+			if (pRoot == nullptr)
+			{
+				pLeft = pRight = nullptr;
+				return;
+			}
+
+			pRoot = editable(pRoot, edit);
+			if (pRoot->m_key < key)
+			{
+				split(std::move(pRoot->m_pRight), key, pRoot->m_pRight, pRight, edit);
+				pRoot->update();
+				pLeft = pRoot;
+			}
+			else
+			{
+				split(std::move(pRoot->m_pLeft), key, pLeft, pRoot->m_pLeft, edit);
+				pRoot->update();
+				pRight = pRoot;
+			}
+		}
+
+		static TreapNodePtr merge(const TreapNodePtr& pLeft, const TreapNodePtr& pRight, EditToken edit)
+		{
+			if (pLeft == nullptr)
+				return pRight;
+			if (pRight == nullptr)
+				return pLeft;
+
+			TreapNodePtr pNewRoot;
+			if (!isAbove(pRight->m_priority, pRight->m_key, pLeft.get()))
+			{
+				pNewRoot = editable(pLeft, edit);
+				pNewRoot->m_pRight = merge(pNewRoot->m_pRight, pRight, edit);
+			}
+			else
+			{
+				pNewRoot = editable(pRight, edit);
+				pNewRoot->m_pLeft = merge(pLeft, pNewRoot->m_pLeft, edit);
+			}
+			pNewRoot->update();
+			return pNewRoot;
+		}
+
+		KeyType m_key;
+		unsigned m_priority;
+		EditToken m_edit = 0;
+		TreapNodePtr m_pLeft, m_pRight;
+
+		ValueType m_value;
+	};
+
+	/*
+	* Iterates keys of a treap version in ascending order. Ancestors still to be visited are kept
+	* on an explicit stack, so a step takes amortized O(1) and a seek O(log n). Holds the root,
+	* so the version stays alive while it is iterated.
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator, typename Augmentation>
+	class TreapIterator
+	{
+	public:
+		using Node = TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+		using TreapNodePtr = IntrusivePtr<Node>;
+
+		TreapIterator() = default;
+
+		/**
+		* Checks if iterator is past the last key
+		*/
+		bool done() const
+		{
+			return m_apPath.empty();
+		}
+
+		/**
+		* Moves to the next key in ascending order
+		*/
+		void next()
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			const Node* pNode = m_apPath.back();
+			m_apPath.pop_back();
+			pushLeft(pNode->m_pRight.get());
+		}
+
+		const KeyType& key() const
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			return m_apPath.back()->m_key;
+		}
+
+		const ValueType& value() const
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			return m_apPath.back()->m_value;
+		}
+
+	private:
+		friend class TreapVersion<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+
+		explicit TreapIterator(const TreapNodePtr& pRoot) :
+			m_pRoot(pRoot)
+		{}
+
+		void pushLeft(const Node* pNode)
+		{
+			for (; pNode != nullptr; pNode = pNode->m_pLeft.get())
+			{
+				m_apPath.push_back(pNode);
+			}
+		}
+
+		/*
+		* Positions iterator at the first key not less than key or, if isStrict, greater than key
+		*/
+		void seek(const KeyType& key, bool isStrict)
+		{
+			m_apPath.clear();
+			const Node* pNode = m_pRoot.get();
+			while (pNode != nullptr)
+			{
+				if (isStrict ? key < pNode->m_key : !(pNode->m_key < key))
+				{
+					m_apPath.push_back(pNode);
+					pNode = pNode->m_pLeft.get();
+				}
+				else
+					pNode = pNode->m_pRight.get();
+			}
+		}
+
+		/*
+		* Positions iterator at the key with given index in ascending order, requires SubtreeSize augmentation
+		*/
+		void seekIndex(int index)
+		{
+			m_apPath.clear();
+			const Node* pNode = m_pRoot.get();
+			while (pNode != nullptr)
+			{
+				int leftSize = Node::size(pNode->m_pLeft.get());
+				if (index <= leftSize)
+				{
+					m_apPath.push_back(pNode);
+					if (index == leftSize)
+						return;
+					pNode = pNode->m_pLeft.get();
+				}
+				else
+				{
+					index -= leftSize + 1;
+					pNode = pNode->m_pRight.get();
+				}
+			}
+		}
+
+		TreapNodePtr m_pRoot;
+		std::vector<const Node*> m_apPath;
+	};
+
+	/*
+	* Finger of a treap version for lookups near each other: keeps the path from the root to the last
+	* node found and the range of keys below each node on it. A lookup climbs to the lowest node whose
+	* range holds the key and descends from there, taking O(log d) on average for d keys between the
+	* last and the current key. Holds the root, so the version stays alive while the finger is used.
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator, typename Augmentation>
+	class TreapFinger
+	{
+	public:
+		using Node = TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+		using TreapNodePtr = IntrusivePtr<Node>;
+
+		TreapFinger() = default;
+
+		/**
+		* Finds key in the version of the finger and moves the finger to it
+		* @param key
+		* @param value - found value
+		* @return true, if found
+		*/
+		bool find(const KeyType& key, ValueType& value)
+		{
+			while (!m_aPath.empty() && !m_aPath.back().contains(key))
+			{
+				m_aPath.pop_back();
+			}
+
+			if (m_aPath.empty())
+			{
+				if (m_pRoot == nullptr)
+					return false;
+				m_aPath.push_back(Entry{ m_pRoot.get(), nullptr, nullptr });
+			}
+
+			for (;;)
+			{
+				const Entry& entry = m_aPath.back();
+				const Node* pNode = entry.m_pNode;
+				if (pNode->m_key == key)
+				{
+					value = pNode->m_value;
+					return true;
+				}
+
+				bool isLeft = key < pNode->m_key;
+				const Node* pChild = isLeft ? pNode->m_pLeft.get() : pNode->m_pRight.get();
+				if (pChild == nullptr)
+					return false;
+
+				m_aPath.push_back(isLeft ? Entry{ pChild, entry.m_pLo, &pNode->m_key } : Entry{ pChild, &pNode->m_key, entry.m_pHi });
+			}
+		}
+
+	private:
+		friend class TreapVersion<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+
+		/*
+		* Node on the path, keys below it are from *m_pLo to *m_pHi exclusive, nullptr bounds mean no bound
+		*/
+		struct Entry
+		{
+			bool contains(const KeyType& key) const
+			{
+				return (m_pLo == nullptr || *m_pLo < key) && (m_pHi == nullptr || key < *m_pHi);
+			}
+
+			const Node* m_pNode;
+			const KeyType* m_pLo;
+			const KeyType* m_pHi;
+		};
+
+		explicit TreapFinger(const TreapNodePtr& pRoot) :
+			m_pRoot(pRoot)
+		{}
+
+		TreapNodePtr m_pRoot;
+		std::vector<Entry> m_aPath;
+	};
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator, typename Augmentation>
+	class TreapVersion
+	{
+
+	public:
+		using Node = TreapNode<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+		using TreapNodePtr = IntrusivePtr<Node>;
+		using Iterator = TreapIterator<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+		using Finger = TreapFinger<KeyType, ValueType, RefCountPolicy, Allocator, Augmentation>;
+		using NodeTable = HashConsTable<Node>;
+
+		TreapVersion() : m_pRoot(nullptr) {}
+
+		TreapVersion(const TreapNodePtr& pNode) : m_pRoot(pNode) {}
+
+		bool find(const KeyType& key, ValueType& value) const
+		{
+			if (m_pRoot == nullptr)
+				return false;
+
+			const Node* pNode = m_pRoot->find(key);
+			if (pNode == nullptr)
+			{
+				return false;
+			}
+			value = pNode->value();
+			return true;
+		}
+
+		Iterator begin() const
+		{
+			Iterator it(m_pRoot);
+			it.pushLeft(m_pRoot.get());
+			return it;
+		}
+
+		Finger finger() const
+		{
+			return Finger(m_pRoot);
+		}
+
+		void findMany(const std::vector<KeyType>& aKeys, std::vector<std::optional<ValueType> >& aValues) const
+		{
+			aValues.assign(aKeys.size(), std::nullopt);
+			Node::findMany(m_pRoot.get(), aKeys.data(), aKeys.size(), aValues.data());
+		}
+
+		Iterator lowerBound(const KeyType& key) const
+		{
+			Iterator it(m_pRoot);
+			it.seek(key, false);
+			return it;
+		}
+
+		Iterator upperBound(const KeyType& key) const
+		{
+			Iterator it(m_pRoot);
+			it.seek(key, true);
+			return it;
+		}
+
+		int size() const
+		{
+			return Node::size(m_pRoot.get());
+		}
+
+		Iterator kth(int index) const
+		{
+			assert(index >= 0 && index < size());
+			if (index < 0 || index >= size())
+				throw std::exception();
+
+			Iterator it(m_pRoot);
+			it.seekIndex(index);
+			return it;
+		}
+
+		int rank(const KeyType& key) const
+		{
+			return Node::rank(m_pRoot.get(), key);
+		}
+
+		int countRange(const KeyType& lo, const KeyType& hi) const
+		{
+			return lo < hi ? rank(hi) - rank(lo) : 0;
+		}
+
+		auto aggregate(const KeyType& lo, const KeyType& hi) const
+		{
+			return Node::aggregate(m_pRoot.get(), lo, hi);
+		}
+
+		/*
+		* Calls callback(key, value) for keys from lo inclusive to hi exclusive in ascending order
+		*/
+		template<typename Callback>
+		void forRange(const KeyType& lo, const KeyType& hi, const Callback& callback) const
+		{
+			for (Iterator it = lowerBound(lo); !it.done() && it.key() < hi; it.next())
+			{
+				callback(it.key(), it.value());
+			}
+		}
+
+		TreapNodePtr erase(const KeyType& key, bool& isSuccess)
+		{
+			assert(m_pRoot != nullptr);
+			if (m_pRoot == nullptr)
+				throw std::exception();
+
+			TreapNodePtr pRoot = m_pRoot;
+			isSuccess = Node::erase(pRoot, key, newEditToken());
+			return isSuccess ? pRoot : nullptr;
+		}
+
+		TreapNodePtr insert(const KeyType& key, const ValueType& value)
+		{
+			return setValue(key, value);
+		}
+
+		TreapNodePtr setValue(const KeyType& key, const ValueType& value)
+		{
+			TreapNodePtr pRoot = m_pRoot;
+			Node::setValue(pRoot, key, value, newEditToken());
+			return pRoot;
+		}
+
+		void setValue(const KeyType& key, const ValueType& value, EditToken edit)
+		{
+			Node::setValue(m_pRoot, key, value, edit);
+		}
+
+		bool erase(const KeyType& key, EditToken edit)
+		{
+			return Node::erase(m_pRoot, key, edit);
+		}
+
+		template<typename Iterator>
+		static TreapVersion fromSorted(Iterator begin, Iterator end)
+		{
+			return TreapVersion(Node::fromSorted(begin, end, newEditToken()));
+		}
+
+		/*
+		* Builds treap from the sorted pairs and unites it with this version, values of the pairs win
+		*/
+		template<typename Iterator>
+		TreapVersion insertSorted(Iterator begin, Iterator end) const
+		{
+			EditToken edit = newEditToken();
+			TreapNodePtr pSorted = Node::fromSorted(begin, end, edit);
+			int forkDepth = Node::forkDepth(m_pRoot, pSorted);
+			return TreapVersion(Node::unite(m_pRoot, std::move(pSorted), false, edit, forkDepth));
+		}
+
+		TreapVersion unite(const TreapVersion& other) const
+		{
+			return TreapVersion(Node::unite(m_pRoot, other.m_pRoot, true, newEditToken(), Node::forkDepth(m_pRoot, other.m_pRoot)));
+		}
+
+		TreapVersion intersect(const TreapVersion& other) const
+		{
+			return TreapVersion(Node::intersect(m_pRoot, other.m_pRoot, true, newEditToken(), Node::forkDepth(m_pRoot, other.m_pRoot)));
+		}
+
+		TreapVersion subtract(const TreapVersion& other) const
+		{
+			return TreapVersion(Node::subtract(m_pRoot, other.m_pRoot, newEditToken(), Node::forkDepth(m_pRoot, other.m_pRoot)));
+		}
+
+		TreapVersion intern(NodeTable& table) const
+		{
+			return TreapVersion(Node::intern(m_pRoot, table));
+		}
+
+		bool isIdentical(const TreapVersion& other) const
+		{
+			return m_pRoot == other.m_pRoot;
+		}
+
+		std::uint64_t digest() const
+		{
+			return Node::digest(m_pRoot.get());
+		}
+
+		bool equals(const TreapVersion& other) const
+		{
+			return m_pRoot == other.m_pRoot || digest() == other.digest();
+		}
+
+		template<typename Callback>
+		void diff(const TreapVersion& other, const Callback& callback) const
+		{
+			Node::diff(m_pRoot.get(), other.m_pRoot.get(), nullptr, nullptr, callback);
+		}
+
+		void print()
+		{
+			if (m_pRoot == nullptr)
+				return;
+
+			m_pRoot->print();
+		}
+
+	private:
+		TreapNodePtr m_pRoot;
+	};
+
+	const int BTREE_WIDTH = 32;
+	const int BTREE_MIN_WIDTH = BTREE_WIDTH / 2;
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy = AtomicRefCount, typename Allocator = HeapAllocator>
+	class BTreeVersion;
+
+	/*
+	* Searches a block of BTREE_WIDTH sorted keys. Integral and floating-point keys are compared all at once
+	* with AVX2 or SSE2 compare and movemask, chosen at compile time, other keys use binary search
+	*/
+	template<typename KeyType>
+	struct KeyBlockSearch
+	{
+		static const bool IS_INTEGER = std::is_integral<KeyType>::value && !std::is_same<KeyType, bool>::value;
+		static const bool IS_FLOATING = std::is_same<KeyType, float>::value || std::is_same<KeyType, double>::value;
+#if defined(__AVX2__) || defined(__SSE4_2__)
+		static const bool IS_VECTORIZED = IS_FLOATING || (IS_INTEGER && (sizeof(KeyType) == 4 || sizeof(KeyType) == 8));
+#elif defined(__SSE2__) || defined(_M_X64)
+		static const bool IS_VECTORIZED = IS_FLOATING || (IS_INTEGER && sizeof(KeyType) == 4);
+#else
+		static const bool IS_VECTORIZED = false;
+#endif
+
+		/*
+		* Counts keys in [first, last) less than key or, if isStrict, not greater than key
+		*/
+		static int count(const KeyType* aKeys, int first, int last, const KeyType& key, bool isStrict)
+		{
+			if constexpr (IS_VECTORIZED)
+			{
+				std::uint64_t range = ((std::uint64_t(1) << last) - 1) & ~((std::uint64_t(1) << first) - 1);
+				if (!isStrict)
+					return int(std::bitset<64>(compare(aKeys, key, false) & range).count());
+				return int(std::bitset<64>(range).count() - std::bitset<64>(compare(aKeys, key, true) & range).count());
+			}
+			else
+				return int((isStrict ? std::upper_bound(aKeys + first, aKeys + last, key) : std::lower_bound(aKeys + first, aKeys + last, key)) - (aKeys + first));
+		}
+
+	private:
+#if defined(__AVX2__)
+		/*
+		* Gets bit mask of keys greater than key or, if not isGreater, less than key
+		*/
+		static std::uint64_t compare(const KeyType* aKeys, const KeyType& key, bool isGreater)
+		{
+			std::uint64_t mask = 0;
+			if constexpr (std::is_same<KeyType, float>::value)
+			{
+				__m256 k = _mm256_set1_ps(key);
+				for (int i = 0; i < BTREE_WIDTH; i += 8)
+				{
+					__m256 keys = _mm256_loadu_ps(aKeys + i);
+					__m256 cmp = isGreater ? _mm256_cmp_ps(keys, k, _CMP_GT_OQ) : _mm256_cmp_ps(keys, k, _CMP_LT_OQ);
+					mask |= std::uint64_t(_mm256_movemask_ps(cmp)) << i;
+				}
+			}
+			else if constexpr (std::is_same<KeyType, double>::value)
+			{
+				__m256d k = _mm256_set1_pd(key);
+				for (int i = 0; i < BTREE_WIDTH; i += 4)
+				{
+					__m256d keys = _mm256_loadu_pd(aKeys + i);
+					__m256d cmp = isGreater ? _mm256_cmp_pd(keys, k, _CMP_GT_OQ) : _mm256_cmp_pd(keys, k, _CMP_LT_OQ);
+					mask |= std::uint64_t(_mm256_movemask_pd(cmp)) << i;
+				}
+			}
+			else if constexpr (sizeof(KeyType) == 4)
+			{
+				// unsigned keys are compared as signed ones with the sign bit flipped
+				__m256i bias = _mm256_set1_epi32(std::is_signed<KeyType>::value ? 0 : std::numeric_limits<int>::min());
+				__m256i k = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(key)), bias);
+				for (int i = 0; i < BTREE_WIDTH; i += 8)
+				{
+					__m256i keys = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(aKeys + i)), bias);
+					__m256i cmp = isGreater ? _mm256_cmpgt_epi32(keys, k) : _mm256_cmpgt_epi32(k, keys);
+					mask |= std::uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(cmp))) << i;
+				}
+			}
+			else
+			{
+				__m256i bias = _mm256_set1_epi64x(std::is_signed<KeyType>::value ? 0 : std::numeric_limits<long long>::min());
+				__m256i k = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(key)), bias);
+				for (int i = 0; i < BTREE_WIDTH; i += 4)
+				{
+					__m256i keys = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(aKeys + i)), bias);
+					__m256i cmp = isGreater ? _mm256_cmpgt_epi64(keys, k) : _mm256_cmpgt_epi64(k, keys);
+					mask |= std::uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(cmp))) << i;
+				}
+			}
+			return mask;
+		}
+#elif defined(__SSE2__) || defined(_M_X64)
+		/*
+		* Gets bit mask of keys greater than key or, if not isGreater, less than key
+		*/
+		static std::uint64_t compare(const KeyType* aKeys, const KeyType& key, bool isGreater)
+		{
+			std::uint64_t mask = 0;
+			if constexpr (std::is_same<KeyType, float>::value)
+			{
+				__m128 k = _mm_set1_ps(key);
+				for (int i = 0; i < BTREE_WIDTH; i += 4)
+				{
+					__m128 keys = _mm_loadu_ps(aKeys + i);
+					__m128 cmp = isGreater ? _mm_cmpgt_ps(keys, k) : _mm_cmplt_ps(keys, k);
+					mask |= std::uint64_t(_mm_movemask_ps(cmp)) << i;
+				}
+			}
+			else if constexpr (std::is_same<KeyType, double>::value)
+			{
+				__m128d k = _mm_set1_pd(key);
+				for (int i = 0; i < BTREE_WIDTH; i += 2)
+				{
+					__m128d keys = _mm_loadu_pd(aKeys + i);
+					__m128d cmp = isGreater ? _mm_cmpgt_pd(keys, k) : _mm_cmplt_pd(keys, k);
+					mask |= std::uint64_t(_mm_movemask_pd(cmp)) << i;
+				}
+			}
+			else if constexpr (sizeof(KeyType) == 4)
+			{
+				// unsigned keys are compared as signed ones with the sign bit flipped
+				__m128i bias = _mm_set1_epi32(std::is_signed<KeyType>::value ? 0 : std::numeric_limits<int>::min());
+				__m128i k = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(key)), bias);
+				for (int i = 0; i < BTREE_WIDTH; i += 4)
+				{
+					__m128i keys = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(aKeys + i)), bias);
+					__m128i cmp = isGreater ? _mm_cmpgt_epi32(keys, k) : _mm_cmpgt_epi32(k, keys);
+					mask |= std::uint64_t(_mm_movemask_ps(_mm_castsi128_ps(cmp))) << i;
+				}
+			}
+#if defined(__SSE4_2__)
+			else
+			{
+				__m128i bias = _mm_set1_epi64x(std::is_signed<KeyType>::value ? 0 : std::numeric_limits<long long>::min());
+				__m128i k = _mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(key)), bias);
+				for (int i = 0; i < BTREE_WIDTH; i += 2)
+				{
+					__m128i keys = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(aKeys + i)), bias);
+					__m128i cmp = isGreater ? _mm_cmpgt_epi64(keys, k) : _mm_cmpgt_epi64(k, keys);
+					mask |= std::uint64_t(_mm_movemask_pd(_mm_castsi128_pd(cmp))) << i;
+				}
+			}
+#endif
+			return mask;
+		}
+#endif
+	};
+
+	/*
+	* Node of a persistent B+-tree: leaves keep up to BTREE_WIDTH sorted keys with values,
+	* inner nodes keep up to BTREE_WIDTH children, key i > 0 is the smallest key under child i
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	struct BTreeNode : public RefCounted<RefCountPolicy, Allocator>
+	{
+		explicit BTreeNode(bool isLeaf) :
+			m_isLeaf(isLeaf)
+		{}
+
+		virtual ~BTreeNode() = default;
+
+		/*
+		* Gets index of the first key not less than key or, if isStrict, greater than key
+		*/
+		int lowerBound(const KeyType& key, bool isStrict = false) const
+		{
+			return KeyBlockSearch<KeyType>::count(m_aKeys.data(), 0, m_numKeys, key, isStrict);
+		}
+
+		/*
+		* Gets index of the child of inner node whose keys include key
+		*/
+		int childIndex(const KeyType& key) const
+		{
+			return KeyBlockSearch<KeyType>::count(m_aKeys.data(), 1, m_numKeys, key, true);
+		}
+
+		bool m_isLeaf;
+		int m_numKeys = 0;
+		EditToken m_edit = 0;
+		// keys past m_numKeys are compared by SIMD search too, so they are initialized
+		std::array<KeyType, BTREE_WIDTH> m_aKeys{};
+	};
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	struct BTreeLeaf : public BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator>
+	{
+		BTreeLeaf() :
+			BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator>(true)
+		{}
+
+		std::array<ValueType, BTREE_WIDTH> m_aValues;
+	};
+
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	struct BTreeInner : public BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator>
+	{
+		BTreeInner() :
+			BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator>(false)
+		{}
+
+		std::array<IntrusivePtr<BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator> >, BTREE_WIDTH> m_apChildren;
+	};
+
+	/*
+	* Iterates keys of a B+-tree version in ascending order, keeps the path from the root to the current leaf.
+	* Holds the root, so the version stays alive while it is iterated.
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	class BTreeIterator
+	{
+	public:
+		using Node = BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using Leaf = BTreeLeaf<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using Inner = BTreeInner<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using NodePtr = IntrusivePtr<Node>;
+
+		BTreeIterator() = default;
+
+		/**
+		* Checks if iterator is past the last key
+		*/
+		bool done() const
+		{
+			return m_aPath.empty();
+		}
+
+		/**
+		* Moves to the next key in ascending order
+		*/
+		void next()
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			m_aPath.back().m_index++;
+			settle();
+		}
+
+		const KeyType& key() const
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			return m_aPath.back().m_pNode->m_aKeys[m_aPath.back().m_index];
+		}
+
+		const ValueType& value() const
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			return static_cast<const Leaf*>(m_aPath.back().m_pNode)->m_aValues[m_aPath.back().m_index];
+		}
+
+	private:
+		friend class BTreeVersion<KeyType, ValueType, RefCountPolicy, Allocator>;
+
+		struct Entry
+		{
+			const Node* m_pNode;
+			int m_index;
+		};
+
+		explicit BTreeIterator(const NodePtr& pRoot) :
+			m_pRoot(pRoot)
+		{}
+
+		void pushFirst(const Node* pNode)
+		{
+			m_aPath.push_back(Entry{ pNode, 0 });
+			while (!pNode->m_isLeaf)
+			{
+				pNode = static_cast<const Inner*>(pNode)->m_apChildren[0].get();
+				m_aPath.push_back(Entry{ pNode, 0 });
+			}
+		}
+
+		/*
+		* Moves from the end of a leaf to the first key of the next leaf
+		*/
+		void settle()
+		{
+			while (m_aPath.back().m_index == m_aPath.back().m_pNode->m_numKeys)
+			{
+				m_aPath.pop_back();
+				if (m_aPath.empty())
+					return;
+
+				Entry& parent = m_aPath.back();
+				if (++parent.m_index < parent.m_pNode->m_numKeys)
+				{
+					pushFirst(static_cast<const Inner*>(parent.m_pNode)->m_apChildren[parent.m_index].get());
+					return;
+				}
+			}
+		}
+
+		/*
+		* Positions iterator at the first key not less than key or, if isStrict, greater than key
+		*/
+		void seek(const KeyType& key, bool isStrict)
+		{
+			m_aPath.clear();
+			const Node* pNode = m_pRoot.get();
+			if (pNode == nullptr)
+				return;
+
+			while (!pNode->m_isLeaf)
+			{
+				int index = pNode->childIndex(key);
+				m_aPath.push_back(Entry{ pNode, index });
+				pNode = static_cast<const Inner*>(pNode)->m_apChildren[index].get();
+			}
+			m_aPath.push_back(Entry{ pNode, pNode->lowerBound(key, isStrict) });
+			settle();
+		}
+
+		NodePtr m_pRoot;
+		std::vector<Entry> m_aPath;
+	};
+
+	/*
+	* Map version stored as a persistent B+-tree: wide nodes with sorted key arrays, so a lookup touches
+	* log32(n) nodes, and changes copy the wide nodes on the path. Leaves aren't chained, as a chain
+	* would have to be copied along with every changed leaf; iterators walk the path instead.
+	* Set operations insert or look up the smaller operand in the larger one.
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	class BTreeVersion
+	{
+
+	public:
+		using Node = BTreeNode<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using Leaf = BTreeLeaf<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using Inner = BTreeInner<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using NodePtr = IntrusivePtr<Node>;
+		using Iterator = BTreeIterator<KeyType, ValueType, RefCountPolicy, Allocator>;
+
+		BTreeVersion() = default;
+
+		bool find(const KeyType& key, ValueType& value) const
+		{
+			const Node* pNode = m_pRoot.get();
+			if (pNode == nullptr)
+				return false;
+
+			while (!pNode->m_isLeaf)
+			{
+				pNode = static_cast<const Inner*>(pNode)->m_apChildren[pNode->childIndex(key)].get();
+			}
+
+			int index = pNode->lowerBound(key);
+			if (index == pNode->m_numKeys || !(pNode->m_aKeys[index] == key))
+				return false;
+
+			value = static_cast<const Leaf*>(pNode)->m_aValues[index];
+			return true;
+		}
+
+		int size() const
+		{
+			return m_size;
+		}
+
+		Iterator begin() const
+		{
+			Iterator it(m_pRoot);
+			if (m_pRoot != nullptr)
+				it.pushFirst(m_pRoot.get());
+			return it;
+		}
+
+		Iterator lowerBound(const KeyType& key) const
+		{
+			Iterator it(m_pRoot);
+			it.seek(key, false);
+			return it;
+		}
+
+		Iterator upperBound(const KeyType& key) const
+		{
+			Iterator it(m_pRoot);
+			it.seek(key, true);
+			return it;
+		}
+
+		/*
+		* Calls callback(key, value) for keys from lo inclusive to hi exclusive in ascending order
+		*/
+		template<typename Callback>
+		void forRange(const KeyType& lo, const KeyType& hi, const Callback& callback) const
+		{
+			for (Iterator it = lowerBound(lo); !it.done() && it.key() < hi; it.next())
+			{
+				callback(it.key(), it.value());
+			}
+		}
+
+		BTreeVersion erase(const KeyType& key, bool& isSuccess)
+		{
+			BTreeVersion version(*this);
+			isSuccess = version.erase(key, newEditToken());
+			return version;
+		}
+
+		BTreeVersion insert(const KeyType& key, const ValueType& value)
+		{
+			return setValue(key, value);
+		}
+
+		BTreeVersion setValue(const KeyType& key, const ValueType& value)
+		{
+			BTreeVersion version(*this);
+			version.setValue(key, value, newEditToken());
+			return version;
+		}
+
+		void setValue(const KeyType& key, const ValueType& value, EditToken edit)
+		{
+			if (m_pRoot == nullptr)
+			{
+				auto pLeaf = newNode<Leaf>(edit);
+				pLeaf->m_aKeys[0] = key;
+				pLeaf->m_aValues[0] = value;
+				pLeaf->m_numKeys = 1;
+				m_pRoot = pLeaf;
+				m_size = 1;
+				return;
+			}
+
+			bool isInserted = false;
+			KeyType separator;
+			m_pRoot = editable(m_pRoot, edit);
+			NodePtr pSibling = insert(m_pRoot.get(), key, value, edit, isInserted, separator);
+			if (isInserted)
+				m_size++;
+
+			if (pSibling != nullptr)
+			{
+				auto pRoot = newNode<Inner>(edit);
+				pRoot->m_apChildren[0] = std::move(m_pRoot);
+				pRoot->m_apChildren[1] = std::move(pSibling);
+				pRoot->m_aKeys[1] = separator;
+				pRoot->m_numKeys = 2;
+				m_pRoot = pRoot;
+			}
+		}
+
+		bool erase(const KeyType& key, EditToken edit)
+		{
+			ValueType value;
+			if (!find(key, value))
+				return false;
+
+			m_pRoot = editable(m_pRoot, edit);
+			erase(m_pRoot.get(), key, edit);
+			m_size--;
+
+			if (m_pRoot->m_numKeys == 0)
+			{
+				m_pRoot = nullptr;
+			}
+			else if (!m_pRoot->m_isLeaf && m_pRoot->m_numKeys == 1)
+			{
+				NodePtr pChild = std::move(static_cast<Inner*>(m_pRoot.get())->m_apChildren[0]);
+				m_pRoot = std::move(pChild);
+			}
+			return true;
+		}
+
+		template<typename Iterator>
+		static BTreeVersion fromSorted(Iterator begin, Iterator end)
+		{
+			EditToken edit = newEditToken();
+			BTreeVersion version;
+			std::vector<NodePtr> apLevel;
+			std::vector<KeyType> aFirstKeys;
+			for (; begin != end; ++begin)
+			{
+				bool isAscending = apLevel.empty() || apLevel.back()->m_aKeys[apLevel.back()->m_numKeys - 1] < begin->first;
+				assert(isAscending);
+				if (!isAscending)
+					throw std::exception();
+
+				if (apLevel.empty() || apLevel.back()->m_numKeys == BTREE_WIDTH)
+				{
+					apLevel.push_back(newNode<Leaf>(edit));
+					aFirstKeys.push_back(begin->first);
+				}
+
+				auto pLeaf = static_cast<Leaf*>(apLevel.back().get());
+				pLeaf->m_aKeys[pLeaf->m_numKeys] = begin->first;
+				pLeaf->m_aValues[pLeaf->m_numKeys] = begin->second;
+				pLeaf->m_numKeys++;
+				version.m_size++;
+			}
+
+			if (apLevel.empty())
+				return version;
+
+			balanceLast(apLevel, aFirstKeys);
+			while (apLevel.size() > 1)
+			{
+				std::vector<NodePtr> apParents;
+				std::vector<KeyType> aParentFirstKeys;
+				for (std::size_t i = 0; i < apLevel.size(); i++)
+				{
+					if (i % BTREE_WIDTH == 0)
+					{
+						apParents.push_back(newNode<Inner>(edit));
+						aParentFirstKeys.push_back(aFirstKeys[i]);
+					}
+
+					auto pInner = static_cast<Inner*>(apParents.back().get());
+					pInner->m_aKeys[pInner->m_numKeys] = aFirstKeys[i];
+					pInner->m_apChildren[pInner->m_numKeys] = std::move(apLevel[i]);
+					pInner->m_numKeys++;
+				}
+
+				balanceLast(apParents, aParentFirstKeys);
+				apLevel = std::move(apParents);
+				aFirstKeys = std::move(aParentFirstKeys);
+			}
+
+			version.m_pRoot = std::move(apLevel.front());
+			return version;
+		}
+
+		/*
+		* Inserts the sorted pairs one by one, nodes copied for the first pairs are changed in place for the rest
+		*/
+		template<typename Iterator>
+		BTreeVersion insertSorted(Iterator begin, Iterator end) const
+		{
+			EditToken edit = newEditToken();
+			BTreeVersion version(*this);
+			bool isFirst = true;
+			KeyType lastKey;
+			for (; begin != end; ++begin)
+			{
+				if (!isFirst && !(lastKey < begin->first))
+				{
+					assert(lastKey < begin->first);
+					throw std::exception();
+				}
+
+				version.setValue(begin->first, begin->second, edit);
+				lastKey = begin->first;
+				isFirst = false;
+			}
+			return version;
+		}
+
+		BTreeVersion unite(const BTreeVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return *this;
+
+			EditToken edit = newEditToken();
+			ValueType value;
+			if (other.m_size <= m_size)
+			{
+				BTreeVersion version(*this);
+				for (Iterator it = other.begin(); !it.done(); it.next())
+				{
+					if (!find(it.key(), value))
+						version.setValue(it.key(), it.value(), edit);
+				}
+				return version;
+			}
+
+			BTreeVersion version(other);
+			for (Iterator it = begin(); !it.done(); it.next())
+			{
+				version.setValue(it.key(), it.value(), edit);
+			}
+			return version;
+		}
+
+		BTreeVersion intersect(const BTreeVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return *this;
+
+			std::vector<std::pair<KeyType, ValueType> > aPairs;
+			ValueType value;
+			if (other.m_size <= m_size)
+			{
+				for (Iterator it = other.begin(); !it.done(); it.next())
+				{
+					if (find(it.key(), value))
+						aPairs.emplace_back(it.key(), value);
+				}
+			}
+			else
+			{
+				for (Iterator it = begin(); !it.done(); it.next())
+				{
+					if (other.find(it.key(), value))
+						aPairs.emplace_back(it.key(), it.value());
+				}
+			}
+			return fromSorted(aPairs.begin(), aPairs.end());
+		}
+
+		BTreeVersion subtract(const BTreeVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return BTreeVersion();
+
+			if (other.m_size <= m_size)
+			{
+				EditToken edit = newEditToken();
+				BTreeVersion version(*this);
+				for (Iterator it = other.begin(); !it.done(); it.next())
+				{
+					version.erase(it.key(), edit);
+				}
+				return version;
+			}
+
+			std::vector<std::pair<KeyType, ValueType> > aPairs;
+			ValueType value;
+			for (Iterator it = begin(); !it.done(); it.next())
+			{
+				if (!other.find(it.key(), value))
+					aPairs.emplace_back(it.key(), it.value());
+			}
+			return fromSorted(aPairs.begin(), aPairs.end());
+		}
+
+		/*
+		* Calls callback(key, pFirstValue, pSecondValue) in ascending order for keys whose values differ from other.
+		* Both trees are merged in key order, a child shared by both trees is skipped as a whole
+		*/
+		template<typename Callback>
+		void diff(const BTreeVersion& other, const Callback& callback) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return;
+
+			DiffCursor first(m_pRoot.get()), second(other.m_pRoot.get());
+			while (!first.done() && !second.done())
+			{
+				const Node* pFirst = first.subtree();
+				const Node* pSecond = second.subtree();
+				if (pFirst != nullptr && pFirst == pSecond)
+				{
+					first.skip();
+					second.skip();
+					continue;
+				}
+
+				const KeyType& firstKey = first.minKey();
+				const KeyType& secondKey = second.minKey();
+				if (firstKey < secondKey || secondKey < firstKey)
+				{
+					// the smaller key is missing in the other tree, a subtree starting with it is split first
+					DiffCursor& cursor = firstKey < secondKey ? first : second;
+					if (cursor.subtree() != nullptr)
+					{
+						cursor.descend();
+						continue;
+					}
+
+					bool isFirst = &cursor == &first;
+					callback(cursor.minKey(), isFirst ? &cursor.value() : nullptr, isFirst ? nullptr : &cursor.value());
+					cursor.skip();
+				}
+				else if (pFirst == nullptr && pSecond == nullptr)
+				{
+					if (!(first.value() == second.value()))
+						callback(firstKey, &first.value(), &second.value());
+					first.skip();
+					second.skip();
+				}
+				else
+				{
+					// the taller subtree is split, so a child shared at a different depth can still be skipped
+					bool isFirstDescended = pFirst != nullptr && (pSecond == nullptr || first.height() >= second.height());
+					bool isSecondDescended = pSecond != nullptr && (pFirst == nullptr || second.height() >= first.height());
+					if (isFirstDescended)
+						first.descend();
+					if (isSecondDescended)
+						second.descend();
+				}
+			}
+
+			for (; !first.done(); first.skip())
+			{
+				while (first.subtree() != nullptr)
+					first.descend();
+				callback(first.minKey(), &first.value(), nullptr);
+			}
+
+			for (; !second.done(); second.skip())
+			{
+				while (second.subtree() != nullptr)
+					second.descend();
+				callback(second.minKey(), nullptr, &second.value());
+			}
+		}
+
+		void print()
+		{
+			for (Iterator it = begin(); !it.done(); it.next())
+			{
+				std::cout << "(" << it.key() << "; " << it.value() << ")  ";
+			}
+		}
+
+	private:
+		/*
+		* Position of diff in a tree: a key of a leaf or a child of an inner node, whose subtree is not visited yet
+		*/
+		class DiffCursor
+		{
+		public:
+			explicit DiffCursor(const Node* pRoot)
+			{
+				if (pRoot == nullptr)
+					return;
+
+				m_aPath.push_back(Entry{ pRoot, 0 });
+				for (const Node* pNode = pRoot; !pNode->m_isLeaf; pNode = child(pNode, 0))
+				{
+					m_height++;
+				}
+			}
+
+			bool done() const
+			{
+				return m_aPath.empty();
+			}
+
+			/*
+			* Gets the child at the position, nullptr at a key
+			*/
+			const Node* subtree() const
+			{
+				const Entry& entry = m_aPath.back();
+				return entry.m_pNode->m_isLeaf ? nullptr : child(entry.m_pNode, entry.m_index);
+			}
+
+			/*
+			* Gets height of the child at the position, leaves have height 0
+			*/
+			int height() const
+			{
+				return m_height - (int)m_aPath.size();
+			}
+
+			const KeyType& minKey() const
+			{
+				const Node* pNode = m_aPath.back().m_pNode;
+				int index = m_aPath.back().m_index;
+				for (; !pNode->m_isLeaf; index = 0)
+				{
+					pNode = child(pNode, index);
+				}
+				return pNode->m_aKeys[index];
+			}
+
+			const ValueType& value() const
+			{
+				return static_cast<const Leaf*>(m_aPath.back().m_pNode)->m_aValues[m_aPath.back().m_index];
+			}
+
+			void descend()
+			{
+				m_aPath.push_back(Entry{ subtree(), 0 });
+			}
+
+			/*
+			* Moves past the key or the child at the position
+			*/
+			void skip()
+			{
+				m_aPath.back().m_index++;
+				while (m_aPath.back().m_index == m_aPath.back().m_pNode->m_numKeys)
+				{
+					m_aPath.pop_back();
+					if (m_aPath.empty())
+						return;
+					m_aPath.back().m_index++;
+				}
+			}
+
+		private:
+			struct Entry
+			{
+				const Node* m_pNode;
+				int m_index;
+			};
+
+			static const Node* child(const Node* pNode, int index)
+			{
+				return static_cast<const Inner*>(pNode)->m_apChildren[index].get();
+			}
+
+			std::vector<Entry> m_aPath;
+			int m_height = 0;
+		};
+
+		template<typename NodeType>
+		static IntrusivePtr<NodeType> newNode(EditToken edit)
+		{
+			auto pNode = makeIntrusive<NodeType>();
+			pNode->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+			return pNode;
+		}
+
+		static NodePtr editable(const NodePtr& pNode, EditToken edit)
+		{
+			if (edit == EXCLUSIVE_EDIT ? pNode.use_count() == 1 : pNode->m_edit == edit)
+				return pNode;
+
+			NodePtr pCopy;
+			if (pNode->m_isLeaf)
+				pCopy = makeIntrusive<Leaf>(*static_cast<const Leaf*>(pNode.get()));
+			else
+				pCopy = makeIntrusive<Inner>(*static_cast<const Inner*>(pNode.get()));
+			pCopy->m_edit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+			return pCopy;
+		}
+
+		/*
+		* Inserts key at index of node with room for it
+		*/
+		template<typename NodeType, typename Payload>
+		static void insertAt(NodeType* pNode, std::array<Payload, BTREE_WIDTH>& aPayload, int index, const KeyType& key, Payload payload)
+		{
+			std::move_backward(pNode->m_aKeys.begin() + index, pNode->m_aKeys.begin() + pNode->m_numKeys, pNode->m_aKeys.begin() + pNode->m_numKeys + 1);
+			std::move_backward(aPayload.begin() + index, aPayload.begin() + pNode->m_numKeys, aPayload.begin() + pNode->m_numKeys + 1);
+			pNode->m_aKeys[index] = key;
+			aPayload[index] = std::move(payload);
+			pNode->m_numKeys++;
+		}
+
+		/*
+		* Moves the upper half of a full node to a new right sibling
+		*/
+		template<typename NodeType, typename Payload>
+		static IntrusivePtr<NodeType> splitHalf(NodeType* pNode, std::array<Payload, BTREE_WIDTH> NodeType::* paPayload, EditToken edit)
+		{
+			auto pRight = newNode<NodeType>(edit);
+			std::move(pNode->m_aKeys.begin() + BTREE_MIN_WIDTH, pNode->m_aKeys.end(), pRight->m_aKeys.begin());
+			std::move((pNode->*paPayload).begin() + BTREE_MIN_WIDTH, (pNode->*paPayload).end(), (pRight.get()->*paPayload).begin());
+			pNode->m_numKeys = BTREE_MIN_WIDTH;
+			pRight->m_numKeys = BTREE_WIDTH - BTREE_MIN_WIDTH;
+			return pRight;
+		}
+
+		/*
+		* Sets value to key below editable node, returns the new right sibling and its smallest key if the node is split
+		*/
+		static NodePtr insert(Node* pNode, const KeyType& key, const ValueType& value, EditToken edit, bool& isInserted, KeyType& separator)
+		{
+			if (pNode->m_isLeaf)
+			{
+				auto pLeaf = static_cast<Leaf*>(pNode);
+				int index = pLeaf->lowerBound(key);
+				if (index < pLeaf->m_numKeys && pLeaf->m_aKeys[index] == key)
+				{
+					pLeaf->m_aValues[index] = value;
+					return nullptr;
+				}
+
+				isInserted = true;
+				IntrusivePtr<Leaf> pRight;
+				if (pLeaf->m_numKeys == BTREE_WIDTH)
+				{
+					pRight = splitHalf(pLeaf, &Leaf::m_aValues, edit);
+					if (index > BTREE_MIN_WIDTH)
+					{
+						insertAt(pRight.get(), pRight->m_aValues, index - BTREE_MIN_WIDTH, key, value);
+					}
+					else
+						insertAt(pLeaf, pLeaf->m_aValues, index, key, value);
+					separator = pRight->m_aKeys[0];
+					return pRight;
+				}
+
+				insertAt(pLeaf, pLeaf->m_aValues, index, key, value);
+				return nullptr;
+			}
+
+			auto pInner = static_cast<Inner*>(pNode);
+			int index = pInner->childIndex(key);
+			NodePtr& pChild = pInner->m_apChildren[index];
+			pChild = editable(pChild, edit);
+
+			KeyType childSeparator;
+			NodePtr pChildSibling = insert(pChild.get(), key, value, edit, isInserted, childSeparator);
+			if (pChildSibling == nullptr)
+				return nullptr;
+
+			if (pInner->m_numKeys == BTREE_WIDTH)
+			{
+				IntrusivePtr<Inner> pRight = splitHalf(pInner, &Inner::m_apChildren, edit);
+				separator = pRight->m_aKeys[0];
+				if (index + 1 > BTREE_MIN_WIDTH)
+				{
+					insertAt(pRight.get(), pRight->m_apChildren, index + 1 - BTREE_MIN_WIDTH, childSeparator, std::move(pChildSibling));
+				}
+				else
+					insertAt(pInner, pInner->m_apChildren, index + 1, childSeparator, std::move(pChildSibling));
+				return pRight;
+			}
+
+			insertAt(pInner, pInner->m_apChildren, index + 1, childSeparator, std::move(pChildSibling));
+			return nullptr;
+		}
+
+		/*
+		* Erases existing key below editable node, a child left with too few keys is refilled from its sibling
+		*/
+		static void erase(Node* pNode, const KeyType& key, EditToken edit)
+		{
+			if (pNode->m_isLeaf)
+			{
+				auto pLeaf = static_cast<Leaf*>(pNode);
+				int index = pLeaf->lowerBound(key);
+				std::move(pLeaf->m_aKeys.begin() + index + 1, pLeaf->m_aKeys.begin() + pLeaf->m_numKeys, pLeaf->m_aKeys.begin() + index);
+				std::move(pLeaf->m_aValues.begin() + index + 1, pLeaf->m_aValues.begin() + pLeaf->m_numKeys, pLeaf->m_aValues.begin() + index);
+				pLeaf->m_numKeys--;
+				return;
+			}
+
+			auto pInner = static_cast<Inner*>(pNode);
+			int index = pInner->childIndex(key);
+			NodePtr& pChild = pInner->m_apChildren[index];
+			pChild = editable(pChild, edit);
+			erase(pChild.get(), key, edit);
+			if (pChild->m_numKeys < BTREE_MIN_WIDTH && pInner->m_numKeys > 1)
+				rebalance(pInner, index, edit);
+		}
+
+		/*
+		* Merges child at index with its sibling if they fit in one node, otherwise splits their keys evenly
+		*/
+		static void rebalance(Inner* pParent, int index, EditToken edit)
+		{
+			int leftIndex = index > 0 ? index - 1 : index;
+			NodePtr& pLeft = pParent->m_apChildren[leftIndex];
+			NodePtr& pRight = pParent->m_apChildren[leftIndex + 1];
+			pLeft = editable(pLeft, edit);
+			pRight = editable(pRight, edit);
+
+			bool isMerged;
+			KeyType& separator = pParent->m_aKeys[leftIndex + 1];
+			if (pLeft->m_isLeaf)
+			{
+				isMerged = redistribute(static_cast<Leaf*>(pLeft.get()), static_cast<Leaf*>(pRight.get()), &Leaf::m_aValues, separator);
+			}
+			else
+				isMerged = redistribute(static_cast<Inner*>(pLeft.get()), static_cast<Inner*>(pRight.get()), &Inner::m_apChildren, separator);
+
+			if (isMerged)
+			{
+				int numKeys = pParent->m_numKeys;
+				std::move(pParent->m_aKeys.begin() + leftIndex + 2, pParent->m_aKeys.begin() + numKeys, pParent->m_aKeys.begin() + leftIndex + 1);
+				std::move(pParent->m_apChildren.begin() + leftIndex + 2, pParent->m_apChildren.begin() + numKeys, pParent->m_apChildren.begin() + leftIndex + 1);
+				pParent->m_apChildren[numKeys - 1] = nullptr;
+				pParent->m_numKeys--;
+			}
+		}
+
+		/*
+		* Puts keys of siblings into the left one if they fit, otherwise splits them evenly and updates
+		* separator, the smallest key of the right one. Returns true if the right sibling is emptied
+		*/
+		template<typename NodeType, typename Payload>
+		static bool redistribute(NodeType* pLeft, NodeType* pRight, std::array<Payload, BTREE_WIDTH> NodeType::* paPayload, KeyType& separator)
+		{
+			std::array<KeyType, 2 * BTREE_WIDTH> aKeys;
+			std::array<Payload, 2 * BTREE_WIDTH> aPayload;
+
+			// the first key of an inner node is unused, it becomes the separator in between
+			if (!pLeft->m_isLeaf)
+				pRight->m_aKeys[0] = separator;
+
+			int numLeft = pLeft->m_numKeys, numKeys = pLeft->m_numKeys + pRight->m_numKeys;
+			std::move(pLeft->m_aKeys.begin(), pLeft->m_aKeys.begin() + numLeft, aKeys.begin());
+			std::move(pRight->m_aKeys.begin(), pRight->m_aKeys.begin() + pRight->m_numKeys, aKeys.begin() + numLeft);
+			std::move((pLeft->*paPayload).begin(), (pLeft->*paPayload).begin() + numLeft, aPayload.begin());
+			std::move((pRight->*paPayload).begin(), (pRight->*paPayload).begin() + pRight->m_numKeys, aPayload.begin() + numLeft);
+
+			numLeft = numKeys <= BTREE_WIDTH ? numKeys : numKeys / 2;
+			std::move(aKeys.begin(), aKeys.begin() + numLeft, pLeft->m_aKeys.begin());
+			std::move(aPayload.begin(), aPayload.begin() + numLeft, (pLeft->*paPayload).begin());
+			std::move(aKeys.begin() + numLeft, aKeys.begin() + numKeys, pRight->m_aKeys.begin());
+			std::move(aPayload.begin() + numLeft, aPayload.begin() + numKeys, (pRight->*paPayload).begin());
+			pLeft->m_numKeys = numLeft;
+			pRight->m_numKeys = numKeys - numLeft;
+			if (numLeft < numKeys)
+				separator = aKeys[numLeft];
+			return numLeft == numKeys;
+		}
+
+		/*
+		* Refills the last node of a level built from sorted pairs from the node before it
+		*/
+		static void balanceLast(std::vector<NodePtr>& apLevel, std::vector<KeyType>& aFirstKeys)
+		{
+			std::size_t last = apLevel.size() - 1;
+			if (last == 0 || apLevel[last]->m_numKeys >= BTREE_MIN_WIDTH)
+				return;
+
+			if (apLevel[last]->m_isLeaf)
+			{
+				redistribute(static_cast<Leaf*>(apLevel[last - 1].get()), static_cast<Leaf*>(apLevel[last].get()), &Leaf::m_aValues, aFirstKeys[last]);
+			}
+			else
+				redistribute(static_cast<Inner*>(apLevel[last - 1].get()), static_cast<Inner*>(apLevel[last].get()), &Inner::m_apChildren, aFirstKeys[last]);
+		}
+
+		NodePtr m_pRoot;
+		int m_size = 0;
+	};
+
+	const int HASH_TRIE_BITS = 5;
+	const std::size_t HASH_TRIE_MASK = (std::size_t(1) << HASH_TRIE_BITS) - 1;
+	const int HASH_BITS = int(sizeof(std::size_t) * 8);
+
+	template<typename KeyType, typename ValueType, typename Hash = std::hash<KeyType>, typename RefCountPolicy = AtomicRefCount, typename Allocator = HeapAllocator>
+	class HashTrieVersion;
+
+	/*
+	* Node of a hash array mapped trie: slot i, taken by the next HASH_TRIE_BITS bits of the hash, holds a pair
+	* if bit i of m_dataMap is set or a child if bit i of m_nodeMap is set, pairs and children are packed in
+	* slot order and found by popcount. Nodes below the last bits of the hash keep colliding pairs unordered.
+	* Pairs and then children follow the node in its allocation, so a node is sized by its entries and
+	* adding or removing an entry makes a new node.
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	struct HashTrieNode : public RefCounted<RefCountPolicy, Allocator>
+	{
+		using Pair = std::pair<KeyType, ValueType>;
+		using NodePtr = IntrusivePtr<HashTrieNode>;
+
+		/*
+		* Makes node with numPairs pairs and a child per bit of nodeMap, makePair(i, p) and makeChild(i, p)
+		* construct pair or child i at p
+		*/
+		template<typename PairMaker, typename ChildMaker>
+		static NodePtr create(std::uint32_t dataMap, std::uint32_t nodeMap, int numPairs, EditToken edit, const PairMaker& makePair, const ChildMaker& makeChild)
+		{
+			static_assert(alignof(Pair) <= alignof(std::max_align_t), "Pairs must not need more alignment than allocators give");
+
+			int numChildren = count(nodeMap);
+			HashTrieNode* pNode = ::new (HashTrieNode::operator new(byteSize(numPairs, numChildren))) HashTrieNode(dataMap, nodeMap, numPairs, edit);
+			int numMadePairs = 0, numMadeChildren = 0;
+			try
+			{
+				for (; numMadePairs < numPairs; numMadePairs++)
+				{
+					makePair(numMadePairs, static_cast<void*>(pNode->pairs() + numMadePairs));
+				}
+				for (; numMadeChildren < numChildren; numMadeChildren++)
+				{
+					makeChild(numMadeChildren, static_cast<void*>(pNode->children() + numMadeChildren));
+				}
+			}
+			catch (...)
+			{
+				destroy(pNode, numMadePairs, numMadeChildren);
+				throw;
+			}
+			return NodePtr(pNode);
+		}
+
+		/*
+		* Destroys entries of node and frees its allocation, called by NodeReclaimer instead of delete
+		*/
+		static void destroy(HashTrieNode* pNode)
+		{
+			destroy(pNode, pNode->numPairs(), pNode->numChildren());
+		}
+
+		/*
+		* Gets position of the pair or child of slot bit among those set in map
+		*/
+		static int index(std::uint32_t map, std::uint32_t bit)
+		{
+			return count(map & (bit - 1));
+		}
+
+		static int count(std::uint32_t map)
+		{
+			return int(std::bitset<32>(map).count());
+		}
+
+		int numPairs() const
+		{
+			return int(m_numPairs);
+		}
+
+		int numChildren() const
+		{
+			return count(m_nodeMap);
+		}
+
+		Pair* pairs()
+		{
+			return reinterpret_cast<Pair*>(reinterpret_cast<char*>(this) + pairsOffset());
+		}
+
+		const Pair* pairs() const
+		{
+			return reinterpret_cast<const Pair*>(reinterpret_cast<const char*>(this) + pairsOffset());
+		}
+
+		NodePtr* children()
+		{
+			return reinterpret_cast<NodePtr*>(reinterpret_cast<char*>(this) + childrenOffset(numPairs()));
+		}
+
+		const NodePtr* children() const
+		{
+			return reinterpret_cast<const NodePtr*>(reinterpret_cast<const char*>(this) + childrenOffset(numPairs()));
+		}
+
+		HashTrieNode(const HashTrieNode&) = delete;
+		HashTrieNode& operator=(const HashTrieNode&) = delete;
+
+		const std::uint32_t m_dataMap;
+		const std::uint32_t m_nodeMap;
+		const std::uint32_t m_numPairs;
+		EditToken m_edit;
+
+	private:
+		HashTrieNode(std::uint32_t dataMap, std::uint32_t nodeMap, int numPairs, EditToken edit) :
+			m_dataMap(dataMap),
+			m_nodeMap(nodeMap),
+			m_numPairs(std::uint32_t(numPairs)),
+			m_edit(edit)
+		{}
+
+		static void destroy(HashTrieNode* pNode, int numMadePairs, int numMadeChildren)
+		{
+			std::size_t size = byteSize(pNode->numPairs(), pNode->numChildren());
+			for (int i = numMadeChildren - 1; i >= 0; i--)
+			{
+				pNode->children()[i].~NodePtr();
+			}
+			for (int i = numMadePairs - 1; i >= 0; i--)
+			{
+				pNode->pairs()[i].~Pair();
+			}
+			pNode->~HashTrieNode();
+			HashTrieNode::operator delete(pNode, size);
+		}
+
+		static std::size_t alignUp(std::size_t offset, std::size_t alignment)
+		{
+			return (offset + alignment - 1) / alignment * alignment;
+		}
+
+		static std::size_t pairsOffset()
+		{
+			return alignUp(sizeof(HashTrieNode), alignof(Pair));
+		}
+
+		static std::size_t childrenOffset(int numPairs)
+		{
+			return alignUp(pairsOffset() + numPairs * sizeof(Pair), alignof(NodePtr));
+		}
+
+		static std::size_t byteSize(int numPairs, int numChildren)
+		{
+			return childrenOffset(numPairs) + numChildren * sizeof(NodePtr);
+		}
+	};
+
+	/*
+	* Iterates keys of a hash trie version in no particular order, keeps the path from the root to the current node.
+	* Holds the root, so the version stays alive while it is iterated.
+	*/
+	template<typename KeyType, typename ValueType, typename RefCountPolicy, typename Allocator>
+	class HashTrieIterator
+	{
+	public:
+		using Node = HashTrieNode<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using NodePtr = IntrusivePtr<Node>;
+
+		HashTrieIterator() = default;
+
+		/**
+		* Checks if iterator is past the last key
+		*/
+		bool done() const
+		{
+			return m_aPath.empty();
+		}
+
+		/**
+		* Moves to the next key
+		*/
+		void next()
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			m_aPath.back().m_index++;
+			settle();
+		}
+
+		const KeyType& key() const
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			return m_aPath.back().m_pNode->pairs()[m_aPath.back().m_index].first;
+		}
+
+		const ValueType& value() const
+		{
+			assert(!done());
+			if (done())
+				throw std::exception();
+
+			return m_aPath.back().m_pNode->pairs()[m_aPath.back().m_index].second;
+		}
+
+	private:
+		template<typename, typename, typename, typename, typename>
+		friend class HashTrieVersion;
+
+		/*
+		* Position in a node, pairs come first and children after them
+		*/
+		struct Entry
+		{
+			const Node* m_pNode;
+			int m_index;
+		};
+
+		explicit HashTrieIterator(const NodePtr& pRoot) :
+			m_pRoot(pRoot)
+		{
+			if (m_pRoot != nullptr)
+			{
+				m_aPath.push_back(Entry{ m_pRoot.get(), 0 });
+				settle();
+			}
+		}
+
+		/*
+		* Moves from the end of the pairs of a node to the first pair of the next node
+		*/
+		void settle()
+		{
+			while (!m_aPath.empty())
+			{
+				Entry& entry = m_aPath.back();
+				int numPairs = entry.m_pNode->numPairs();
+				if (entry.m_index < numPairs)
+					return;
+
+				int child = entry.m_index - numPairs;
+				if (child < entry.m_pNode->numChildren())
+				{
+					entry.m_index++;
+					m_aPath.push_back(Entry{ entry.m_pNode->children()[child].get(), 0 });
+				}
+				else
+					m_aPath.pop_back();
+			}
+		}
+
+		NodePtr m_pRoot;
+		std::vector<Entry> m_aPath;
+	};
+
+	/*
+	* Map version stored as a persistent hash array mapped trie: 32-way nodes indexed by bits of Hash of
+	* the key, so a lookup touches about log32(n) nodes and needs only Hash and operator== of keys.
+	* A node left with a single pair after erase is merged into its parent, so each key set has one shape.
+	* Keys are iterated in no particular order, and set operations insert or look up the smaller operand in the larger one.
+	*/
+	template<typename KeyType, typename ValueType, typename Hash, typename RefCountPolicy, typename Allocator>
+	class HashTrieVersion
+	{
+
+	public:
+		using Node = HashTrieNode<KeyType, ValueType, RefCountPolicy, Allocator>;
+		using NodePtr = IntrusivePtr<Node>;
+		using Pair = std::pair<KeyType, ValueType>;
+		using Iterator = HashTrieIterator<KeyType, ValueType, RefCountPolicy, Allocator>;
+
+		HashTrieVersion() = default;
+
+		bool find(const KeyType& key, ValueType& value) const
+		{
+			std::size_t hash = Hash()(key);
+			const Node* pNode = m_pRoot.get();
+			for (int shift = 0; pNode != nullptr; shift += HASH_TRIE_BITS)
+			{
+				if (shift >= HASH_BITS)
+				{
+					const Pair* pPair = findPair(*pNode, key);
+					if (pPair == nullptr)
+						return false;
+
+					value = pPair->second;
+					return true;
+				}
+
+				std::uint32_t bit = slotBit(hash, shift);
+				if (pNode->m_dataMap & bit)
+				{
+					const Pair& pair = pNode->pairs()[Node::index(pNode->m_dataMap, bit)];
+					if (!(pair.first == key))
+						return false;
+
+					value = pair.second;
+					return true;
+				}
+
+				if (!(pNode->m_nodeMap & bit))
+					return false;
+
+				pNode = pNode->children()[Node::index(pNode->m_nodeMap, bit)].get();
+			}
+			return false;
+		}
+
+		int size() const
+		{
+			return m_size;
+		}
+
+		Iterator begin() const
+		{
+			return Iterator(m_pRoot);
+		}
+
+		HashTrieVersion erase(const KeyType& key, bool& isSuccess)
+		{
+			HashTrieVersion version(*this);
+			isSuccess = version.erase(key, newEditToken());
+			return version;
+		}
+
+		HashTrieVersion insert(const KeyType& key, const ValueType& value)
+		{
+			return setValue(key, value);
+		}
+
+		HashTrieVersion setValue(const KeyType& key, const ValueType& value)
+		{
+			HashTrieVersion version(*this);
+			version.setValue(key, value, newEditToken());
+			return version;
+		}
+
+		void setValue(const KeyType& key, const ValueType& value, EditToken edit)
+		{
+			std::size_t hash = Hash()(key);
+			Pair pair(key, value);
+			if (m_pRoot == nullptr)
+			{
+				m_pRoot = rebuild(nullptr, slotBit(hash, 0), 0, 1, Splice<Pair>{ -1, 0, &pair }, Splice<NodePtr>(), edit);
+				m_size++;
+				return;
+			}
+
+			// nodes are replaced in the slot of their parent, which is made editable on the way down
+			NodePtr* ppNode = &m_pRoot;
+			for (int shift = 0; ; shift += HASH_TRIE_BITS)
+			{
+				Node* pNode = ppNode->get();
+				int numPairs = pNode->numPairs();
+				if (shift >= HASH_BITS)
+				{
+					const Pair* pPair = findPair(*pNode, key);
+					if (pPair != nullptr)
+					{
+						int index = int(pPair - pNode->pairs());
+						*ppNode = editable(*ppNode, edit);
+						(*ppNode)->pairs()[index].second = value;
+						return;
+					}
+
+					*ppNode = rebuild(*ppNode, 0, 0, numPairs + 1, Splice<Pair>{ -1, numPairs, &pair }, Splice<NodePtr>(), edit);
+					m_size++;
+					return;
+				}
+
+				std::uint32_t bit = slotBit(hash, shift);
+				std::uint32_t dataMap = pNode->m_dataMap, nodeMap = pNode->m_nodeMap;
+				if (nodeMap & bit)
+				{
+					*ppNode = editable(*ppNode, edit);
+					ppNode = &(*ppNode)->children()[Node::index(nodeMap, bit)];
+					continue;
+				}
+
+				int index = Node::index(dataMap, bit);
+				if (!(dataMap & bit))
+				{
+					*ppNode = rebuild(*ppNode, dataMap | bit, nodeMap, numPairs + 1, Splice<Pair>{ -1, index, &pair }, Splice<NodePtr>(), edit);
+					m_size++;
+					return;
+				}
+
+				const Pair& other = pNode->pairs()[index];
+				if (other.first == key)
+				{
+					*ppNode = editable(*ppNode, edit);
+					(*ppNode)->pairs()[index].second = value;
+					return;
+				}
+
+				// the slot is taken by another key, both keys move to a new child
+				NodePtr pChild = join(other, Hash()(other.first), pair, hash, shift + HASH_TRIE_BITS, edit);
+				*ppNode = rebuild(*ppNode, dataMap & ~bit, nodeMap | bit, numPairs - 1, Splice<Pair>{ index, -1, nullptr }, Splice<NodePtr>{ -1, Node::index(nodeMap, bit), &pChild }, edit);
+				m_size++;
+				return;
+			}
+		}
+
+		bool erase(const KeyType& key, EditToken edit)
+		{
+			ValueType value;
+			if (!find(key, value))
+				return false;
+
+			if (--m_size == 0)
+				m_pRoot = nullptr;
+			else
+				erase(m_pRoot, key, Hash()(key), 0, edit);
+			return true;
+		}
+
+		HashTrieVersion unite(const HashTrieVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return *this;
+
+			EditToken edit = newEditToken();
+			ValueType value;
+			if (other.m_size <= m_size)
+			{
+				HashTrieVersion version(*this);
+				for (Iterator it = other.begin(); !it.done(); it.next())
+				{
+					if (!find(it.key(), value))
+						version.setValue(it.key(), it.value(), edit);
+				}
+				return version;
+			}
+
+			HashTrieVersion version(other);
+			for (Iterator it = begin(); !it.done(); it.next())
+			{
+				version.setValue(it.key(), it.value(), edit);
+			}
+			return version;
+		}
+
+		HashTrieVersion intersect(const HashTrieVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return *this;
+
+			EditToken edit = newEditToken();
+			HashTrieVersion version;
+			ValueType value;
+			if (other.m_size <= m_size)
+			{
+				for (Iterator it = other.begin(); !it.done(); it.next())
+				{
+					if (find(it.key(), value))
+						version.setValue(it.key(), value, edit);
+				}
+			}
+			else
+			{
+				for (Iterator it = begin(); !it.done(); it.next())
+				{
+					if (other.find(it.key(), value))
+						version.setValue(it.key(), it.value(), edit);
+				}
+			}
+			return version;
+		}
+
+		HashTrieVersion subtract(const HashTrieVersion& other) const
+		{
+			if (m_pRoot == other.m_pRoot)
+				return HashTrieVersion();
+
+			EditToken edit = newEditToken();
+			if (other.m_size <= m_size)
+			{
+				HashTrieVersion version(*this);
+				for (Iterator it = other.begin(); !it.done(); it.next())
+				{
+					version.erase(it.key(), edit);
+				}
+				return version;
+			}
+
+			HashTrieVersion version;
+			ValueType value;
+			for (Iterator it = begin(); !it.done(); it.next())
+			{
+				if (!other.find(it.key(), value))
+					version.setValue(it.key(), it.value(), edit);
+			}
+			return version;
+		}
+
+		/*
+		* Calls callback(key, pFirstValue, pSecondValue) in no particular order for keys whose values differ from other.
+		* Both tries are descended together slot by slot, children shared by both tries are skipped
+		*/
+		template<typename Callback>
+		void diff(const HashTrieVersion& other, const Callback& callback) const
+		{
+			diff(m_pRoot.get(), other.m_pRoot.get(), 0, callback);
+		}
+
+		void print()
+		{
+			for (Iterator it = begin(); !it.done(); it.next())
+			{
+				std::cout << "(" << it.key() << "; " << it.value() << ")  ";
+			}
+		}
+
+	private:
+		/*
+		* Calls callback(key, pFirstValue, pSecondValue) for keys whose values differ between nodes at shift
+		*/
+		template<typename Callback>
+		static void diff(const Node* pFirst, const Node* pSecond, int shift, const Callback& callback)
+		{
+			if (pFirst == pSecond)
+				return;
+
+			if (pFirst == nullptr || pSecond == nullptr)
+			{
+				diffSubtree(pFirst != nullptr ? pFirst : pSecond, nullptr, pFirst != nullptr, callback);
+				return;
+			}
+
+			if (shift >= HASH_BITS)
+			{
+				for (int i = 0; i < pSecond->numPairs(); i++)
+				{
+					const Pair& pair = pSecond->pairs()[i];
+					const Pair* pFirstPair = findPair(*pFirst, pair.first);
+					if (pFirstPair == nullptr)
+						callback(pair.first, nullptr, &pair.second);
+					else if (!(pFirstPair->second == pair.second))
+						callback(pair.first, &pFirstPair->second, &pair.second);
+				}
+
+				for (int i = 0; i < pFirst->numPairs(); i++)
+				{
+					const Pair& pair = pFirst->pairs()[i];
+					if (findPair(*pSecond, pair.first) == nullptr)
+						callback(pair.first, &pair.second, nullptr);
+				}
+				return;
+			}
+
+			std::uint32_t slots = pFirst->m_dataMap | pFirst->m_nodeMap | pSecond->m_dataMap | pSecond->m_nodeMap;
+			for (; slots != 0; slots &= slots - 1)
+			{
+				std::uint32_t bit = slots & (~slots + 1);
+				const Pair* pFirstPair = (pFirst->m_dataMap & bit) ? &pFirst->pairs()[Node::index(pFirst->m_dataMap, bit)] : nullptr;
+				const Pair* pSecondPair = (pSecond->m_dataMap & bit) ? &pSecond->pairs()[Node::index(pSecond->m_dataMap, bit)] : nullptr;
+				const Node* pFirstChild = (pFirst->m_nodeMap & bit) ? pFirst->children()[Node::index(pFirst->m_nodeMap, bit)].get() : nullptr;
+				const Node* pSecondChild = (pSecond->m_nodeMap & bit) ? pSecond->children()[Node::index(pSecond->m_nodeMap, bit)].get() : nullptr;
+
+				if (pFirstChild != nullptr && pSecondChild != nullptr)
+				{
+					diff(pFirstChild, pSecondChild, shift + HASH_TRIE_BITS, callback);
+				}
+				else if (pFirstChild != nullptr || pSecondChild != nullptr)
+				{
+					bool isFirst = pFirstChild != nullptr;
+					diffSubtree(isFirst ? pFirstChild : pSecondChild, isFirst ? pSecondPair : pFirstPair, isFirst, callback);
+				}
+				else if (pFirstPair != nullptr && pSecondPair != nullptr && pFirstPair->first == pSecondPair->first)
+				{
+					if (!(pFirstPair->second == pSecondPair->second))
+						callback(pFirstPair->first, &pFirstPair->second, &pSecondPair->second);
+				}
+				else
+				{
+					if (pFirstPair != nullptr)
+						callback(pFirstPair->first, &pFirstPair->second, nullptr);
+					if (pSecondPair != nullptr)
+						callback(pSecondPair->first, nullptr, &pSecondPair->second);
+				}
+			}
+		}
+
+		/*
+		* Reports differences between pairs of a subtree and a pair, which may be nullptr, from the other trie
+		* @param isFirst - true, if the subtree is of the first trie
+		*/
+		template<typename Callback>
+		static void diffSubtree(const Node* pNode, const Pair* pOther, bool isFirst, const Callback& callback)
+		{
+			bool isMatched = false;
+			forEach(pNode, [&](const Pair& pair)
+			{
+				if (pOther != nullptr && pair.first == pOther->first)
+				{
+					isMatched = true;
+					if (!(pair.second == pOther->second))
+						callback(pair.first, isFirst ? &pair.second : &pOther->second, isFirst ? &pOther->second : &pair.second);
+				}
+				else
+					callback(pair.first, isFirst ? &pair.second : nullptr, isFirst ? nullptr : &pair.second);
+			});
+
+			if (pOther != nullptr && !isMatched)
+				callback(pOther->first, isFirst ? nullptr : &pOther->second, isFirst ? &pOther->second : nullptr);
+		}
+
+		template<typename Function>
+		static void forEach(const Node* pNode, const Function& function)
+		{
+			for (int i = 0; i < pNode->numPairs(); i++)
+			{
+				function(pNode->pairs()[i]);
+			}
+			for (int i = 0; i < pNode->numChildren(); i++)
+			{
+				forEach(pNode->children()[i].get(), function);
+			}
+		}
+
+		static std::uint32_t slotBit(std::size_t hash, int shift)
+		{
+			return std::uint32_t(1) << ((hash >> shift) & HASH_TRIE_MASK);
+		}
+
+		/*
+		* Change of the pairs or children of a node made by rebuild: the entry at m_erased is left out
+		* and *m_pEntry is moved in at m_inserted, a position in the new node, -1 stands for no change
+		*/
+		template<typename Entry>
+		struct Splice
+		{
+			int m_erased = -1;
+			int m_inserted = -1;
+			Entry* m_pEntry = nullptr;
+		};
+
+		static const Pair* findPair(const Node& node, const KeyType& key)
+		{
+			const Pair* pEnd = node.pairs() + node.numPairs();
+			const Pair* pPair = std::find_if(node.pairs(), pEnd, [&key](const Pair& pair) { return pair.first == key; });
+			return pPair != pEnd ? pPair : nullptr;
+		}
+
+		static bool isEditable(const NodePtr& pNode, EditToken edit)
+		{
+			return edit == EXCLUSIVE_EDIT ? pNode.use_count() == 1 : pNode->m_edit == edit;
+		}
+
+		static NodePtr editable(const NodePtr& pNode, EditToken edit)
+		{
+			if (isEditable(pNode, edit))
+				return pNode;
+
+			return rebuild(pNode, pNode->m_dataMap, pNode->m_nodeMap, pNode->numPairs(), Splice<Pair>(), Splice<NodePtr>(), edit);
+		}
+
+		/*
+		* Makes node with the given maps from entries of pNode, which may be nullptr, changed by the splices.
+		* Entries of an editable node are moved, as the node is dropped for the new one
+		*/
+		static NodePtr rebuild(const NodePtr& pNode, std::uint32_t dataMap, std::uint32_t nodeMap, int numPairs, const Splice<Pair>& pairSplice, const Splice<NodePtr>& childSplice, EditToken edit)
+		{
+			bool isMoved = pNode != nullptr && isEditable(pNode, edit);
+			Pair* pPairs = pNode != nullptr ? pNode->pairs() : nullptr;
+			NodePtr* pChildren = pNode != nullptr ? pNode->children() : nullptr;
+			return Node::create(dataMap, nodeMap, numPairs, edit == EXCLUSIVE_EDIT ? 0 : edit,
+				[&](int i, void* p) { makeEntry(i, p, pPairs, pairSplice, isMoved); },
+				[&](int i, void* p) { makeEntry(i, p, pChildren, childSplice, isMoved); });
+		}
+
+		template<typename Entry>
+		static void makeEntry(int i, void* p, Entry* pEntries, const Splice<Entry>& splice, bool isMoved)
+		{
+			if (i == splice.m_inserted)
+			{
+				::new (p) Entry(std::move(*splice.m_pEntry));
+				return;
+			}
+
+			int source = splice.m_inserted >= 0 && i > splice.m_inserted ? i - 1 : i;
+			if (splice.m_erased >= 0 && source >= splice.m_erased)
+				source++;
+
+			if (isMoved)
+				::new (p) Entry(std::move_if_noexcept(pEntries[source]));
+			else
+				::new (p) Entry(pEntries[source]);
+		}
+
+		/*
+		* Makes node at shift holding two pairs with different keys, with a chain of children while their hashes match
+		*/
+		static NodePtr join(const Pair& first, std::size_t firstHash, const Pair& second, std::size_t secondHash, int shift, EditToken edit)
+		{
+			EditToken nodeEdit = edit == EXCLUSIVE_EDIT ? 0 : edit;
+			auto noChildren = [](int, void*) {};
+			if (shift >= HASH_BITS)
+				return Node::create(0, 0, 2, nodeEdit, [&](int i, void* p) { ::new (p) Pair(i == 0 ? first : second); }, noChildren);
+
+			std::uint32_t firstBit = slotBit(firstHash, shift), secondBit = slotBit(secondHash, shift);
+			if (firstBit == secondBit)
+			{
+				NodePtr pChild = join(first, firstHash, second, secondHash, shift + HASH_TRIE_BITS, edit);
+				return Node::create(0, firstBit, 0, nodeEdit, [](int, void*) {}, [&pChild](int, void* p) { ::new (p) NodePtr(std::move(pChild)); });
+			}
+
+			bool isFirstLower = firstBit < secondBit;
+			return Node::create(firstBit | secondBit, 0, 2, nodeEdit, [&](int i, void* p) { ::new (p) Pair((i == 0) == isFirstLower ? first : second); }, noChildren);
+		}
+
+		/*
+		* Erases existing key below the node in slot pNode at shift, replacing the node if its entries change.
+		* A child left with a single pair is merged into the node
+		*/
+		static void erase(NodePtr& pNode, const KeyType& key, std::size_t hash, int shift, EditToken edit)
+		{
+			if (shift >= HASH_BITS)
+			{
+				int index = int(findPair(*pNode, key) - pNode->pairs());
+				pNode = rebuild(pNode, 0, 0, pNode->numPairs() - 1, Splice<Pair>{ index, -1, nullptr }, Splice<NodePtr>(), edit);
+				return;
+			}
+
+			std::uint32_t bit = slotBit(hash, shift);
+			std::uint32_t dataMap = pNode->m_dataMap, nodeMap = pNode->m_nodeMap;
+			if (dataMap & bit)
+			{
+				pNode = rebuild(pNode, dataMap & ~bit, nodeMap, pNode->numPairs() - 1, Splice<Pair>{ Node::index(dataMap, bit), -1, nullptr }, Splice<NodePtr>(), edit);
+				return;
+			}
+
+			// the node is made editable before its child, children of a copied node are shared
+			pNode = editable(pNode, edit);
+			int index = Node::index(nodeMap, bit);
+			NodePtr& pChild = pNode->children()[index];
+			erase(pChild, key, hash, shift + HASH_TRIE_BITS, edit);
+			if (pChild->numChildren() == 0 && pChild->numPairs() == 1)
+			{
+				Pair pair = std::move(pChild->pairs()[0]);
+				pNode = rebuild(pNode, dataMap | bit, nodeMap & ~bit, pNode->numPairs() + 1, Splice<Pair>{ -1, Node::index(dataMap, bit), &pair }, Splice<NodePtr>{ index, -1, nullptr }, edit);
+			}
+		}
+
+		NodePtr m_pRoot;
+		int m_size = 0;
+	};
+
+}
+
+template<typename KeyType, typename ValueType, typename VersionType>
+class PersistentMapTransient;
+
+/*
+* Immutable view of one version of PersistentMap, can be read from any thread
+*/
+template<typename KeyType, typename ValueType, typename VersionType>
+class PersistentMapSnapshot : public RefCounted<AtomicRefCount>
+{
+public:
+	PersistentMapSnapshot(int version, const VersionType& root) :
+		m_version(version),
+		m_root(root)
+	{}
+
+	/**
+	* Finds key in the snapshot
+	* @param key
+	* @param value - found value
+	* @return true, if found
+	*/
+	bool find(const KeyType& key, ValueType& value) const
+	{
+		return m_root.find(key, value);
+	}
+
+	/**
+	* Calls callback(key, value) for keys of the snapshot from lo inclusive to hi exclusive in ascending order
+	* @param lo
+	* @param hi
+	* @param callback
+	*/
+	template<typename Callback>
+	void forRange(const KeyType& lo, const KeyType& hi, const Callback& callback) const
+	{
+		m_root.forRange(lo, hi, callback);
+	}
+
+	/*
+	* Gets number of the version of the map
+	*/
+	int version() const
+	{
+		return m_version;
+	}
+
+private:
+	int m_version;
+	VersionType m_root;
+};
+
+template<typename KeyType, typename ValueType, typename VersionType = TreapVersion<KeyType, ValueType> >
+class PersistentMap : public PersistentBase
+{
+public:
+	friend class PersistentMapTransient<KeyType, ValueType, VersionType>;
+	using PersistentMapTransientPtr = std::shared_ptr<PersistentMapTransient<KeyType, ValueType, VersionType> >;
+	using PersistentMapSnapshotPtr = IntrusivePtr<PersistentMapSnapshot<KeyType, ValueType, VersionType> >;
+	using PersistentMapIterator = typename VersionType::Iterator;
+
+	PersistentMap() :
+		m_lastVersion(0),
+		m_curVersion(0)
+	{
+		m_versions.push(VersionType(), 0);
+	}
+
+	/**
+	* Sets value to key, if key doesn't exist, inserts new key with value
+	* @param key
+	* @param value
+	*/
 	void setValue(const KeyType& key, const ValueType& value)
 	{
-		invalidate();
-		m_versions.push_back(m_versions.back().setValue(key, value));
-		m_lastVersion = ++m_curVersion;
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		invalidate();
+		if (!m_isHistoryEnabled)
+		{
+			m_versions[m_curVersion].setValue(key, value, EXCLUSIVE_EDIT);
+			publish();
+			return;
+		}
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVersion = m_versions[m_curVersion].setValue(key, value);
+		pushVersion(newVersion, allocatedNodeBytes() - numBytes);
+	}
+
+	/**
+	* Finds key in the map
+	* @param key
+	* @param value - found value
+	* @return true, if found
+	*/
+	bool find(const KeyType& key, ValueType& value)
+	{
+		return m_versions[m_curVersion].find(key, value);
+	}
+
+	/**
+	* Finds key in the given version without changing the current one, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param key
+	* @param value - found value
+	* @return true, if found
+	*/
+	bool find(int version, const KeyType& key, ValueType& value) const
+	{
+		return keptVersion(version).find(key, value);
+	}
+
+	/**
+	* Finds many keys in the current version at once: independent lookups advance in lockstep and prefetch
+	* their next nodes, so memory latency of one overlaps with the others. Requires VersionType with findMany,
+	* e.g. TreapVersion
+	* @param aKeys
+	* @param aValues - found values in the order of keys, empty for keys not found
+	*/
+	void findMany(const std::vector<KeyType>& aKeys, std::vector<std::optional<ValueType> >& aValues) const
+	{
+		m_versions[m_curVersion].findMany(aKeys, aValues);
+	}
+
+	/**
+	* Finds many keys in the given version at once, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param aKeys
+	* @param aValues - found values in the order of keys, empty for keys not found
+	*/
+	void findMany(int version, const std::vector<KeyType>& aKeys, std::vector<std::optional<ValueType> >& aValues) const
+	{
+		keptVersion(version).findMany(aKeys, aValues);
+	}
+
+	/**
+	* Gets iterator to the smallest key of the current version, the iterator keeps its version
+	* alive and stays valid while the map changes
+	* @return iterator
+	*/
+	PersistentMapIterator begin() const
+	{
+		return m_versions[m_curVersion].begin();
+	}
+
+	/**
+	* Gets iterator to the smallest key of the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @return iterator
+	*/
+	PersistentMapIterator begin(int version) const
+	{
+		return keptVersion(version).begin();
+	}
+
+	/**
+	* Gets finger of the current version for lookups near each other, e.g. of ascending keys: finger.find(key, value)
+	* resumes from the path of its last lookup and takes O(log d) for d keys between them. The finger keeps its
+	* version alive and stays valid while the map changes. Requires VersionType with Finger, e.g. TreapVersion
+	* @return finger
+	*/
+	auto finger() const
+	{
+		return m_versions[m_curVersion].finger();
+	}
+
+	/**
+	* Gets finger of the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @return finger
+	*/
+	auto finger(int version) const
+	{
+		return keptVersion(version).finger();
+	}
+
+	/**
+	* Gets iterator to the first key not less than key in the current version, takes O(log n)
+	* @param key
+	* @return iterator
+	*/
+	PersistentMapIterator lowerBound(const KeyType& key) const
+	{
+		return m_versions[m_curVersion].lowerBound(key);
+	}
+
+	/**
+	* Gets iterator to the first key not less than key in the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param key
+	* @return iterator
+	*/
+	PersistentMapIterator lowerBound(int version, const KeyType& key) const
+	{
+		return keptVersion(version).lowerBound(key);
+	}
+
+	/**
+	* Gets iterator to the first key greater than key in the current version, takes O(log n)
+	* @param key
+	* @return iterator
+	*/
+	PersistentMapIterator upperBound(const KeyType& key) const
+	{
+		return m_versions[m_curVersion].upperBound(key);
 	}
 
 	/**
-	* Finds key in the map
+	* Gets iterator to the first key greater than key in the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
 	* @param key
-	* @param value - found value
-	* @return true, if found
+	* @return iterator
 	*/
-	bool find(const KeyType& key, ValueType& value)
+	PersistentMapIterator upperBound(int version, const KeyType& key) const
 	{
-		return m_versions[m_curVersion].find(key, value);
+		return keptVersion(version).upperBound(key);
+	}
+
+	/**
+	* Calls callback(key, value) for keys from lo inclusive to hi exclusive of the current version
+	* in ascending order, takes O(log n + k) for k keys in range
+	* @param lo
+	* @param hi
+	* @param callback
+	*/
+	template<typename Callback>
+	void forRange(const KeyType& lo, const KeyType& hi, const Callback& callback) const
+	{
+		m_versions[m_curVersion].forRange(lo, hi, callback);
+	}
+
+	/**
+	* Calls callback(key, value) for keys from lo inclusive to hi exclusive of the given version
+	* in ascending order, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param lo
+	* @param hi
+	* @param callback
+	*/
+	template<typename Callback>
+	void forRange(int version, const KeyType& lo, const KeyType& hi, const Callback& callback) const
+	{
+		keptVersion(version).forRange(lo, hi, callback);
+	}
+
+	/**
+	* Gets number of keys in the current version, requires VersionType with SubtreeSize augmentation
+	* @return number of keys
+	*/
+	int size() const
+	{
+		return m_versions[m_curVersion].size();
+	}
+
+	/**
+	* Gets number of keys in the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @return number of keys
+	*/
+	int size(int version) const
+	{
+		return keptVersion(version).size();
+	}
+
+	/**
+	* Gets iterator to the key with given index in ascending order in the current version, takes O(log n),
+	* throws exception if index is out of range. Requires VersionType with SubtreeSize augmentation
+	* @param index - from 0 to size() - 1
+	* @return iterator
+	*/
+	PersistentMapIterator kth(int index) const
+	{
+		return m_versions[m_curVersion].kth(index);
+	}
+
+	/**
+	* Gets iterator to the key with given index in ascending order in the given version,
+	* throws exception if version isn't kept or index is out of range
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param index - from 0 to size(version) - 1
+	* @return iterator
+	*/
+	PersistentMapIterator kth(int version, int index) const
+	{
+		return keptVersion(version).kth(index);
+	}
+
+	/**
+	* Counts keys less than key in the current version, takes O(log n).
+	* Requires VersionType with SubtreeSize augmentation
+	* @param key
+	* @return number of keys
+	*/
+	int rank(const KeyType& key) const
+	{
+		return m_versions[m_curVersion].rank(key);
+	}
+
+	/**
+	* Counts keys less than key in the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param key
+	* @return number of keys
+	*/
+	int rank(int version, const KeyType& key) const
+	{
+		return keptVersion(version).rank(key);
+	}
+
+	/**
+	* Counts keys from lo inclusive to hi exclusive in the current version, takes O(log n).
+	* Requires VersionType with SubtreeSize augmentation
+	* @param lo
+	* @param hi
+	* @return number of keys
+	*/
+	int countRange(const KeyType& lo, const KeyType& hi) const
+	{
+		return m_versions[m_curVersion].countRange(lo, hi);
+	}
+
+	/**
+	* Counts keys from lo inclusive to hi exclusive in the given version, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param lo
+	* @param hi
+	* @return number of keys
+	*/
+	int countRange(int version, const KeyType& lo, const KeyType& hi) const
+	{
+		return keptVersion(version).countRange(lo, hi);
+	}
+
+	/**
+	* Combines values of keys from lo inclusive to hi exclusive of the current version in ascending order,
+	* takes O(log n). Requires VersionType with MonoidAggregate augmentation
+	* @param lo
+	* @param hi
+	* @return combined values, identity of the monoid for an empty range
+	*/
+	auto aggregate(const KeyType& lo, const KeyType& hi) const
+	{
+		return m_versions[m_curVersion].aggregate(lo, hi);
+	}
+
+	/**
+	* Combines values of keys from lo inclusive to hi exclusive of the given version in ascending order,
+	* throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @param lo
+	* @param hi
+	* @return combined values, identity of the monoid for an empty range
+	*/
+	auto aggregate(int version, const KeyType& lo, const KeyType& hi) const
+	{
+		return keptVersion(version).aggregate(lo, hi);
 	}
 
 	/**
@@ -340,9 +3502,21 @@ public:
 	*/
 	void insert(const KeyType& key, const ValueType& value)
 	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
 		invalidate();
-		m_versions.push_back(m_versions.back().insert(key, value));
-		m_lastVersion = ++m_curVersion;
+		if (!m_isHistoryEnabled)
+		{
+			m_versions[m_curVersion].setValue(key, value, EXCLUSIVE_EDIT);
+			publish();
+			return;
+		}
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVersion = m_versions[m_curVersion].insert(key, value);
+		pushVersion(newVersion, allocatedNodeBytes() - numBytes);
 	}
 
 	/**
@@ -352,32 +3526,226 @@ public:
 	*/
 	bool erase(const KeyType& key)
 	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
 		invalidate();
+		if (!m_isHistoryEnabled)
+		{
+			bool isErased = m_versions[m_curVersion].erase(key, EXCLUSIVE_EDIT);
+			publish();
+			return isErased;
+		}
+
 		bool isSuccess = false;
-		auto pNewRoot = m_versions.back().erase(key, isSuccess);
+		std::size_t numBytes = allocatedNodeBytes();
+		auto pNewRoot = m_versions[m_curVersion].erase(key, isSuccess);
 		if (!isSuccess)
 			return false;
 
-		m_versions.push_back(pNewRoot);
-		m_lastVersion = ++m_curVersion;
+		pushVersion(pNewRoot, allocatedNodeBytes() - numBytes);
 		return true;
 	}
 
 	/**
-	* Undo last numIter operations of 'set', 'insert', 'erase' types
+	* Builds map from pairs sorted by strictly ascending keys in O(n), the pairs become version 0.
+	* Throws exception if keys aren't strictly ascending
+	* @param begin - iterator to the first pair, e.g. of std::vector<std::pair<KeyType, ValueType> >
+	* @param end
+	* @return map
+	*/
+	template<typename Iterator>
+	static PersistentMap fromSorted(Iterator begin, Iterator end)
+	{
+		PersistentMap map;
+		map.m_versions[0] = VersionType::fromSorted(begin, end);
+		return map;
+	}
+
+	/**
+	* Inserts pairs sorted by strictly ascending keys as a single new version, existing keys get new values.
+	* Takes O(k log(n/k + 1)) for k pairs, throws exception if keys aren't strictly ascending
+	* @param begin - iterator to the first pair, e.g. of std::vector<std::pair<KeyType, ValueType> >
+	* @param end
+	*/
+	template<typename Iterator>
+	void insertSorted(Iterator begin, Iterator end)
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVersion = m_versions[m_curVersion].insertSorted(begin, end);
+		applyVersion(newVersion, allocatedNodeBytes() - numBytes);
+	}
+
+	/**
+	* Adds elements of a version of other map as a single new version, for keys present in both maps
+	* values of this map are kept. Takes O(m log(n/m + 1)) for sizes m <= n, large maps are joined
+	* on several threads. Throws exception if version isn't kept
+	* @param other - map, may be this map
+	* @param otherVersion - number of version of other map
+	*/
+	void unite(const PersistentMap& other, int otherVersion)
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVersion = m_versions[m_curVersion].unite(other.keptVersion(otherVersion));
+		applyVersion(newVersion, allocatedNodeBytes() - numBytes);
+	}
+
+	void unite(const PersistentMap& other)
+	{
+		unite(other, other.m_curVersion);
+	}
+
+	/**
+	* Keeps only keys present in a version of other map as a single new version, values of this map are kept.
+	* Takes O(m log(n/m + 1)), throws exception if version isn't kept
+	* @param other - map, may be this map
+	* @param otherVersion - number of version of other map
+	*/
+	void intersect(const PersistentMap& other, int otherVersion)
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVersion = m_versions[m_curVersion].intersect(other.keptVersion(otherVersion));
+		applyVersion(newVersion, allocatedNodeBytes() - numBytes);
+	}
+
+	void intersect(const PersistentMap& other)
+	{
+		intersect(other, other.m_curVersion);
+	}
+
+	/**
+	* Erases keys present in a version of other map as a single new version.
+	* Takes O(m log(n/m + 1)), throws exception if version isn't kept
+	* @param other - map, may be this map
+	* @param otherVersion - number of version of other map
+	*/
+	void subtract(const PersistentMap& other, int otherVersion)
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		std::size_t numBytes = allocatedNodeBytes();
+		VersionType newVersion = m_versions[m_curVersion].subtract(other.keptVersion(otherVersion));
+		applyVersion(newVersion, allocatedNodeBytes() - numBytes);
+	}
+
+	void subtract(const PersistentMap& other)
+	{
+		subtract(other, other.m_curVersion);
+	}
+
+	/**
+	* Gets digest of the given version, equal for versions with equal keys and values in this and other processes.
+	* Requires VersionType with MerkleDigest augmentation, throws exception if version isn't kept
+	* @param version - number of version, from 0 to lastVersion() - 1
+	* @return digest
+	*/
+	std::uint64_t digest(int version) const
+	{
+		return keptVersion(version).digest();
+	}
+
+	/**
+	* Checks in O(1) if two versions have equal keys and values, up to digest collisions.
+	* Requires VersionType with MerkleDigest augmentation, throws exception if a version isn't kept
+	* @param firstVersion - number of version, from 0 to lastVersion() - 1
+	* @param secondVersion - number of version, from 0 to lastVersion() - 1
+	* @return true, if the versions are equal
+	*/
+	bool equals(int firstVersion, int secondVersion) const
+	{
+		return keptVersion(firstVersion).equals(keptVersion(secondVersion));
+	}
+
+	/**
+	* Calls callback(key, pFirstValue, pSecondValue) for keys whose values differ between two versions, in ascending
+	* order unless VersionType is unordered. pFirstValue is nullptr for keys inserted since firstVersion and
+	* pSecondValue for erased ones. Subtrees shared by the versions are skipped, and with MerkleDigest augmentation
+	* so are subtrees with equal digests, so it takes about O(k log n) for k changes. Throws exception if a version isn't kept
+	* @param firstVersion - number of version, from 0 to lastVersion() - 1
+	* @param secondVersion - number of version, from 0 to lastVersion() - 1
+	* @param callback
+	*/
+	template<typename Callback>
+	void diff(int firstVersion, int secondVersion, const Callback& callback) const
+	{
+		keptVersion(firstVersion).diff(keptVersion(secondVersion), callback);
+	}
+
+	/**
+	* Replaces nodes of the current version with equal nodes of table, which are shared by all versions and maps
+	* interned into it. Takes O(k) for k nodes not interned yet, the version number and contents don't change.
+	* Requires VersionType with NodeTable, e.g. TreapVersion, and std::hash and operator== of keys and values
+	* @param table - e.g. of type VersionType::NodeTable, a map should be interned into one table only
+	*/
+	template<typename Table>
+	void intern(Table& table)
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		m_versions[m_curVersion] = m_versions[m_curVersion].intern(table);
+	}
+
+	/**
+	* Checks in O(1) if the current versions of both maps are the same nodes. Versions interned
+	* into one table are the same nodes exactly when they have equal keys and values
+	* @param other - map, may be this map
+	* @return true, if the versions are the same nodes
+	*/
+	bool isIdentical(const PersistentMap& other) const
+	{
+		return m_versions[m_curVersion].isIdentical(other.m_versions[other.m_curVersion]);
+	}
+
+	/**
+	* Starts transient editing of the current version, changes made through the transient
+	* are invisible to the map until commit, which adds them as a single new version.
+	* Until the transient is committed or destroyed the map can be read but not changed
+	* @return transient editor, destroying it without commit discards its changes
+	*/
+	PersistentMapTransientPtr beginTransient()
+	{
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		m_isReadOnly = true;
+		return PersistentMapTransientPtr(new PersistentMapTransient<KeyType, ValueType, VersionType>(*this, m_versions[m_curVersion]));
+	}
+
+	/**
+	* Undo last numIter operations of 'set', 'insert', 'erase' types, stops at the nearest older
+	* version kept by the history limit
 	* @param numIter
 	*/
 	void undo(int numIter = 1, bool clearHistory = false) override
 	{
-		m_curVersion = std::max(0, m_curVersion - numIter);
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		m_curVersion = m_versions.nearest(std::max(0, m_curVersion - numIter));
 		if (clearHistory)
 		{
-			while (m_lastVersion > m_curVersion)
-			{
-				m_versions.pop_back();
-				m_lastVersion--;
-			}
+			invalidate();
 		}
+		publish();
 	}
 
 	/**
@@ -386,7 +3754,16 @@ public:
 	*/
 	void redo(int numIter = 1)
 	{
-		m_curVersion = std::min(m_lastVersion, m_curVersion + numIter);
+		assert(!m_isReadOnly);
+		if (m_isReadOnly)
+			throw std::exception();
+
+		int version = std::min(m_lastVersion, m_curVersion + numIter);
+		if (version > m_curVersion)
+		{
+			m_curVersion = std::max(m_versions.nearest(version), m_versions.next(m_curVersion));
+			publish();
+		}
 	}
 
 	/**
@@ -406,17 +3783,206 @@ public:
 		return m_lastVersion + 1;
 	}
 
+	/**
+	* Turns history on or off, while it is off 'set', 'insert', 'erase' change the current version
+	* instead of creating new ones, nodes not shared with older versions are changed in place
+	* @param isEnabled
+	*/
+	void setHistoryEnabled(bool isEnabled)
+	{
+		m_isHistoryEnabled = isEnabled;
+	}
+
+	/**
+	* Sets retention policy of history, the oldest versions over the limit are released
+	* immediately and after each new version, version numbers stay the same
+	* @param limit
+	*/
+	void setHistoryLimit(const HistoryLimit& limit)
+	{
+		m_versions.setLimit(limit);
+		m_versions.prune(m_curVersion);
+	}
+
+	/**
+	* Turns publishing of snapshots on or off, while it is on the current version is published after
+	* each change, so a single writer thread can change the map while other threads read snapshots.
+	* Snapshots hold nodes of their version, so changes with history off copy them instead of changing in place.
+	* Requires VersionType with atomic reference counts and nodes which can be freed by any thread.
+	* @param isEnabled
+	*/
+	void setSnapshotsEnabled(bool isEnabled)
+	{
+		m_isSnapshotEnabled = isEnabled;
+		m_snapshots.publish(isEnabled ? makeIntrusive<PersistentMapSnapshot<KeyType, ValueType, VersionType> >(m_curVersion, m_versions[m_curVersion]) : nullptr);
+	}
+
+	/**
+	* Gets the last published snapshot, wait-free and safe to call from any thread while the map changes
+	* @return snapshot, nullptr if snapshots are off
+	*/
+	PersistentMapSnapshotPtr snapshot() const
+	{
+		return m_snapshots.acquire();
+	}
+
 private:
+	const VersionType& keptVersion(int version) const
+	{
+		if (version < 0 || version > m_lastVersion || !m_versions.contains(version))
+		{
+			assert(version >= 0 && version <= m_lastVersion && m_versions.contains(version));
+			throw std::exception();
+		}
 
-	void invalidate()
+		return m_versions[version];
+	}
+
+	/*
+	* Makes version the current one: adds it to history or, while history is off, replaces the current version
+	*/
+	void applyVersion(const VersionType& version, std::size_t numBytes)
+	{
+		if (!m_isHistoryEnabled)
+		{
+			invalidate();
+			m_versions[m_curVersion] = version;
+			publish();
+			return;
+		}
+
+		pushVersion(version, numBytes);
+	}
+
+	void publish()
 	{
-		while (m_lastVersion > m_curVersion)
+		if (m_isSnapshotEnabled)
 		{
-			m_versions.pop_back();
-			m_lastVersion--;
+			m_snapshots.publish(makeIntrusive<PersistentMapSnapshot<KeyType, ValueType, VersionType> >(m_curVersion, m_versions[m_curVersion]));
 		}
 	}
 
-	std::vector<TreapVersion<KeyType, ValueType> >m_versions;
+	void invalidate()
+	{
+		m_versions.truncate(m_curVersion);
+		m_lastVersion = m_curVersion;
+	}
+
+	void pushVersion(const VersionType& version, std::size_t numBytes)
+	{
+		invalidate();
+		m_versions.push(version, numBytes);
+		m_lastVersion = ++m_curVersion;
+		m_versions.prune(m_curVersion);
+		publish();
+	}
+
+	VersionHistory<VersionType> m_versions;
 	int m_lastVersion, m_curVersion;
-};
\ No newline at end of file
+	bool m_isHistoryEnabled = true;
+	bool m_isSnapshotEnabled = false;
+	bool m_isReadOnly = false;
+	SnapshotPublisher<PersistentMapSnapshot<KeyType, ValueType, VersionType> > m_snapshots;
+};
+
+template<typename KeyType, typename ValueType, typename VersionType>
+class PersistentMapTransient
+{
+public:
+	/**
+	* Sets value to key, if key doesn't exist, inserts new key with value,
+	* nodes already copied by this transient are changed in place
+	* @param key
+	* @param value
+	*/
+	void setValue(const KeyType& key, const ValueType& value)
+	{
+		assert(m_edit != 0);
+		if (m_edit == 0)
+			throw std::exception();
+
+		m_version.setValue(key, value, m_edit);
+	}
+
+	/**
+	* Inserts key and value into map, if key exists, sets new value to key
+	* @param key
+	* @param value
+	*/
+	void insert(const KeyType& key, const ValueType& value)
+	{
+		setValue(key, value);
+	}
+
+	/**
+	* Erases element with given key
+	* @param key
+	* @return true, if element is successfully deleted
+	*/
+	bool erase(const KeyType& key)
+	{
+		assert(m_edit != 0);
+		if (m_edit == 0)
+			throw std::exception();
+
+		return m_version.erase(key, m_edit);
+	}
+
+	/**
+	* Finds key in the edited version
+	* @param key
+	* @param value - found value
+	* @return true, if found
+	*/
+	bool find(const KeyType& key, ValueType& value)
+	{
+		return m_version.find(key, value);
+	}
+
+	/**
+	* Adds all changes to the map as a single new version, or replaces the current version if history is off,
+	* and unlocks the map, the transient can't be used afterwards
+	*/
+	void commit()
+	{
+		assert(m_edit != 0);
+		if (m_edit == 0)
+			throw std::exception();
+
+		m_edit = 0;
+		m_map.m_isReadOnly = false;
+		m_map.applyVersion(m_version, allocatedNodeBytes() - m_numBytes);
+	}
+
+	/*
+	* Discards changes which weren't committed and unlocks the map
+	*/
+	~PersistentMapTransient()
+	{
+		if (m_edit != 0)
+			m_map.m_isReadOnly = false;
+	}
+
+private:
+	friend class PersistentMap<KeyType, ValueType, VersionType>;
+
+	PersistentMapTransient(PersistentMap<KeyType, ValueType, VersionType>& map, const VersionType& version) :
+		m_map(map),
+		m_version(version),
+		m_edit(newEditToken()),
+		m_numBytes(allocatedNodeBytes())
+	{}
+
+	PersistentMap<KeyType, ValueType, VersionType>& m_map;
+	VersionType m_version;
+	EditToken m_edit;
+	std::size_t m_numBytes;
+};
+
+/*
+* Unordered persistent map stored as a hash array mapped trie, keys need Hash and operator== only.
+* Supports the operations of PersistentMap which don't depend on key order: find, setValue, insert, erase,
+* size, begin, set operations, transients, snapshots and history
+*/
+template<typename KeyType, typename ValueType, typename Hash = std::hash<KeyType> >
+using PersistentHashMap = PersistentMap<KeyType, ValueType, HashTrieVersion<KeyType, ValueType, Hash> >;
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include "intrusive_ptr.h"
+
+/*
+* Publishes immutable snapshots of a container from a single writer to any number of reader threads.
+* Readers take the current snapshot wait-free: they mark themselves in one of two reader counters,
+* load the pointer, take a reference and leave. The writer swaps the pointer and, like Left-Right,
+* waits for both counters to drain in turn before releasing the replaced snapshot, so no reader
+* can be between loading it and referencing it.
+* SnapshotType derives from RefCounted<AtomicRefCount>, the last reference may be dropped by any thread.
+*/
+template<typename SnapshotType>
+class SnapshotPublisher
+{
+public:
+	using SnapshotPtr = IntrusivePtr<SnapshotType>;
+
+	SnapshotPublisher() :
+		m_pCurrent(nullptr),
+		m_readIndex(0)
+	{
+		m_aNumReaders[0] = m_aNumReaders[1] = 0;
+	}
+
+	// copies of a container start with nothing published, the snapshot belongs to the original writer
+	SnapshotPublisher(const SnapshotPublisher&) :
+		SnapshotPublisher()
+	{}
+
+	SnapshotPublisher& operator=(const SnapshotPublisher&)
+	{
+		return *this;
+	}
+
+	/*
+	* Gets the last published snapshot, nullptr if nothing is published, called by readers
+	*/
+	SnapshotPtr acquire() const
+	{
+		int index = m_readIndex.load();
+		m_aNumReaders[index].fetch_add(1);
+		SnapshotPtr pSnapshot(m_pCurrent.load());
+		m_aNumReaders[index].fetch_sub(1);
+		return pSnapshot;
+	}
+
+	/*
+	* Replaces the published snapshot, called by the writer only
+	*/
+	void publish(SnapshotPtr pSnapshot)
+	{
+		m_pCurrent.store(pSnapshot.get());
+
+		int index = m_readIndex.load();
+		waitReaders(1 - index);
+		m_readIndex.store(1 - index);
+		waitReaders(index);
+
+		m_pOwned = std::move(pSnapshot);
+	}
+
+private:
+	void waitReaders(int index) const
+	{
+		while (m_aNumReaders[index].load() != 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	std::atomic<SnapshotType*> m_pCurrent;
+	std::atomic<int> m_readIndex;
+	mutable std::atomic<int> m_aNumReaders[2];
+	SnapshotPtr m_pOwned;
+};
@@ -0,0 +1,145 @@
+#include "check.h"
+#include "../persistent_map.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef PersistentMap<int, int, TreapVersion<int, int, AtomicRefCount, SlabAllocator> > SlabMap;
+
+int count(const SlabMap& map)
+{
+	int numKeys = 0;
+	for (auto it = map.begin(); !it.done(); it.next())
+	{
+		numKeys++;
+	}
+	return numKeys;
+}
+
+/*
+* A node freed by another thread goes back to the pool of its thread, which reuses it on the next allocation
+*/
+void testRemoteFree()
+{
+	const std::size_t size = 200;
+	void* p = SlabAllocator::allocate(size);
+	std::thread([p]() { SlabAllocator::deallocate(p, size); }).join();
+	void* pReused = SlabAllocator::allocate(size);
+	CHECK(pReused == p);
+	SlabAllocator::deallocate(pReused, size);
+}
+
+/*
+* Nodes of a thread which has exited are freed by other threads, the last one releases its pool
+*/
+void testExitedThread()
+{
+	std::vector<void*> apBlocks;
+	std::thread([&apBlocks]()
+	{
+		for (int i = 0; i < 10000; i++)
+		{
+			apBlocks.push_back(SlabAllocator::allocate(48));
+		}
+	}).join();
+
+	std::vector<std::thread> aThreads;
+	for (int i = 0; i < 4; i++)
+	{
+		aThreads.emplace_back([&apBlocks, i]()
+		{
+			for (std::size_t j = i; j < apBlocks.size(); j += 4)
+			{
+				SlabAllocator::deallocate(apBlocks[j], 48);
+			}
+		});
+	}
+	for (auto& thread : aThreads)
+	{
+		thread.join();
+	}
+}
+
+/*
+* Readers drop the last references to snapshots, so nodes allocated by the writer are freed by them
+*/
+void testSnapshotReaders()
+{
+	const int numKeys = 1000;
+	SlabMap map;
+	map.setHistoryEnabled(false);
+	map.setSnapshotsEnabled(true);
+
+	std::atomic<bool> isDone(false);
+	std::atomic<int> numErrors(0);
+	std::vector<std::thread> aReaders;
+	for (int i = 0; i < 4; i++)
+	{
+		aReaders.emplace_back([&]()
+		{
+			for (int key = 0; !isDone.load(); key = (key + 7) % numKeys)
+			{
+				auto pSnapshot = map.snapshot();
+				int value = 0;
+				if (pSnapshot->find(key, value) && value % numKeys != key)
+					numErrors++;
+			}
+		});
+	}
+
+	for (int i = 0; i < 100 * numKeys; i++)
+	{
+		map.setValue(i % numKeys, i);
+	}
+	isDone.store(true);
+	for (auto& reader : aReaders)
+	{
+		reader.join();
+	}
+
+	CHECK(numErrors.load() == 0);
+	CHECK(count(map) == numKeys);
+	map.setSnapshotsEnabled(false);
+}
+
+/*
+* Set operations on large maps build subtrees on worker threads, their nodes outlive the workers
+*/
+void testParallelSetOperations()
+{
+	const int numKeys = 200000;
+	SlabMap evens, odds;
+	{
+		std::vector<std::pair<int, int> > aEvens, aOdds;
+		for (int key = 0; key < numKeys; key++)
+		{
+			(key % 2 == 0 ? aEvens : aOdds).emplace_back(key, key);
+		}
+		evens.insertSorted(aEvens.begin(), aEvens.end());
+		odds.insertSorted(aOdds.begin(), aOdds.end());
+	}
+
+	SlabMap map = evens;
+	map.unite(odds);
+	CHECK(count(map) == numKeys);
+	map.subtract(evens);
+	CHECK(count(map) == numKeys / 2);
+
+	int key = 1;
+	bool isEqual = true;
+	for (auto it = map.begin(); !it.done(); it.next(), key += 2)
+	{
+		isEqual = isEqual && it.key() == key && it.value() == key;
+	}
+	CHECK(isEqual && key == numKeys + 1);
+}
+
+int main()
+{
+	testRemoteFree();
+	testExitedThread();
+	testSnapshotReaders();
+	ThreadPool::instance().setNumWorkers(3);
+	testParallelSetOperations();
+	return testResult("allocator_test");
+}
@@ -0,0 +1,161 @@
+#include "check.h"
+#include "../persistent_array.h"
+#include <random>
+#include <vector>
+
+template<typename Array>
+std::vector<int> read(Array& array, int version, int size)
+{
+	std::vector<int> aValues;
+	for (int index = 0; index < size; index++)
+	{
+		aValues.push_back(array.getValue(version, index));
+	}
+	return aValues;
+}
+
+/*
+* Changes of a transient become one version on commit and none if it is dropped,
+* with history off commit replaces the current version
+*/
+template<typename Array>
+void testTransient()
+{
+	const int size = 100;
+	Array array(size, 0);
+	{
+		auto pTransient = array.beginTransient();
+		pTransient->setValue(1, 5);
+		pTransient->setValue(2, 6);
+		CHECK(array.getValue(1) == 0);
+		pTransient->commit();
+	}
+	CHECK(array.lastVersion() == 2);
+	CHECK(array.getValue(1) == 5 && array.getValue(2) == 6);
+
+	{
+		auto pTransient = array.beginTransient();
+		pTransient->setValue(1, 7);
+	}
+	CHECK(array.lastVersion() == 2 && array.getValue(1) == 5);
+	array.setValue(3, 8);
+	CHECK(array.lastVersion() == 3);
+
+	array.setHistoryEnabled(false);
+	{
+		auto pTransient = array.beginTransient();
+		pTransient->setValue(4, 9);
+		pTransient->commit();
+	}
+	CHECK(array.lastVersion() == 3);
+	CHECK(array.getValue(4) == 9 && array.getValue(3) == 8);
+	CHECK(read(array, 1, size)[4] == 0);
+
+#ifdef NDEBUG
+	// while a transient is open the array can't be changed, checked only where asserts don't stop the program
+	auto pTransient = array.beginTransient();
+	bool isThrown = false;
+	try
+	{
+		array.setValue(1, 10);
+	}
+	catch (const std::exception&)
+	{
+		isThrown = true;
+	}
+	CHECK(isThrown);
+	pTransient->commit();
+	CHECK(array.getValue(1) == 5);
+#endif
+}
+
+/*
+* Versions with equal elements are equal however they were made, without digests too
+*/
+template<typename Array>
+void testEquals()
+{
+	const int size = 1000;
+	Array array(size, 0);
+	std::vector<std::vector<int> > aVersions(1, read(array, 0, size));
+	std::mt19937 random(4);
+	for (int i = 0; i < 500; i++)
+	{
+		array.setValue(random() % 4, random() % 2);
+		aVersions.push_back(read(array, array.lastVersion() - 1, size));
+	}
+
+	for (int i = 0; i < 1000; i++)
+	{
+		int first = random() % array.lastVersion();
+		int second = random() % array.lastVersion();
+		CHECK(array.equals(first, second) == (aVersions[first] == aVersions[second]));
+	}
+
+	int version = array.lastVersion() - 1;
+	int value = array.getValue(0);
+	array.setValue(0, value + 1);
+	CHECK(!array.equals(version, array.lastVersion() - 1));
+	array.setValue(0, value);
+	CHECK(array.equals(version, array.lastVersion() - 1));
+}
+
+/*
+* getMany matches getValue for no indexes, fewer indexes than lanes and more, with repeated indexes,
+* in the current and older versions, also while history is off
+*/
+template<typename Array>
+void testGetMany(bool isHistoryEnabled)
+{
+	std::mt19937 random(6);
+	for (int size : { 1, 10, 1000 })
+	{
+		Array array(size, -1);
+		array.setHistoryEnabled(isHistoryEnabled);
+		for (int i = 0; i < 3 * size; i++)
+		{
+			array.setValue(random() % size, i);
+		}
+
+		for (int version = 0; version < array.lastVersion(); version += isHistoryEnabled ? 1 + size / 10 : 1)
+		{
+			std::vector<int> aExpected = read(array, version, size);
+			for (int numIndexes : { 0, 1, 5, 15, 16, 17, 100, 2000 })
+			{
+				std::vector<int> aIndexes;
+				for (int i = 0; i < numIndexes; i++)
+				{
+					aIndexes.push_back(random() % size);
+				}
+
+				// values left from an earlier call are replaced
+				std::vector<int> aValues(3, 7);
+				array.getMany(version, aIndexes, aValues);
+				CHECK(aValues.size() == aIndexes.size());
+				for (int i = 0; i < (int)aIndexes.size() && i < (int)aValues.size(); i++)
+				{
+					CHECK(aValues[i] == aExpected[aIndexes[i]]);
+				}
+			}
+		}
+	}
+}
+
+template<typename Array>
+void testGetMany()
+{
+	testGetMany<Array>(true);
+	testGetMany<Array>(false);
+}
+
+int main()
+{
+	testTransient<PersistentArray<int> >();
+	testTransient<PersistentArray<int, PersistentArrayVersion<int> > >();
+	testEquals<PersistentArray<int> >();
+	testEquals<PersistentArray<int, PersistentArrayVersion<int> > >();
+	testEquals<PersistentArray<int, PersistentArrayVersion<int, AtomicRefCount, HeapAllocator, MerkleDigest> > >();
+	testGetMany<PersistentArray<int> >();
+	testGetMany<PersistentArray<int, PersistentArrayVersion<int> > >();
+	return testResult("array_test");
+}
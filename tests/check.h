@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdio>
+
+/*
+* Minimal checks for the test programs: a failed check is reported and counted,
+* the program exits with non-zero status if any check failed
+*/
+static int g_numFailures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			g_numFailures++; \
+		} \
+	} while (false)
+
+inline int testResult(const char* name)
+{
+	std::printf("%s: %s\n", name, g_numFailures == 0 ? "passed" : "FAILED");
+	return g_numFailures == 0 ? 0 : 1;
+}
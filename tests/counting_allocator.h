@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+/*
+* Heap allocator policy which counts live nodes and their bytes
+*/
+struct CountingAllocator
+{
+	static long& numNodes()
+	{
+		static long s_numNodes = 0;
+		return s_numNodes;
+	}
+
+	static long& numBytes()
+	{
+		static long s_numBytes = 0;
+		return s_numBytes;
+	}
+
+	static void* allocate(std::size_t size)
+	{
+		numNodes()++;
+		numBytes() += (long)size;
+		return ::operator new(size);
+	}
+
+	static void deallocate(void* p, std::size_t size)
+	{
+		numNodes()--;
+		numBytes() -= (long)size;
+		::operator delete(p);
+	}
+};
@@ -0,0 +1,274 @@
+#include "check.h"
+#include "../persistent_array.h"
+#include "../persistent_map.h"
+#include <algorithm>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+const int NUM_CHANGES = 3000;
+const int NUM_PAIRS = 400;
+const int ARRAY_SIZE = 5000;
+
+typedef std::tuple<int, int, int> Difference;
+
+/*
+* Keys with hash collisions in the lowest bits, to make hash trie nodes deep
+*/
+struct CollidingHash
+{
+	std::size_t operator()(int key) const
+	{
+		return (key % 5) * 0x10001ull;
+	}
+};
+
+template<typename Map>
+std::map<int, int> read(const Map& map, int version)
+{
+	std::map<int, int> contents;
+	for (auto it = map.begin(version); !it.done(); it.next())
+	{
+		contents[it.key()] = it.value();
+	}
+	return contents;
+}
+
+/*
+* Differences of two versions found by comparing all their elements, -1 stands for a missing key
+*/
+std::vector<Difference> compare(const std::map<int, int>& first, const std::map<int, int>& second)
+{
+	std::map<int, std::pair<int, int> > values;
+	for (const auto& element : first)
+	{
+		values[element.first] = std::make_pair(element.second, -1);
+	}
+	for (const auto& element : second)
+	{
+		auto it = values.find(element.first);
+		if (it == values.end())
+			values[element.first] = std::make_pair(-1, element.second);
+		else
+			it->second.second = element.second;
+	}
+
+	std::vector<Difference> aDifferences;
+	for (const auto& value : values)
+	{
+		if (value.second.first != value.second.second)
+			aDifferences.emplace_back(value.first, value.second.first, value.second.second);
+	}
+	return aDifferences;
+}
+
+/*
+* Changes the map by random setValue, erase and transient edits of keys below numKeys
+*/
+template<typename Map>
+void change(Map& map, int numKeys, int numValues, std::mt19937& random)
+{
+	for (int i = 0; i < NUM_CHANGES; i++)
+	{
+		int key = random() % numKeys;
+		int operation = random() % 10;
+		if (operation < 6 || i < NUM_CHANGES / 3)
+		{
+			map.setValue(key, random() % numValues);
+		}
+		else if (operation < 9)
+		{
+			map.erase(key);
+		}
+		else
+		{
+			auto pTransient = map.beginTransient();
+			for (int j = 0; j < 200; j++)
+			{
+				int transientKey = random() % numKeys;
+				if (random() % 2 == 0)
+					pTransient->setValue(transientKey, random() % numValues);
+				else
+					pTransient->erase(transientKey);
+			}
+			pTransient->commit();
+		}
+	}
+}
+
+/*
+* Diff of random versions, mostly close ones, reports the same differences as comparing all elements.
+* Treaps must have the same shape for equal keys, so it checks that priorities depend on keys only
+*/
+template<typename Map>
+void testMapDiff(int numKeys, bool isOrdered)
+{
+	Map map;
+	std::mt19937 random(11);
+	change(map, numKeys, 5, random);
+
+	int numVersions = map.lastVersion();
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		int first = random() % numVersions;
+		int second = i % 3 == 0 ? std::min(numVersions - 1, first + 1 + (int)(random() % 3)) : random() % numVersions;
+
+		std::vector<Difference> aDifferences;
+		map.diff(first, second, [&](const int& key, const int* pFirstValue, const int* pSecondValue)
+		{
+			aDifferences.emplace_back(key, pFirstValue ? *pFirstValue : -1, pSecondValue ? *pSecondValue : -1);
+		});
+		if (!isOrdered)
+			std::sort(aDifferences.begin(), aDifferences.end());
+		CHECK(aDifferences == compare(read(map, first), read(map, second)));
+	}
+}
+
+/*
+* Versions with equal contents have equal digests however they were built, few keys and values make them frequent
+*/
+template<typename Map>
+void testMapEquals()
+{
+	Map map;
+	std::mt19937 random(5);
+	change(map, 8, 2, random);
+
+	int numVersions = map.lastVersion();
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		int first = random() % numVersions;
+		int second = random() % numVersions;
+		bool isEqual = read(map, first) == read(map, second);
+		CHECK(map.equals(first, second) == isEqual);
+		CHECK((map.digest(first) == map.digest(second)) == isEqual);
+	}
+
+	map.setValue(100, 1);
+	int version = map.lastVersion() - 1;
+	map.erase(100);
+	map.setValue(100, 1);
+	CHECK(map.equals(version, map.lastVersion() - 1));
+}
+
+/*
+* Changes the array by random setValue, setValues and transient edits, keeping a copy of each version
+*/
+template<typename Array>
+std::vector<std::vector<int> > change(Array& array, int numValues, std::mt19937& random)
+{
+	std::vector<int> aValues(ARRAY_SIZE, 0);
+	std::vector<std::vector<int> > aVersions(1, aValues);
+	for (int i = 0; i < NUM_CHANGES; i++)
+	{
+		int operation = random() % 3;
+		if (operation == 0)
+		{
+			int index = random() % ARRAY_SIZE;
+			int value = random() % numValues;
+			array.setValue(index, value);
+			aValues[index] = value;
+		}
+		else if (operation == 1)
+		{
+			std::vector<std::pair<int, int> > aChanges;
+			for (int j = 0; j < 50; j++)
+			{
+				aChanges.emplace_back(random() % ARRAY_SIZE, random() % numValues);
+			}
+			array.setValues(aChanges);
+			for (const auto& change : aChanges)
+			{
+				aValues[change.first] = change.second;
+			}
+		}
+		else
+		{
+			auto pTransient = array.beginTransient();
+			for (int j = 0; j < 30; j++)
+			{
+				int index = random() % ARRAY_SIZE;
+				int value = random() % numValues;
+				pTransient->setValue(index, value);
+				aValues[index] = value;
+			}
+			pTransient->commit();
+		}
+		aVersions.push_back(aValues);
+	}
+	return aVersions;
+}
+
+template<typename Array>
+void testArrayDiff()
+{
+	Array array(ARRAY_SIZE, 0);
+	std::mt19937 random(2);
+	std::vector<std::vector<int> > aVersions = change(array, 3, random);
+	CHECK(array.lastVersion() == (int)aVersions.size());
+
+	int numVersions = array.lastVersion();
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		int first = random() % numVersions;
+		int second = random() % numVersions;
+
+		std::vector<Difference> aExpected, aDifferences;
+		for (int index = 0; index < ARRAY_SIZE; index++)
+		{
+			if (aVersions[first][index] != aVersions[second][index])
+				aExpected.emplace_back(index, aVersions[first][index], aVersions[second][index]);
+		}
+		array.diff(first, second, [&](int index, const int& firstValue, const int& secondValue)
+		{
+			aDifferences.emplace_back(index, firstValue, secondValue);
+		});
+		CHECK(aDifferences == aExpected);
+	}
+}
+
+/*
+* Array versions with equal elements have equal digests, e.g. after a value is changed and restored
+*/
+template<typename Array>
+void testArrayEquals()
+{
+	Array array(ARRAY_SIZE, 0);
+	std::mt19937 random(3);
+	std::vector<std::vector<int> > aVersions = change(array, 2, random);
+
+	int numVersions = array.lastVersion();
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		int first = random() % numVersions;
+		int second = random() % numVersions;
+		bool isEqual = aVersions[first] == aVersions[second];
+		CHECK(array.equals(first, second) == isEqual);
+		CHECK((array.digest(first) == array.digest(second)) == isEqual);
+	}
+
+	int version = array.lastVersion() - 1;
+	int value = aVersions.back()[0];
+	array.setValue(0, value + 1);
+	CHECK(!array.equals(version, array.lastVersion() - 1));
+	array.setValue(0, value);
+	CHECK(array.equals(version, array.lastVersion() - 1));
+}
+
+int main()
+{
+	testMapDiff<PersistentMap<int, int> >(5000, true);
+	testMapDiff<PersistentMap<int, int> >(100, true);
+	testMapDiff<PersistentMap<int, int, TreapVersion<int, int, AtomicRefCount, HeapAllocator, MerkleDigest> > >(5000, true);
+	testMapDiff<PersistentMap<int, int, BTreeVersion<int, int> > >(5000, true);
+	testMapDiff<PersistentMap<int, int, BTreeVersion<int, int> > >(200000, true);
+	testMapDiff<PersistentHashMap<int, int> >(5000, false);
+	testMapDiff<PersistentHashMap<int, int, CollidingHash> >(300, false);
+	testMapEquals<PersistentMap<int, int, TreapVersion<int, int, AtomicRefCount, HeapAllocator, MerkleDigest> > >();
+	testArrayDiff<PersistentArray<int> >();
+	testArrayDiff<PersistentArray<int, PersistentArrayVersion<int> > >();
+	testArrayDiff<PersistentArray<int, PersistentArrayVersion<int, AtomicRefCount, HeapAllocator, MerkleDigest> > >();
+	testArrayEquals<PersistentArray<int, PersistentArrayVersion<int, AtomicRefCount, HeapAllocator, MerkleDigest> > >();
+	return testResult("diff_test");
+}
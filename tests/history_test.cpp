@@ -0,0 +1,212 @@
+#include "check.h"
+#include "counting_allocator.h"
+#include "../persistent_array.h"
+#include "../persistent_map.h"
+#include <random>
+
+const int NUM_KEYS = 1000;
+const int NUM_CHANGES = 20000;
+const std::size_t MAX_BYTES = 64 * 1024;
+
+/*
+* Old versions are released once the nodes allocated by newer ones exceed the byte budget,
+* so the live nodes stay within the current version and the budget
+*/
+template<typename Map>
+void testMapByteBudget()
+{
+	{
+		Map map;
+		map.setHistoryEnabled(false);
+		for (int key = 0; key < NUM_KEYS; key++)
+		{
+			map.setValue(key, 0);
+		}
+		long numBytes = CountingAllocator::numBytes();
+
+		map.setHistoryEnabled(true);
+		HistoryLimit limit;
+		limit.m_maxBytes = MAX_BYTES;
+		map.setHistoryLimit(limit);
+
+		std::mt19937 random(1);
+		for (int i = 0; i < NUM_CHANGES; i++)
+		{
+			int key = random() % NUM_KEYS;
+			if (i % 2 == 0)
+				map.setValue(key, i);
+			else
+				map.insert(key, i);
+		}
+		CHECK(CountingAllocator::numBytes() <= numBytes + 2 * (long)MAX_BYTES);
+	}
+	CHECK(CountingAllocator::numNodes() == 0);
+}
+
+/*
+* Versions made by set operations count their nodes in the byte budget too
+*/
+template<typename Map>
+void testSetOperationBudget()
+{
+	{
+		Map map, evens, odds;
+		map.setHistoryEnabled(false);
+		for (int key = 0; key < NUM_KEYS; key++)
+		{
+			map.setValue(key, key);
+			(key % 2 == 0 ? evens : odds).setValue(key, -key);
+		}
+		long numBytes = CountingAllocator::numBytes();
+
+		map.setHistoryEnabled(true);
+		HistoryLimit limit;
+		limit.m_maxBytes = MAX_BYTES;
+		map.setHistoryLimit(limit);
+
+		for (int i = 0; i < NUM_CHANGES / 10; i++)
+		{
+			map.subtract(evens);
+			map.unite(evens);
+			map.intersect(odds);
+			map.unite(evens);
+		}
+		CHECK(CountingAllocator::numBytes() <= numBytes + 2 * (long)MAX_BYTES);
+	}
+	CHECK(CountingAllocator::numNodes() == 0);
+}
+
+/*
+* Versions made by sorted bulk inserts count their nodes in the byte budget too
+*/
+template<typename Map>
+void testBulkInsertBudget()
+{
+	{
+		Map map;
+		HistoryLimit limit;
+		limit.m_maxBytes = MAX_BYTES;
+		map.setHistoryLimit(limit);
+
+		std::vector<std::pair<int, int> > aPairs;
+		for (int key = 0; key < NUM_KEYS; key++)
+		{
+			aPairs.emplace_back(key, key);
+		}
+		map.insertSorted(aPairs.begin(), aPairs.end());
+		long numBytes = CountingAllocator::numBytes();
+
+		for (int i = 0; i < NUM_CHANGES / 100; i++)
+		{
+			for (auto& pair : aPairs)
+			{
+				pair.second = i;
+			}
+			map.insertSorted(aPairs.begin(), aPairs.end());
+		}
+		CHECK(CountingAllocator::numBytes() <= 2 * numBytes + 2 * (long)MAX_BYTES);
+	}
+	CHECK(CountingAllocator::numNodes() == 0);
+}
+
+/*
+* Set operations forked onto worker threads count the bytes of nodes the workers allocate,
+* so they measure as much as the same operations on a single thread
+*/
+template<typename Map>
+std::vector<std::size_t> setOperationBytes()
+{
+	const int numKeys = 100000;
+	Map first, second;
+	for (int key = 0; key < numKeys; key++)
+	{
+		first.setValue(2 * key, key);
+		second.setValue(3 * key, key);
+	}
+
+	std::vector<std::size_t> aNumBytes;
+	for (int i = 0; i < 3; i++)
+	{
+		Map map = first;
+		std::size_t numBytes = allocatedNodeBytes();
+		if (i == 0)
+			map.unite(second);
+		else if (i == 1)
+			map.intersect(second);
+		else
+			map.subtract(second);
+		aNumBytes.push_back(allocatedNodeBytes() - numBytes);
+	}
+	return aNumBytes;
+}
+
+void testParallelSetOperationBytes()
+{
+	ThreadPool::instance().setNumWorkers(3);
+	std::vector<std::size_t> aParallel = setOperationBytes<PersistentMap<int, int, TreapVersion<int, int, AtomicRefCount> > >();
+	std::vector<std::size_t> aSequential = setOperationBytes<PersistentMap<int, int, TreapVersion<int, int, PlainRefCount> > >();
+	CHECK(aParallel == aSequential);
+	CHECK(aParallel[0] > 0);
+}
+
+/*
+* Hash trie nodes hold their pairs and children in their own allocation, so the allocator sees all
+* of their memory and nothing more: the pairs, and a node header and the pointer from its parent per node
+*/
+void testHashTrieBytesPerKey()
+{
+	typedef HashTrieVersion<int, int, std::hash<int>, PlainRefCount, CountingAllocator> Version;
+	typedef PersistentMap<int, int, Version> Map;
+	{
+		Map map;
+		map.setHistoryEnabled(false);
+		std::mt19937 random(4);
+		for (int i = 0; i < 10 * NUM_KEYS; i++)
+		{
+			map.setValue(int(random()), i);
+		}
+		long numNodes = CountingAllocator::numNodes();
+		long numPairBytes = 10 * NUM_KEYS * (long)sizeof(std::pair<int, int>);
+		long numNodeBytes = numNodes * (long)sizeof(Version::Node) + (numNodes - 1) * (long)sizeof(Version::NodePtr);
+		CHECK(CountingAllocator::numBytes() == numPairBytes + numNodeBytes);
+	}
+	CHECK(CountingAllocator::numNodes() == 0);
+}
+
+template<typename Array>
+void testArrayByteBudget()
+{
+	{
+		Array array(NUM_KEYS, 0);
+		long numBytes = CountingAllocator::numBytes();
+
+		HistoryLimit limit;
+		limit.m_maxBytes = MAX_BYTES;
+		array.setHistoryLimit(limit);
+
+		std::mt19937 random(1);
+		for (int i = 0; i < NUM_CHANGES; i++)
+		{
+			array.setValue(random() % NUM_KEYS, i);
+		}
+		CHECK(CountingAllocator::numBytes() <= numBytes + 2 * (long)MAX_BYTES);
+	}
+	CHECK(CountingAllocator::numNodes() == 0);
+}
+
+int main()
+{
+	testMapByteBudget<PersistentMap<int, int, TreapVersion<int, int, PlainRefCount, CountingAllocator> > >();
+	testMapByteBudget<PersistentMap<int, int, BTreeVersion<int, int, PlainRefCount, CountingAllocator> > >();
+	testMapByteBudget<PersistentMap<int, int, HashTrieVersion<int, int, std::hash<int>, PlainRefCount, CountingAllocator> > >();
+	testSetOperationBudget<PersistentMap<int, int, TreapVersion<int, int, PlainRefCount, CountingAllocator> > >();
+	testSetOperationBudget<PersistentMap<int, int, BTreeVersion<int, int, PlainRefCount, CountingAllocator> > >();
+	testSetOperationBudget<PersistentMap<int, int, HashTrieVersion<int, int, std::hash<int>, PlainRefCount, CountingAllocator> > >();
+	testBulkInsertBudget<PersistentMap<int, int, TreapVersion<int, int, PlainRefCount, CountingAllocator> > >();
+	testBulkInsertBudget<PersistentMap<int, int, BTreeVersion<int, int, PlainRefCount, CountingAllocator> > >();
+	testParallelSetOperationBytes();
+	testHashTrieBytesPerKey();
+	testArrayByteBudget<PersistentArray<int, PersistentArrayVersion<int, PlainRefCount, CountingAllocator> > >();
+	testArrayByteBudget<PersistentArray<int, PersistentArrayTrieVersion<int, PlainRefCount, CountingAllocator> > >();
+	return testResult("history_test");
+}
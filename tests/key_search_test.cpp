@@ -0,0 +1,128 @@
+#include "check.h"
+#include "../persistent_map.h"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+/*
+* KeyBlockSearch picks its compare at compile time, so each path is tested by building this program
+* with the default flags (SSE2 on x86-64), with -msse4.2 (64-bit integers) and with -mavx2
+*/
+
+const int NUM_BLOCKS = 20000;
+const int NUM_KEYS = 5000;
+const int NUM_QUERIES = 20000;
+
+/*
+* Random key, half of them from a small range around zero so blocks and queries share keys,
+* the others from the whole range of the type to catch sign and width mistakes
+*/
+template<typename KeyType>
+KeyType randomKey(std::mt19937_64& random)
+{
+	bool isSmall = random() % 2 == 0;
+	if constexpr (std::is_floating_point<KeyType>::value)
+	{
+		if (isSmall)
+			return KeyType(int(random() % 64) - 32) / 4;
+		return KeyType((double(random()) / double(random.max()) - 0.5) * 1e12);
+	}
+	else
+	{
+		if (isSmall)
+			return KeyType(int(random() % 64) - (std::is_signed<KeyType>::value ? 32 : 0));
+		return KeyType(random());
+	}
+}
+
+/*
+* Counts in random ranges of random sorted blocks match std::lower_bound and std::upper_bound
+*/
+template<typename KeyType>
+void testBlockSearch()
+{
+	std::mt19937_64 random(1);
+	for (int i = 0; i < NUM_BLOCKS; i++)
+	{
+		KeyType aKeys[BTREE_WIDTH];
+		for (KeyType& key : aKeys)
+		{
+			key = randomKey<KeyType>(random);
+		}
+		int last = int(random() % (BTREE_WIDTH + 1));
+		int first = last == 0 ? 0 : int(random() % (last + 1));
+		// keys past last are left unsorted, like unused keys of a node
+		std::sort(aKeys + first, aKeys + last);
+
+		KeyType key = randomKey<KeyType>(random);
+		if (last > first && random() % 2 == 0)
+			key = aKeys[first + random() % (last - first)];
+
+		int lower = int(std::lower_bound(aKeys + first, aKeys + last, key) - (aKeys + first));
+		int upper = int(std::upper_bound(aKeys + first, aKeys + last, key) - (aKeys + first));
+		CHECK(KeyBlockSearch<KeyType>::count(aKeys, first, last, key, false) == lower);
+		CHECK(KeyBlockSearch<KeyType>::count(aKeys, first, last, key, true) == upper);
+	}
+}
+
+/*
+* lowerBound and upperBound of a B-tree map with random keys, some of them erased, match std::map
+*/
+template<typename KeyType>
+void testMapBounds()
+{
+	std::mt19937_64 random(2);
+	PersistentMap<KeyType, int, BTreeVersion<KeyType, int> > map;
+	map.setHistoryEnabled(false);
+	std::map<KeyType, int> expected;
+	for (int i = 0; i < NUM_KEYS; i++)
+	{
+		KeyType key = randomKey<KeyType>(random);
+		map.setValue(key, i);
+		expected[key] = i;
+	}
+	for (int i = 0; i < NUM_KEYS / 4; i++)
+	{
+		KeyType key = randomKey<KeyType>(random);
+		map.erase(key);
+		expected.erase(key);
+	}
+
+	for (int i = 0; i < NUM_QUERIES; i++)
+	{
+		KeyType key = randomKey<KeyType>(random);
+		auto it = map.lowerBound(key);
+		auto expectedIt = expected.lower_bound(key);
+		CHECK(it.done() == (expectedIt == expected.end()));
+		if (!it.done() && expectedIt != expected.end())
+			CHECK(it.key() == expectedIt->first && it.value() == expectedIt->second);
+
+		it = map.upperBound(key);
+		expectedIt = expected.upper_bound(key);
+		CHECK(it.done() == (expectedIt == expected.end()));
+		if (!it.done() && expectedIt != expected.end())
+			CHECK(it.key() == expectedIt->first && it.value() == expectedIt->second);
+	}
+}
+
+template<typename KeyType>
+void testKeyType()
+{
+	testBlockSearch<KeyType>();
+	testMapBounds<KeyType>();
+}
+
+int main()
+{
+	testKeyType<int>();
+	testKeyType<unsigned>();
+	testKeyType<std::int64_t>();
+	testKeyType<std::uint64_t>();
+	testKeyType<float>();
+	testKeyType<double>();
+	testKeyType<short>();
+	return testResult("key_search_test");
+}
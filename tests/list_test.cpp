@@ -0,0 +1,267 @@
+#include "check.h"
+#include "counting_allocator.h"
+#include "../persistent_list.h"
+#include <random>
+#include <vector>
+
+using List = PersistentList<int>;
+
+std::vector<int> read(List::PersistentListIteratorPtr pIter)
+{
+	std::vector<int> aValues;
+	for (; !pIter->done(); pIter->next())
+	{
+		aValues.push_back(pIter->getVal());
+	}
+	return aValues;
+}
+
+std::vector<int> readBackward(List& list, int size)
+{
+	std::vector<int> aValues(size);
+	auto pIter = list.end();
+	for (int i = size - 1; i >= 0; i--)
+	{
+		pIter->prev();
+		aValues[i] = pIter->getVal();
+	}
+	return aValues;
+}
+
+template<typename Editor>
+List::PersistentListIteratorPtr at(Editor& editor, int index)
+{
+	auto pIter = editor.begin();
+	for (int i = 0; i < index; i++)
+	{
+		pIter->next();
+	}
+	return pIter;
+}
+
+/*
+* Makes a random insert, erase or set through editor, the list or its transient, and the same change of aValues
+*/
+template<typename Editor>
+void change(Editor& editor, std::vector<int>& aValues, std::mt19937& random)
+{
+	int size = (int)aValues.size();
+	int operation = size == 0 ? 0 : random() % 3;
+	if (operation == 0)
+	{
+		int index = random() % (size + 1), value = random() % 100;
+		auto pIter = at(editor, index);
+		editor.insert(pIter, value);
+		aValues.insert(aValues.begin() + index, value);
+	}
+	else if (operation == 1)
+	{
+		int index = random() % size;
+		auto pIter = at(editor, index);
+		editor.erase(pIter);
+		aValues.erase(aValues.begin() + index);
+	}
+	else
+	{
+		int index = random() % size, value = random() % 100;
+		at(editor, index)->setVal(value);
+		aValues[index] = value;
+	}
+}
+
+/*
+* A node which becomes the head in place must not be the head of versions before that
+*/
+void testHeadOfOlderVersion()
+{
+	List list;
+	auto pIter = list.begin();
+	list.insert(pIter, 1);
+	pIter = list.end();
+	list.insert(pIter, 2);
+	pIter = list.begin();
+	list.erase(pIter);
+
+	CHECK(read(list.begin(2)) == std::vector<int>({ 1, 2 }));
+	CHECK(read(list.begin(3)) == std::vector<int>({ 2 }));
+	list.undo(1);
+	CHECK(read(list.begin()) == std::vector<int>({ 1, 2 }));
+	CHECK(readBackward(list, 2) == std::vector<int>({ 1, 2 }));
+}
+
+/*
+* Random inserts, erases, sets, undo, redo and transients compared with a full copy of every kept version
+* @param maxVersions - history limit of the list, 0 keeps all versions
+*/
+void testRandomVersions(int maxVersions)
+{
+	for (int seed = 0; seed < 300; seed++)
+	{
+		std::mt19937 random(seed);
+		List list;
+		HistoryLimit limit;
+		limit.m_maxVersions = maxVersions;
+		list.setHistoryLimit(limit);
+		std::vector<std::vector<int> > aVersions(1);
+		int curVersion = 0, lastVersion = 0, firstVersion = 0;
+		for (int step = 0; step < 60; step++)
+		{
+			std::vector<int> aValues = aVersions[curVersion];
+			int operation = random() % 10;
+			if (operation < 6)
+			{
+				change(list, aValues, random);
+			}
+			else if (operation < 7)
+			{
+				int numIter = 1 + random() % 3;
+				list.undo(numIter);
+				curVersion = std::max(firstVersion, curVersion - numIter);
+				continue;
+			}
+			else if (operation < 8)
+			{
+				int numIter = 1 + random() % 3;
+				list.redo(numIter);
+				curVersion = std::min(lastVersion, curVersion + numIter);
+				continue;
+			}
+			else
+			{
+				auto pTransient = list.beginTransient();
+				aVersions.resize(curVersion + 1);
+				lastVersion = curVersion;
+
+				int numChanges = 1 + random() % 5;
+				for (int i = 0; i < numChanges; i++)
+				{
+					change(*pTransient, aValues, random);
+				}
+				CHECK(read(pTransient->begin()) == aValues);
+				CHECK(read(list.begin()) == aVersions[curVersion]);
+				CHECK(list.lastVersion() == lastVersion + 1);
+
+				if (operation == 9)
+				{
+					pTransient.reset();
+					CHECK(read(list.begin()) == aVersions[curVersion]);
+					continue;
+				}
+				pTransient->commit();
+			}
+
+			aVersions.resize(curVersion + 1);
+			aVersions.push_back(aValues);
+			lastVersion = ++curVersion;
+			if (maxVersions > 0)
+				firstVersion = std::max(firstVersion, lastVersion - maxVersions + 1);
+
+			CHECK(list.lastVersion() == lastVersion + 1);
+			for (int version = firstVersion; version <= lastVersion; version++)
+			{
+				CHECK(read(list.begin(version)) == aVersions[version]);
+			}
+			CHECK(read(list.begin()) == aVersions[curVersion]);
+			CHECK(readBackward(list, (int)aVersions[curVersion].size()) == aVersions[curVersion]);
+		}
+	}
+}
+
+/*
+* Nodes created or copied by a transient are changed in place by its later changes
+*/
+void testTransientInPlace()
+{
+	PersistentList<int, PlainRefCount, CountingAllocator> list;
+	{
+		auto pTransient = list.beginTransient();
+		for (int i = 0; i < 1000; i++)
+		{
+			auto pIter = pTransient->end();
+			pTransient->insert(pIter, i);
+		}
+		for (auto pIter = pTransient->begin(); !pIter->done(); pIter->next())
+		{
+			pIter->setVal(pIter->getVal() * 2);
+		}
+		CHECK(CountingAllocator::numNodes() <= 1002);
+		CHECK(list.begin()->done());
+		pTransient->commit();
+	}
+
+	auto pIter = list.begin();
+	for (int i = 0; i < 1000; i++, pIter->next())
+	{
+		CHECK(pIter->getVal() == i * 2);
+	}
+	CHECK(pIter->done());
+	CHECK(list.lastVersion() == 2);
+}
+
+/*
+* Nodes which only released versions use are freed, and so are all nodes with the list
+*/
+void testReleasedNodes()
+{
+	{
+		PersistentList<int, PlainRefCount, CountingAllocator> list;
+		HistoryLimit limit;
+		limit.m_maxVersions = 5;
+		list.setHistoryLimit(limit);
+
+		for (int i = 0; i < 2000; i++)
+		{
+			auto pIter = list.end();
+			list.insert(pIter, i);
+		}
+		long numNodes = CountingAllocator::numNodes();
+
+		for (int i = 0; i < 20000; i++)
+		{
+			auto pIter = list.begin();
+			list.erase(pIter);
+			pIter = list.end();
+			list.insert(pIter, i);
+		}
+		CHECK(CountingAllocator::numNodes() < numNodes + 100);
+	}
+	CHECK(CountingAllocator::numNodes() == 0);
+}
+
+/*
+* The list limits only the number of versions, other limits are rejected instead of being ignored,
+* checked only where asserts don't stop the program
+*/
+void testUnsupportedLimit()
+{
+#ifdef NDEBUG
+	List list;
+	HistoryLimit limits[2];
+	limits[0].m_maxBytes = 1024;
+	limits[1].m_checkpointInterval = 10;
+	for (const HistoryLimit& limit : limits)
+	{
+		bool isThrown = false;
+		try
+		{
+			list.setHistoryLimit(limit);
+		}
+		catch (const std::exception&)
+		{
+			isThrown = true;
+		}
+		CHECK(isThrown);
+	}
+#endif
+}
+
+int main()
+{
+	testHeadOfOlderVersion();
+	testRandomVersions(0);
+	testRandomVersions(3);
+	testReleasedNodes();
+	testTransientInPlace();
+	testUnsupportedLimit();
+	return testResult("list_test");
+}
@@ -0,0 +1,424 @@
+#include "check.h"
+#include "../persistent_map.h"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <random>
+#include <vector>
+
+typedef PersistentMap<int, int, TreapVersion<int, int, AtomicRefCount, HeapAllocator, SubtreeSize> > SizedMap;
+
+template<typename Map>
+std::map<int, int> read(const Map& map, int version)
+{
+	std::map<int, int> contents;
+	for (auto it = map.begin(version); !it.done(); it.next())
+	{
+		contents[it.key()] = it.value();
+	}
+	return contents;
+}
+
+template<typename Map>
+std::map<int, int> read(const Map& map)
+{
+	std::map<int, int> contents;
+	for (auto it = map.begin(); !it.done(); it.next())
+	{
+		contents[it.key()] = it.value();
+	}
+	return contents;
+}
+
+/*
+* Map and its contents with numKeys random keys below maxKey, values are the keys plus offset
+*/
+template<typename Map>
+Map makeMap(int numKeys, int maxKey, int offset, bool isHistoryEnabled, std::mt19937& random, std::map<int, int>& expected)
+{
+	Map map;
+	map.setHistoryEnabled(isHistoryEnabled);
+	expected.clear();
+	for (int i = 0; i < numKeys; i++)
+	{
+		int key = random() % maxKey;
+		map.setValue(key, key + offset);
+		expected[key] = key + offset;
+	}
+	return map;
+}
+
+/*
+* Makes random setValue, insert and erase of keys below maxKey in map and the same changes of expected,
+* the treap doesn't take erase while it is empty
+*/
+template<typename Map>
+void change(Map& map, std::map<int, int>& expected, int numChanges, int maxKey, std::mt19937& random)
+{
+	for (int i = 0; i < numChanges; i++)
+	{
+		int key = random() % maxKey;
+		int value = random() % 1000;
+		switch (expected.empty() ? 1 : random() % 4)
+		{
+		case 0:
+			map.erase(key);
+			expected.erase(key);
+			break;
+		case 1:
+			map.insert(key, value);
+			expected[key] = value;
+			break;
+		default:
+			map.setValue(key, value);
+			expected[key] = value;
+		}
+	}
+}
+
+/*
+* Changes the map in rounds and passes each round's version and expected contents to check,
+* with history on the versions of all rounds are checked again at the end
+*/
+template<typename Map, typename Check>
+void checkRounds(bool isHistoryEnabled, int maxKey, const Check& check)
+{
+	Map map;
+	map.setHistoryEnabled(isHistoryEnabled);
+	check(map, map.lastVersion() - 1, std::map<int, int>());
+
+	std::mt19937 random(3);
+	std::map<int, int> expected;
+	std::vector<std::pair<int, std::map<int, int> > > aRounds;
+	for (int round = 0; round < 20; round++)
+	{
+		change(map, expected, round < 10 ? 3 * round : 200, maxKey, random);
+		aRounds.emplace_back(map.lastVersion() - 1, expected);
+		check(map, map.lastVersion() - 1, expected);
+	}
+
+	if (isHistoryEnabled)
+	{
+		for (const auto& round : aRounds)
+		{
+			check(map, round.first, round.second);
+		}
+	}
+}
+
+/*
+* Changes of a transient become one version on commit and none if it is dropped,
+* with history off commit replaces the current version
+*/
+template<typename Map>
+void testTransient()
+{
+	Map map;
+	map.setValue(1, 1);
+	{
+		auto pTransient = map.beginTransient();
+		pTransient->setValue(2, 2);
+		pTransient->erase(1);
+		int value = 0;
+		CHECK(map.find(1, value) && !map.find(2, value));
+		pTransient->commit();
+	}
+	CHECK(map.lastVersion() == 3);
+	CHECK((read(map, 2) == std::map<int, int>{ { 2, 2 } }));
+
+	{
+		auto pTransient = map.beginTransient();
+		pTransient->setValue(3, 3);
+	}
+	CHECK(map.lastVersion() == 3 && read(map, 2).size() == 1);
+	map.setValue(4, 4);
+	CHECK(map.lastVersion() == 4);
+
+	map.setHistoryEnabled(false);
+	{
+		auto pTransient = map.beginTransient();
+		pTransient->setValue(5, 5);
+		pTransient->commit();
+	}
+	CHECK(map.lastVersion() == 4);
+	CHECK((read(map, 3) == std::map<int, int>{ { 2, 2 }, { 4, 4 }, { 5, 5 } }));
+	CHECK(read(map, 2).size() == 1);
+
+#ifdef NDEBUG
+	// while a transient is open the map can't be changed, checked only where asserts don't stop the program
+	auto pTransient = map.beginTransient();
+	bool isThrown = false;
+	try
+	{
+		map.setValue(1, 10);
+	}
+	catch (const std::exception&)
+	{
+		isThrown = true;
+	}
+	CHECK(isThrown);
+	pTransient->commit();
+	CHECK(read(map, 3).size() == 3);
+#endif
+}
+
+/*
+* Set operations match std::map for empty, small and large operands, which are forked onto threads,
+* and leave the other map and copies sharing the nodes of the changed one as they were
+*/
+template<typename Map>
+void testSetOperations(bool isHistoryEnabled)
+{
+	std::mt19937 random(7);
+	const int aSizes[] = { 0, 1, 50, 40000 };
+	for (int firstSize : aSizes)
+	{
+		for (int secondSize : aSizes)
+		{
+			int maxKey = 2 * std::max(1, std::max(firstSize, secondSize));
+			std::map<int, int> first, second;
+			Map firstMap = makeMap<Map>(firstSize, maxKey, 0, isHistoryEnabled, random, first);
+			Map secondMap = makeMap<Map>(secondSize, maxKey, maxKey, isHistoryEnabled, random, second);
+
+			std::map<int, int> united = first, intersected, subtracted;
+			for (const auto& element : second)
+			{
+				united.insert(element);
+			}
+			for (const auto& element : first)
+			{
+				(second.count(element.first) != 0 ? intersected : subtracted).insert(element);
+			}
+
+			Map map = firstMap;
+			map.unite(secondMap);
+			CHECK(read(map) == united);
+			map = firstMap;
+			map.intersect(secondMap);
+			CHECK(read(map) == intersected);
+			map = firstMap;
+			map.subtract(secondMap);
+			CHECK(read(map) == subtracted);
+			CHECK(read(firstMap) == first && read(secondMap) == second);
+
+			// operands sharing all nodes
+			map = firstMap;
+			map.unite(firstMap);
+			CHECK(read(map) == first);
+			map.intersect(firstMap);
+			CHECK(read(map) == first);
+			map.subtract(firstMap);
+			CHECK(read(map).empty() && read(firstMap) == first);
+		}
+	}
+}
+
+template<typename Map>
+void testSetOperations()
+{
+	testSetOperations<Map>(true);
+	testSetOperations<Map>(false);
+}
+
+/*
+* kth, rank and countRange match positions of keys in std::map, also for keys and ranges outside the map
+*/
+void testOrderStatistics(bool isHistoryEnabled)
+{
+	const int maxKey = 500;
+	checkRounds<SizedMap>(isHistoryEnabled, maxKey, [](const SizedMap& map, int version, const std::map<int, int>& expected)
+	{
+		std::vector<int> aKeys;
+		for (const auto& element : expected)
+		{
+			aKeys.push_back(element.first);
+		}
+
+		CHECK(map.size(version) == (int)aKeys.size());
+		for (int i = 0; i < (int)aKeys.size(); i++)
+		{
+			auto it = map.kth(version, i);
+			CHECK(!it.done() && it.key() == aKeys[i] && it.value() == expected.at(aKeys[i]));
+		}
+
+		auto rank = [&aKeys](int key) { return int(std::lower_bound(aKeys.begin(), aKeys.end(), key) - aKeys.begin()); };
+		for (int key = -2; key < maxKey + 2; key++)
+		{
+			CHECK(map.rank(version, key) == rank(key));
+		}
+		for (int lo = -2; lo < maxKey + 2; lo += 7)
+		{
+			for (int hi = lo - 3; hi < maxKey + 2; hi += 11)
+			{
+				CHECK(map.countRange(version, lo, hi) == std::max(0, rank(hi) - rank(lo)));
+			}
+		}
+	});
+}
+
+/*
+* Hash of values in the order they are combined, combine isn't commutative, so it catches values combined out of order
+*/
+struct PolynomialMonoid
+{
+	using Type = std::pair<std::uint64_t, std::uint64_t>;
+	static constexpr std::uint64_t BASE = 1000003;
+
+	static Type identity()
+	{
+		return Type(0, 1);
+	}
+
+	static Type lift(int value)
+	{
+		return Type(std::uint64_t(value), BASE);
+	}
+
+	static Type combine(const Type& left, const Type& right)
+	{
+		return Type(left.first * right.second + right.first, left.second * right.second);
+	}
+};
+
+/*
+* aggregate matches values of std::map combined in ascending order of keys, identity for empty ranges
+*/
+template<typename Monoid>
+void testAggregate(bool isHistoryEnabled)
+{
+	typedef PersistentMap<int, int, TreapVersion<int, int, AtomicRefCount, HeapAllocator, MonoidAggregate<Monoid> > > Map;
+	const int maxKey = 500;
+	checkRounds<Map>(isHistoryEnabled, maxKey, [](const Map& map, int version, const std::map<int, int>& expected)
+	{
+		for (int lo = -2; lo < maxKey + 2; lo += 7)
+		{
+			for (int hi = lo - 3; hi < maxKey + 2; hi += 11)
+			{
+				typename Monoid::Type aggregate = Monoid::identity();
+				for (auto it = expected.lower_bound(lo); it != expected.end() && it->first < hi; ++it)
+				{
+					aggregate = Monoid::combine(aggregate, Monoid::lift(it->second));
+				}
+				CHECK(map.aggregate(version, lo, hi) == aggregate);
+			}
+		}
+	});
+}
+
+template<typename Monoid>
+void testAggregate()
+{
+	testAggregate<Monoid>(true);
+	testAggregate<Monoid>(false);
+}
+
+/*
+* Finger lookups of ascending, descending, repeated and random keys match std::map
+*/
+template<typename Finger>
+void checkFinger(Finger& finger, const std::map<int, int>& expected, int maxKey, std::mt19937& random)
+{
+	std::vector<int> aKeys;
+	for (int key = -2; key < maxKey + 2; key++)
+	{
+		aKeys.push_back(key);
+	}
+	for (int key = maxKey + 2; key >= -2; key -= 3)
+	{
+		aKeys.push_back(key);
+		aKeys.push_back(key);
+	}
+	for (int i = 0; i < maxKey; i++)
+	{
+		aKeys.push_back(int(random() % (maxKey + 4)) - 2);
+	}
+
+	for (int key : aKeys)
+	{
+		int value = -1;
+		bool isFound = finger.find(key, value);
+		auto it = expected.find(key);
+		CHECK(isFound == (it != expected.end()));
+		if (isFound && it != expected.end())
+			CHECK(value == it->second);
+	}
+}
+
+/*
+* A finger finds keys of its version, also after the map changes, in place too while history is off
+*/
+void testFinger(bool isHistoryEnabled)
+{
+	typedef PersistentMap<int, int> Map;
+	const int maxKey = 500;
+	std::mt19937 random(9);
+	checkRounds<Map>(isHistoryEnabled, maxKey, [&random](const Map& map, int version, const std::map<int, int>& expected)
+	{
+		auto finger = map.finger(version);
+		checkFinger(finger, expected, maxKey, random);
+	});
+
+	Map map;
+	map.setHistoryEnabled(isHistoryEnabled);
+	std::map<int, int> expected, changed;
+	change(map, expected, 300, maxKey, random);
+	auto finger = map.finger();
+	changed = expected;
+	change(map, changed, 300, maxKey, random);
+	checkFinger(finger, expected, maxKey, random);
+}
+
+/*
+* findMany matches find for no keys, fewer keys than lanes and more, with missing and repeated keys,
+* in the current and older versions, also while history is off
+*/
+void testFindMany(bool isHistoryEnabled)
+{
+	typedef PersistentMap<int, int> Map;
+	const int maxKey = 500;
+	std::mt19937 random(10);
+	checkRounds<Map>(isHistoryEnabled, maxKey, [&random](const Map& map, int version, const std::map<int, int>& expected)
+	{
+		for (int numKeys : { 0, 1, 5, 15, 16, 17, 100, 2000 })
+		{
+			std::vector<int> aKeys;
+			for (int i = 0; i < numKeys; i++)
+			{
+				aKeys.push_back(int(random() % (maxKey + 4)) - 2);
+			}
+
+			// values left from an earlier call are replaced
+			std::vector<std::optional<int> > aValues(3, 7);
+			map.findMany(version, aKeys, aValues);
+			CHECK(aValues.size() == aKeys.size());
+			for (int i = 0; i < (int)aKeys.size() && i < (int)aValues.size(); i++)
+			{
+				auto it = expected.find(aKeys[i]);
+				CHECK(aValues[i] == (it != expected.end() ? std::optional<int>(it->second) : std::nullopt));
+			}
+		}
+	});
+}
+
+int main()
+{
+	testTransient<PersistentMap<int, int> >();
+	testTransient<PersistentMap<int, int, BTreeVersion<int, int> > >();
+	testTransient<PersistentHashMap<int, int> >();
+	testOrderStatistics(true);
+	testOrderStatistics(false);
+	testAggregate<SumMonoid<int> >();
+	testAggregate<MinMonoid<int> >();
+	testAggregate<PolynomialMonoid>();
+	testFinger(true);
+	testFinger(false);
+	testFindMany(true);
+	testFindMany(false);
+	ThreadPool::instance().setNumWorkers(3);
+	testSetOperations<PersistentMap<int, int> >();
+	testSetOperations<SizedMap>();
+	testSetOperations<PersistentMap<int, int, BTreeVersion<int, int> > >();
+	testSetOperations<PersistentHashMap<int, int> >();
+	return testResult("map_test");
+}
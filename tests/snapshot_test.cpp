@@ -0,0 +1,113 @@
+#include "check.h"
+#include "../persistent_map.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/*
+* A writer publishes snapshots while readers check that each one holds exactly the contents of one version.
+* Build it with -fsanitize=thread too, e.g.
+*     g++ -std=c++17 -O1 -g -fsanitize=thread -I. tests/snapshot_test.cpp -pthread
+*/
+
+const int NUM_KEYS = 64;
+const int NUM_CHANGES = 20000;
+const int NUM_READERS = 4;
+// holds the number of changes made, so a snapshot tells which state it should hold without history too
+const int COUNTER_KEY = -1;
+
+/*
+* Change i sets key i % NUM_KEYS to i, or erases it if it is even in odd rounds
+*/
+bool isErase(int change)
+{
+	return (change / NUM_KEYS) % 2 == 1 && (change % NUM_KEYS) % 2 == 0;
+}
+
+/*
+* Gets value of key after numChanges changes, -1 if the key is missing
+*/
+int expectedValue(int key, int numChanges)
+{
+	if (key >= numChanges)
+		return -1;
+
+	int change = key + (numChanges - 1 - key) / NUM_KEYS * NUM_KEYS;
+	return isErase(change) ? -1 : change;
+}
+
+template<typename Map>
+void testSnapshots(bool isHistoryEnabled)
+{
+	Map map;
+	map.setHistoryEnabled(isHistoryEnabled);
+	HistoryLimit limit;
+	limit.m_maxVersions = 8;
+	map.setHistoryLimit(limit);
+	map.setSnapshotsEnabled(true);
+
+	std::atomic<bool> isDone(false);
+	std::atomic<int> numErrors(0), numReads(0);
+	std::vector<std::thread> aReaders;
+	for (int i = 0; i < NUM_READERS; i++)
+	{
+		aReaders.emplace_back([&]()
+		{
+			while (!isDone.load())
+			{
+				auto pSnapshot = map.snapshot();
+				int numChanges = 0;
+				pSnapshot->find(COUNTER_KEY, numChanges);
+				bool isCorrect = !isHistoryEnabled || pSnapshot->version() == numChanges;
+				for (int key = 0; key < NUM_KEYS; key++)
+				{
+					int value = -1;
+					pSnapshot->find(key, value);
+					isCorrect = isCorrect && value == expectedValue(key, numChanges);
+				}
+				if (!isCorrect)
+					numErrors++;
+				numReads++;
+			}
+		});
+	}
+
+	for (int i = 0; i < NUM_CHANGES; i++)
+	{
+		// the change and the counter are published together
+		auto pTransient = map.beginTransient();
+		if (isErase(i))
+			pTransient->erase(i % NUM_KEYS);
+		else
+			pTransient->setValue(i % NUM_KEYS, i);
+		pTransient->setValue(COUNTER_KEY, i + 1);
+		pTransient->commit();
+	}
+	isDone.store(true);
+	for (auto& reader : aReaders)
+	{
+		reader.join();
+	}
+
+	CHECK(numErrors.load() == 0);
+	CHECK(numReads.load() > 0);
+	int value = 0;
+	CHECK(map.snapshot()->find(COUNTER_KEY, value) && value == NUM_CHANGES);
+	map.setSnapshotsEnabled(false);
+	CHECK(map.snapshot() == nullptr);
+}
+
+template<typename Map>
+void testMap()
+{
+	testSnapshots<Map>(true);
+	testSnapshots<Map>(false);
+}
+
+int main()
+{
+	testMap<PersistentMap<int, int> >();
+	testMap<PersistentMap<int, int, BTreeVersion<int, int> > >();
+	testMap<PersistentHashMap<int, int> >();
+	return testResult("snapshot_test");
+}
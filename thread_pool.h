@@ -0,0 +1,200 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "node_allocator.h"
+
+/*
+* Process-wide pool of worker threads for fork-join parallelism, started on first use with a worker
+* per hardware thread but one, the forking thread makes the last one. A thread waiting for a forked
+* task runs queued tasks meanwhile, so nested forks can't deadlock when all workers are waiting too.
+*/
+class ThreadPool
+{
+public:
+	static ThreadPool& instance()
+	{
+		static ThreadPool s_pool;
+		return s_pool;
+	}
+
+	/*
+	* Runs left on a worker and right on the calling thread, returns when both are done.
+	* Bytes of nodes allocated by left are added to allocatedNodeBytes() of the calling thread,
+	* so containers measure versions built in parallel like the ones built by a single thread
+	*/
+	template<typename LeftTask, typename RightTask>
+	void forkJoin(const LeftTask& left, const RightTask& right)
+	{
+		Task task(std::cref(left));
+		push(task);
+		try
+		{
+			right();
+		}
+		catch (...)
+		{
+			join(task);
+			throw;
+		}
+
+		join(task);
+		allocatedNodeBytes() += task.m_numBytes;
+		if (task.m_pException != nullptr)
+			std::rethrow_exception(task.m_pException);
+	}
+
+	/*
+	* Gets number of nested fork levels which give each thread a task, log2 of the number of threads
+	*/
+	int maxForkDepth() const
+	{
+		return m_maxForkDepth;
+	}
+
+	/*
+	* Replaces workers by numWorkers new ones, e.g. to use more threads than hardware threads in tests.
+	* Must not be called while tasks run
+	*/
+	void setNumWorkers(unsigned numWorkers)
+	{
+		stop();
+		start(numWorkers);
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		stop();
+	}
+
+private:
+	struct Task
+	{
+		explicit Task(std::function<void()> function) :
+			m_function(std::move(function))
+		{}
+
+		std::function<void()> m_function;
+		std::exception_ptr m_pException;
+		std::size_t m_numBytes = 0;
+		bool m_isDone = false;
+	};
+
+	ThreadPool()
+	{
+		start(std::max(1u, std::thread::hardware_concurrency()) - 1);
+	}
+
+	void start(unsigned numWorkers)
+	{
+		m_maxForkDepth = 0;
+		while ((1u << m_maxForkDepth) < numWorkers + 1)
+		{
+			m_maxForkDepth++;
+		}
+
+		m_isStopping = false;
+		for (unsigned i = 0; i < numWorkers; i++)
+		{
+			m_aWorkers.emplace_back([this]() { work(); });
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_isStopping = true;
+		}
+		m_changed.notify_all();
+
+		for (auto& worker : m_aWorkers)
+		{
+			worker.join();
+		}
+		m_aWorkers.clear();
+	}
+
+	void push(Task& task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_apTasks.push_back(&task);
+		}
+		m_changed.notify_all();
+	}
+
+	void join(Task& task)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!task.m_isDone)
+		{
+			if (m_apTasks.empty())
+			{
+				m_changed.wait(lock);
+				continue;
+			}
+
+			Task* pTask = m_apTasks.back();
+			m_apTasks.pop_back();
+			lock.unlock();
+			run(*pTask);
+			lock.lock();
+		}
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_changed.wait(lock, [this]() { return m_isStopping || !m_apTasks.empty(); });
+			if (m_apTasks.empty())
+				return;
+
+			Task* pTask = m_apTasks.back();
+			m_apTasks.pop_back();
+			lock.unlock();
+			run(*pTask);
+			lock.lock();
+		}
+	}
+
+	/*
+	* Runs task on the current thread, its bytes are taken out of the thread's counter and passed to the forking one
+	*/
+	void run(Task& task)
+	{
+		std::size_t numBytes = allocatedNodeBytes();
+		try
+		{
+			task.m_function();
+		}
+		catch (...)
+		{
+			task.m_pException = std::current_exception();
+		}
+		task.m_numBytes = allocatedNodeBytes() - numBytes;
+		allocatedNodeBytes() = numBytes;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			task.m_isDone = true;
+		}
+		m_changed.notify_all();
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	std::vector<Task*> m_apTasks;
+	std::vector<std::thread> m_aWorkers;
+	int m_maxForkDepth = 0;
+	bool m_isStopping = false;
+};
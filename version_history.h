@@ -0,0 +1,159 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <iterator>
+
+/*
+* Retention policy of container history, zero fields mean no limit
+*/
+struct HistoryLimit
+{
+	// number of latest versions to keep
+	int m_maxVersions = 0;
+	// estimated bytes of nodes held by the kept versions on top of the oldest one
+	std::size_t m_maxBytes = 0;
+	// versions with number divisible by the interval are kept as checkpoints after being pruned
+	int m_checkpointInterval = 0;
+};
+
+/*
+* Versions of a container indexed by their numbers. Versions over the limit are released
+* oldest first, except for the current one and checkpoints, numbers of other versions don't change
+*/
+template<typename VersionType>
+class VersionHistory
+{
+public:
+	VersionHistory() :
+		m_firstVersion(0),
+		m_numBytes(0)
+	{}
+
+	void setLimit(const HistoryLimit& limit)
+	{
+		m_limit = limit;
+	}
+
+	VersionType& operator[](int version)
+	{
+		if (version >= m_firstVersion)
+			return m_aEntries[version - m_firstVersion].m_version;
+
+		return m_checkpoints.at(version);
+	}
+
+	const VersionType& operator[](int version) const
+	{
+		if (version >= m_firstVersion)
+			return m_aEntries[version - m_firstVersion].m_version;
+
+		return m_checkpoints.at(version);
+	}
+
+	/**
+	* Checks if version is kept
+	* @param version - number of version not newer than the last one
+	*/
+	bool contains(int version) const
+	{
+		return version >= m_firstVersion || m_checkpoints.count(version) != 0;
+	}
+
+	/**
+	* Gets the newest kept version not newer than version, or the oldest kept version
+	* @param version - number of version not newer than the last one
+	*/
+	int nearest(int version) const
+	{
+		if (version >= m_firstVersion)
+			return version;
+
+		auto it = m_checkpoints.upper_bound(version);
+		if (it != m_checkpoints.begin())
+			return std::prev(it)->first;
+
+		return m_checkpoints.empty() ? m_firstVersion : m_checkpoints.begin()->first;
+	}
+
+	/**
+	* Gets the oldest kept version newer than version
+	* @param version - number of version older than the last one
+	*/
+	int next(int version) const
+	{
+		if (version + 1 >= m_firstVersion)
+			return version + 1;
+
+		auto it = m_checkpoints.upper_bound(version);
+		return it != m_checkpoints.end() ? it->first : m_firstVersion;
+	}
+
+	/**
+	* Adds version with the number following the last one
+	* @param version
+	* @param numBytes - bytes of nodes allocated for the version
+	*/
+	void push(const VersionType& version, std::size_t numBytes)
+	{
+		if (!m_aEntries.empty())
+			m_numBytes += numBytes;
+		m_aEntries.push_back(Entry{ version, numBytes });
+	}
+
+	/**
+	* Releases versions newer than lastVersion
+	*/
+	void truncate(int lastVersion)
+	{
+		while (!m_aEntries.empty() && m_firstVersion + (int)m_aEntries.size() - 1 > lastVersion)
+		{
+			if (m_aEntries.size() > 1)
+				m_numBytes -= m_aEntries.back().m_numBytes;
+			m_aEntries.pop_back();
+		}
+
+		m_checkpoints.erase(m_checkpoints.upper_bound(lastVersion), m_checkpoints.end());
+		if (m_aEntries.empty())
+		{
+			m_firstVersion = lastVersion + 1;
+			m_numBytes = 0;
+		}
+	}
+
+	/**
+	* Releases the oldest versions until the limit is met, curVersion is never released
+	*/
+	void prune(int curVersion)
+	{
+		while (m_aEntries.size() > 1 && m_firstVersion != curVersion && isOverLimit())
+		{
+			if (m_limit.m_checkpointInterval > 0 && m_firstVersion % m_limit.m_checkpointInterval == 0)
+				m_checkpoints[m_firstVersion] = m_aEntries.front().m_version;
+
+			m_aEntries.pop_front();
+			m_numBytes -= m_aEntries.front().m_numBytes;
+			m_firstVersion++;
+		}
+	}
+
+private:
+	struct Entry
+	{
+		VersionType m_version;
+		std::size_t m_numBytes;
+	};
+
+	bool isOverLimit() const
+	{
+		return (m_limit.m_maxVersions > 0 && (int)m_aEntries.size() > m_limit.m_maxVersions)
+			|| (m_limit.m_maxBytes > 0 && m_numBytes > m_limit.m_maxBytes);
+	}
+
+	HistoryLimit m_limit;
+	std::deque<Entry> m_aEntries;
+	std::map<int, VersionType> m_checkpoints;
+	int m_firstVersion;
+	std::size_t m_numBytes;
+};